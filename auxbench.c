@@ -0,0 +1,181 @@
+/*****************************************************************************
+ * auxbench.c: measure the time taken by lookups in an aux file
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ * $Id$
+ *
+ * Authors: Christophe Massiot <massiot@via.ecp.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "util.h"
+
+/* A 10 Mbit/s stream in chunks of 7 TS packets, with a 10 s hole every
+ * 1000000 chunks so that the STCs aren't exactly linear */
+#define BENCH_START UINT64_C(97200000000) /* 1 hour */
+#define BENCH_PERIOD 28426
+#define BENCH_JITTER 2000
+#define BENCH_HOLE_CHUNKS 1000000
+#define BENCH_HOLE UINT64_C(270000000)
+#define BENCH_LOOKUPS 1000
+
+/*****************************************************************************
+ * Generate: write a synthetic aux file
+ *****************************************************************************/
+static bool Generate( const char *psz_aux, off_t i_nb_chunks )
+{
+    aux_file_t *p_aux = OpenAuxFile( psz_aux, false, false );
+    uint64_t i_stc = BENCH_START;
+    off_t i;
+
+    if ( p_aux == NULL )
+        return false;
+
+    for ( i = 0; i < i_nb_chunks; i++ )
+    {
+        i_stc += BENCH_PERIOD - BENCH_JITTER / 2 + rand() % BENCH_JITTER;
+        if ( i && !(i % BENCH_HOLE_CHUNKS) )
+            i_stc += BENCH_HOLE;
+        if ( !WriteAuxFile( p_aux, i_stc ) )
+        {
+            msg_Err( NULL, "couldn't write to %s (%s)", psz_aux,
+                     strerror(errno) );
+            CloseAuxFile( p_aux );
+            return false;
+        }
+    }
+    CloseAuxFile( p_aux );
+    return true;
+}
+
+/*****************************************************************************
+ * Evict: drop the aux file from the page cache, to measure cold lookups
+ *****************************************************************************/
+static void Evict( const char *psz_aux )
+{
+    int i_fd = open( psz_aux, O_RDONLY );
+    if ( i_fd == -1 )
+        return;
+    posix_fadvise( i_fd, 0, 0, POSIX_FADV_DONTNEED );
+    close( i_fd );
+}
+
+/*****************************************************************************
+ * Check: the result is the first chunk at or after the wanted STC
+ *****************************************************************************/
+static bool Check( aux_file_t *p_aux, off_t i_nb_chunks, off_t i_chunk,
+                   uint64_t i_wanted )
+{
+    uint64_t i_stc;
+
+    if ( i_chunk < 1 || i_chunk > i_nb_chunks )
+        return false;
+    if ( SeekAuxFile( p_aux, i_chunk - 1 ) < 0
+          || !ReadAuxFile( p_aux, &i_stc ) || i_stc >= i_wanted )
+        return false;
+    return i_chunk == i_nb_chunks
+            || (ReadAuxFile( p_aux, &i_stc ) && i_stc >= i_wanted);
+}
+
+/*****************************************************************************
+ * Entry point
+ *****************************************************************************/
+int main( int i_argc, char **pp_argv )
+{
+    aux_file_t *p_aux;
+    off_t i_nb_chunks;
+    uint64_t i_first, i_last, pi_time[2] = { 0, 0 };
+    unsigned int i_lookups = BENCH_LOOKUPS, i_errors = 0, i, j;
+
+    if ( i_argc > 1 && !strcmp( pp_argv[1], "-A" ) )
+    {
+        i_aux_version = 2;
+        i_argc--;
+        pp_argv++;
+    }
+
+    if ( i_argc < 2 || i_argc > 4 )
+    {
+        msg_Err( NULL, "Usage: auxbench [-A] <aux file> [<chunks to generate> [<lookups>]]" );
+        exit(EXIT_FAILURE);
+    }
+
+    if ( i_argc > 2 )
+    {
+        srand( 0 );
+        if ( !Generate( pp_argv[1], strtoll( pp_argv[2], NULL, 0 ) ) )
+            exit(EXIT_FAILURE);
+    }
+    if ( i_argc > 3 )
+        i_lookups = strtoul( pp_argv[3], NULL, 0 );
+
+    p_aux = OpenAuxFile( pp_argv[1], true, false );
+    if ( p_aux == NULL )
+        exit(EXIT_FAILURE);
+    i_nb_chunks = CountAuxFile( p_aux );
+    if ( i_nb_chunks < 2 || SeekAuxFile( p_aux, 0 ) < 0
+          || !ReadAuxFile( p_aux, &i_first )
+          || SeekAuxFile( p_aux, i_nb_chunks - 1 ) < 0
+          || !ReadAuxFile( p_aux, &i_last ) || i_last <= i_first )
+    {
+        msg_Err( NULL, "not enough chunks in %s", pp_argv[1] );
+        exit(EXIT_FAILURE);
+    }
+
+    /* Each lookup is done from a cold cache, then again from a warm one */
+    srand( 1 );
+    for ( i = 0; i < i_lookups; i++ )
+    {
+        uint64_t i_wanted = i_first + 1
+            + (uint64_t)((double)rand() / RAND_MAX * (i_last - i_first - 1));
+        off_t i_ret = 0;
+
+        Evict( pp_argv[1] );
+        for ( j = 0; j < 2; j++ )
+        {
+            uint64_t i_start = real_Date();
+            i_ret = LookupAuxFile( pp_argv[1], i_wanted, true );
+            pi_time[j] += real_Date() - i_start;
+        }
+
+        if ( !Check( p_aux, i_nb_chunks, i_ret, i_wanted ) )
+        {
+            msg_Err( NULL, "wrong chunk %jd for STC %"PRIu64, (intmax_t)i_ret,
+                     i_wanted );
+            i_errors++;
+        }
+    }
+    CloseAuxFile( p_aux );
+
+    printf( "%jd chunks, %u lookups, cold %.1f us, warm %.1f us, %u errors\n",
+            (intmax_t)i_nb_chunks, i_lookups,
+            (double)pi_time[0] / i_lookups / 27,
+            (double)pi_time[1] / i_lookups / 27, i_errors );
+
+    exit(i_errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,98 @@
+/*****************************************************************************
+ * auxconv.c: convert aux files between version 1 and version 2
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ * $Id$
+ *
+ * Authors: Christophe Massiot <massiot@via.ecp.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "util.h"
+
+static void usage(void)
+{
+    msg_Raw( NULL, "Usage: auxconv [-V <version>] <input aux> <output aux>" );
+    msg_Raw( NULL, "    -V: version of the output aux file (1 or 2, default 2)" );
+    exit(EXIT_FAILURE);
+}
+
+/*****************************************************************************
+ * Entry point
+ *****************************************************************************/
+int main( int i_argc, char **pp_argv )
+{
+    aux_file_t *p_input_aux, *p_output_aux;
+    uint64_t i_stc;
+    off_t i_nb_chunks = 0;
+    int c;
+
+    i_aux_version = 2;
+
+    while ( (c = getopt( i_argc, pp_argv, "V:h" )) != -1 )
+    {
+        switch ( c )
+        {
+        case 'V':
+            i_aux_version = strtol( optarg, NULL, 0 );
+            if ( i_aux_version != 1 && i_aux_version != 2 )
+                usage();
+            break;
+
+        case 'h':
+        default:
+            usage();
+            break;
+        }
+    }
+    if ( optind != i_argc - 2 )
+        usage();
+
+    if ( !strcmp( pp_argv[optind], pp_argv[optind + 1] ) )
+    {
+        msg_Err( NULL, "input and output must be different files" );
+        exit(EXIT_FAILURE);
+    }
+
+    p_input_aux = OpenAuxFile( pp_argv[optind], true, false );
+    p_output_aux = OpenAuxFile( pp_argv[optind + 1], false, false );
+
+    while ( ReadAuxFile( p_input_aux, &i_stc ) )
+    {
+        if ( !WriteAuxFile( p_output_aux, i_stc ) )
+        {
+            msg_Err( NULL, "couldn't write to auxiliary file" );
+            exit(EXIT_FAILURE);
+        }
+        i_nb_chunks++;
+    }
+
+    CloseAuxFile( p_input_aux );
+    CloseAuxFile( p_output_aux );
+
+    msg_Dbg( NULL, "converted %jd chunks", (intmax_t)i_nb_chunks );
+    exit(EXIT_SUCCESS);
+}
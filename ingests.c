@@ -48,7 +48,14 @@ static uint16_t i_pcr_pid = 0;
 static size_t i_ts_in_payload = DEFAULT_PAYLOAD_SIZE / TS_SIZE;
 
 static int i_fd;
-static FILE *p_output_aux;
+static aux_file_t *p_output_aux;
+static int i_container_fd = -1;
+static off_t i_container_chunk = 0;
+/* packets read, waiting for their chunk to be dated */
+static uint8_t *p_pending = NULL;
+static size_t i_pending_start = 0, i_pending_end = 0, i_pending_max = 0;
+static bool b_pending_stc = false;
+static uint64_t i_pending_stc;
 static int i_ts_read = 0;
 
 static bool b_init = true;
@@ -60,35 +67,118 @@ static uint64_t i_last_stc = 0;
 
 static void usage(void)
 {
-    msg_Raw( NULL, "Usage: ingests [-l <syslogtag>] -p <PCR PID> [-m <payload size>] <input ts>" );
+    msg_Raw( NULL, "Usage: ingests [-l <syslogtag>] -p <PCR PID> [-m <payload size>] [-A] [-c <container>] <input ts>" );
+    msg_Raw( NULL, "    -A: write a compact (version 2) auxiliary file" );
+    msg_Raw( NULL, "    -c: write a self-timed container instead of an auxiliary file" );
     exit(EXIT_FAILURE);
 }
 
+/*****************************************************************************
+ * WriteChunk: write the first pending payload to the container
+ *****************************************************************************/
+static bool WriteChunk( uint64_t i_stc )
+{
+    size_t i_payload_size = i_ts_in_payload * TS_SIZE;
+
+    if ( WriteContainer( i_container_fd, i_container_chunk, i_stc,
+                         p_pending + i_pending_start, i_payload_size ) < 0 )
+        return false;
+    i_pending_start += i_payload_size;
+    i_container_chunk++;
+    return true;
+}
+
+/*****************************************************************************
+ * AppendContainer: keep a TS packet until its payload is dated
+ *****************************************************************************/
+static bool AppendContainer( const uint8_t *p_ts )
+{
+    if ( i_pending_end + TS_SIZE > i_pending_max )
+    {
+        if ( i_pending_start )
+        {
+            memmove( p_pending, p_pending + i_pending_start,
+                     i_pending_end - i_pending_start );
+            i_pending_end -= i_pending_start;
+            i_pending_start = 0;
+        }
+        if ( i_pending_end + TS_SIZE > i_pending_max )
+        {
+            i_pending_max = i_pending_max * 2 + i_ts_in_payload * TS_SIZE;
+            p_pending = realloc( p_pending, i_pending_max );
+        }
+    }
+    memcpy( p_pending + i_pending_end, p_ts, TS_SIZE );
+    i_pending_end += TS_SIZE;
+
+    /* The payload was dated before it was complete */
+    if ( b_pending_stc
+          && i_pending_end - i_pending_start >= i_ts_in_payload * TS_SIZE )
+    {
+        b_pending_stc = false;
+        return WriteChunk( i_pending_stc );
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * OutputContainer: write a dated payload to the container, or wait for the
+ * rest of it
+ *****************************************************************************/
+static bool OutputContainer( uint64_t i_stc )
+{
+    if ( i_pending_end - i_pending_start < i_ts_in_payload * TS_SIZE )
+    {
+        i_pending_stc = i_stc;
+        b_pending_stc = true;
+        return true;
+    }
+    return WriteChunk( i_stc );
+}
+
+/*****************************************************************************
+ * FlushContainer: pad and write the last incomplete payload
+ *****************************************************************************/
+static void FlushContainer(void)
+{
+    if ( !b_pending_stc || i_pending_end == i_pending_start )
+        return;
+
+    p_pending = realloc( p_pending, i_pending_start
+                                     + i_ts_in_payload * TS_SIZE );
+    for ( ; i_pending_end - i_pending_start < i_ts_in_payload * TS_SIZE;
+          i_pending_end += TS_SIZE )
+        ts_pad( p_pending + i_pending_end );
+    if ( !WriteChunk( i_pending_stc ) )
+        msg_Err( NULL, "couldn't write to container" );
+}
+
 /*****************************************************************************
  * OutputAux: date payload packets
  *****************************************************************************/
 static void OutputAux( int i_nb_payloads, uint64_t i_duration )
 {
-    uint8_t p_aux[i_nb_payloads*sizeof(uint64_t)];
     int i;
 
     for ( i = 0; i < i_nb_payloads; i++ )
     {
         uint64_t i_stc = i_last_stc + i_duration * (i + 1) / i_nb_payloads;
 
-        p_aux[8 * i + 0] = i_stc >> 56;
-        p_aux[8 * i + 1] = (i_stc >> 48) & 0xff;
-        p_aux[8 * i + 2] = (i_stc >> 40) & 0xff;
-        p_aux[8 * i + 3] = (i_stc >> 32) & 0xff;
-        p_aux[8 * i + 4] = (i_stc >> 24) & 0xff;
-        p_aux[8 * i + 5] = (i_stc >> 16) & 0xff;
-        p_aux[8 * i + 6] = (i_stc >> 8) & 0xff;
-        p_aux[8 * i + 7] = (i_stc >> 0) & 0xff;
+        if ( i_container_fd != -1 )
+        {
+            if ( !OutputContainer( i_stc ) )
+            {
+                msg_Err( NULL, "couldn't write to container" );
+                break;
+            }
+        }
+        else if ( !WriteAuxFile( p_output_aux, i_stc ) )
+        {
+            msg_Err( NULL, "couldn't write to auxiliary file" );
+            break;
+        }
     }
     i_last_stc += i_duration;
-
-    if ( fwrite( p_aux, 8, i_nb_payloads, p_output_aux ) != i_nb_payloads )
-        msg_Err( NULL, "couldn't write to auxiliary file" );
 }
 
 /*****************************************************************************
@@ -186,6 +276,7 @@ static void TSHandle( uint8_t *p_ts )
 int main( int i_argc, char **pp_argv )
 {
     const char *psz_syslog_tag = NULL;
+    const char *psz_container = NULL;
     uint8_t *p_buffer;
     unsigned int i_payload_size = DEFAULT_PAYLOAD_SIZE;
     mode_t i_mode;
@@ -194,7 +285,7 @@ int main( int i_argc, char **pp_argv )
     {
         int c;
 
-        if ( (c = getopt(i_argc, pp_argv, "l:p:m:h")) == -1 )
+        if ( (c = getopt(i_argc, pp_argv, "l:p:m:Ac:h")) == -1 )
             break;
 
         switch ( c )
@@ -217,6 +308,14 @@ int main( int i_argc, char **pp_argv )
             }
             break;
 
+        case 'A':
+            i_aux_version = 2;
+            break;
+
+        case 'c':
+            psz_container = optarg;
+            break;
+
         case 'h':
         default:
             usage();
@@ -234,9 +333,14 @@ int main( int i_argc, char **pp_argv )
         usage();
     i_fd = OpenFile( pp_argv[optind], true, false );
 
-    char *psz_aux_file = GetAuxFile( pp_argv[optind], i_payload_size );
-    p_output_aux = OpenAuxFile( psz_aux_file, false, false );
-    free( psz_aux_file );
+    if ( psz_container != NULL )
+        i_container_fd = OpenFile( psz_container, false, false );
+    else
+    {
+        char *psz_aux_file = GetAuxFile( pp_argv[optind], i_payload_size );
+        p_output_aux = OpenAuxFile( psz_aux_file, false, false );
+        free( psz_aux_file );
+    }
 
     p_buffer = malloc( TS_SIZE * READ_ONCE );
 
@@ -258,6 +362,9 @@ int main( int i_argc, char **pp_argv )
 
         for ( i = 0; i < i_ret / TS_SIZE; i++ )
         {
+            if ( i_container_fd != -1
+                  && !AppendContainer( p_buffer + TS_SIZE * i ) )
+                msg_Err( NULL, "couldn't write to container" );
             TSHandle( p_buffer + TS_SIZE * i );
             i_ts_read++;
         }
@@ -268,7 +375,13 @@ int main( int i_argc, char **pp_argv )
         msg_Err( NULL, "no PCR found" );
     else
         OutputLast(); /* Emulate CBR */
-    fclose( p_output_aux );
+    if ( i_container_fd != -1 )
+    {
+        FlushContainer();
+        close( i_container_fd );
+        free( p_pending );
+    }
+    CloseAuxFile( p_output_aux );
     close( i_fd );
 
     if ( psz_syslog_tag != NULL )
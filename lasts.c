@@ -25,20 +25,23 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "util.h"
+
 /*****************************************************************************
  * Entry point
  *****************************************************************************/
 int main(int i_argc, char **ppsz_argv)
 {
     uint64_t i_stc0, i_stcn;
-    uint8_t p_aux[8];
-    int i_fd;
+    aux_file_t *p_aux;
+    off_t i_nb_chunks;
 
     if (i_argc != 2 || !strcmp(ppsz_argv[1], "-h") ||
         !strcmp(ppsz_argv[1], "--help"))
@@ -47,55 +50,26 @@ int main(int i_argc, char **ppsz_argv)
         exit(EXIT_FAILURE);
     }
 
-    i_fd = open(ppsz_argv[1], O_RDONLY);
-    if (i_fd == -1)
-    {
-        fprintf(stderr, "cannot open (%m)\n");
-        exit(EXIT_FAILURE);
-    }
+    p_aux = OpenAuxFile(ppsz_argv[1], true, false);
+    i_nb_chunks = CountAuxFile(p_aux);
 
-    if (read(i_fd, p_aux, sizeof(p_aux)) != sizeof(p_aux))
+    if (!i_nb_chunks || !ReadAuxFile(p_aux, &i_stc0))
     {
-        fprintf(stderr, "cannot read (%m)\n");
-        close(i_fd);
+        fprintf(stderr, "cannot read\n");
+        CloseAuxFile(p_aux);
         exit(EXIT_FAILURE);
     }
 
-    i_stc0 = ((uint64_t)p_aux[0] << 56)
-          | ((uint64_t)p_aux[1] << 48)
-          | ((uint64_t)p_aux[2] << 40)
-          | ((uint64_t)p_aux[3] << 32)
-          | ((uint64_t)p_aux[4] << 24)
-          | ((uint64_t)p_aux[5] << 16)
-          | ((uint64_t)p_aux[6] << 8)
-          | ((uint64_t)p_aux[7] << 0);
-
-    if (lseek(i_fd, -(off_t)sizeof(p_aux), SEEK_END) == -1)
+    if (SeekAuxFile(p_aux, i_nb_chunks - 1) == -1 ||
+        !ReadAuxFile(p_aux, &i_stcn))
     {
-        fprintf(stderr, "cannot lseek (%m)\n");
-        close(i_fd);
+        fprintf(stderr, "cannot seek\n");
+        CloseAuxFile(p_aux);
         exit(EXIT_FAILURE);
     }
-
-    if (read(i_fd, p_aux, sizeof(p_aux)) != sizeof(p_aux))
-    {
-        fprintf(stderr, "cannot read (%m)\n");
-        close(i_fd);
-        exit(EXIT_FAILURE);
-    }
-    close(i_fd);
-
-    i_stcn = ((uint64_t)p_aux[0] << 56)
-          | ((uint64_t)p_aux[1] << 48)
-          | ((uint64_t)p_aux[2] << 40)
-          | ((uint64_t)p_aux[3] << 32)
-          | ((uint64_t)p_aux[4] << 24)
-          | ((uint64_t)p_aux[5] << 16)
-          | ((uint64_t)p_aux[6] << 8)
-          | ((uint64_t)p_aux[7] << 0);
+    CloseAuxFile(p_aux);
 
     printf( "%"PRIu64"\n", i_stcn - i_stc0);
 
     exit(EXIT_SUCCESS);
 }
-
@@ -34,6 +34,7 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/socket.h>
@@ -42,19 +43,35 @@
 #include <pthread.h>
 #include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/statvfs.h>
 #include <syslog.h>
 
 #ifdef SIOCGSTAMPNS
 #   define HAVE_TIMESTAMPS
 #endif
 
+#ifdef SO_RXQ_OVFL
+#   define HAVE_RXQ_OVFL
+#endif
+
+#ifdef SO_MEMINFO
+#   include <linux/sock_diag.h>
+#   define HAVE_MEMINFO
+#endif
+
 #ifndef POLLRDHUP
 #   define POLLRDHUP 0
 #endif
 
+#if defined(__linux__) && defined(__GLIBC__) \
+     && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 27)
+#   define HAVE_COPY_FILE_RANGE
+#endif
+
 #include <bitstream/ietf/rtp.h>
 #include <bitstream/mpeg/ts.h>
 #include <bitstream/mpeg/pes.h>
+#include <bitstream/mpeg/psi.h>
 
 #include "util.h"
 
@@ -66,12 +83,14 @@
 #define POW2_33 UINT64_C(8589934592)
 #define TS_CLOCK_MAX (POW2_33 * 27000000 / 90000)
 #define MAX_PCR_INTERVAL (27000000 / 2)
+#define SPEED_UNIT 1000 /* -x 1 */
+#define NULL_PID 8191
 
 /*****************************************************************************
  * Local declarations
  *****************************************************************************/
 static int i_input_fd, i_output_fd;
-FILE *p_input_aux, *p_output_aux;
+aux_file_t *p_input_aux, *p_output_aux;
 static int i_ttl = 0;
 static bool b_sleep = true;
 static uint16_t i_pcr_pid = 0;
@@ -81,9 +100,20 @@ static bool b_input_udp = false, b_output_udp = false;
 static size_t i_asked_payload_size = DEFAULT_PAYLOAD_SIZE;
 static size_t i_rtp_header_size = RTP_HEADER_SIZE;
 static uint64_t i_rotate_size = DEFAULT_ROTATE_SIZE;
+static uint64_t i_bucket_size = 0;
 static struct udprawpkt pktheader;
 static bool b_raw_packets = false;
 static uint8_t *pi_pid_cc_table = NULL;
+static bool b_output_container = false;
+static unsigned int i_extract_threads = 1;
+static unsigned int i_retention_files = 0, i_retention_usage = 0;
+static uint64_t i_retention_age = 0;
+static uint16_t i_rap_pid = 0;
+static uint64_t i_speed = SPEED_UNIT;
+static uint16_t i_thin_pid = 0;
+static unsigned int i_split_packets = 0;
+static bool b_depart_pcr = false;
+static bool b_null_strip = false;
 /* PCR/PTS/DTS restamping */
 static uint64_t i_last_pcr_date;
 static uint64_t i_last_pcr = TS_CLOCK_MAX;
@@ -93,24 +123,26 @@ static volatile sig_atomic_t b_die = 0, b_error = 0;
 static uint16_t i_rtp_seqnum;
 static uint64_t i_stc = 0; /* system time clock, used for date calculations */
 static uint64_t i_first_stc = 0;
+static uint64_t i_input_arrival = 0; /* of the chunk read, for live inputs */
 static uint64_t i_pcr = 0, i_pcr_stc = 0; /* for RTP/TS output */
 static uint64_t (*pf_Date)(void) = wall_Date;
 static void (*pf_Sleep)( uint64_t ) = wall_Sleep;
 static ssize_t (*pf_Read)( void *p_buf, size_t i_len );
 static bool (*pf_Delay)(void) = NULL;
+static bool (*pf_NextFile)(void) = NULL;
 static void (*pf_ExitRead)(void);
 static ssize_t (*pf_Write)( const void *p_buf, size_t i_len );
 static void (*pf_ExitWrite)(void);
 
 static void usage(void)
 {
-    msg_Raw( NULL, "Usage: multicat [-i <RT priority>] [-l <syslogtag>] [-t <ttl>] [-X] [-T <file name>] [-f] [-p <PCR PID>] [-C] [-P] [-s <chunks>] [-n <chunks>] [-k <start time>] [-d <duration>] [-a] [-r <file duration>] [-S <SSRC IP>] [-u] [-U] [-m <payload size>] [-R <RTP header size>] [-w] <input item> <output item>" );
+    msg_Raw( NULL, "Usage: multicat [-i <RT priority>] [-l <syslogtag>] [-t <ttl>] [-X] [-T <file name>] [-f] [-p <PCR PID>] [-C] [-P] [-s <chunks>] [-n <chunks>] [-k <start time>] [-d <duration>] [-a] [-r <file duration>] [-S <SSRC IP>] [-u] [-U] [-m <payload size>] [-R <RTP header size>] [-w] [-A] [-c] [-E <segments>] [-O <age>] [-W <disk usage>] [-D <subdirectory duration>] [-J <directory>] [-F] [-j <threads>] [-I <video PID>] [-K] [-x <speed>] [-g <video PID>] [-L] [-e] [-B <latency>] [-N <packets>] [-Z] [-z] [-M <PID>[=<new PID>]] [-Y] [-G] [-Q] [-H] [-q <packets>] [-o] <input item> <output item>" );
     msg_Raw( NULL, "    item format: <file path | device path | FIFO path | directory path | network host>" );
     msg_Raw( NULL, "    host format: [<connect addr>[:<connect port>]][@[<bind addr][:<bind port>]]" );
     msg_Raw( NULL, "    -X: also pass-through all packets to stdout" );
     msg_Raw( NULL, "    -T: write an XML file with the current characteristics of transmission" );
     msg_Raw( NULL, "    -f: output packets as fast as possible" );
-    msg_Raw( NULL, "    -p: overwrite or create RTP timestamps using PCR PID (MPEG-2/TS)" );
+    msg_Raw( NULL, "    -p: overwrite or create RTP timestamps using PCR PID (MPEG-2/TS), and date files without aux file" );
     msg_Raw( NULL, "    -C: rewrite continuity counters to be continuous" );
     msg_Raw( NULL, "    -P: restamp PCRs, DTSs, and PTSs" );
     msg_Raw( NULL, "    -s: skip the first N chunks of payload [deprecated]" );
@@ -125,6 +157,32 @@ static void usage(void)
     msg_Raw( NULL, "    -m: size of the payload chunk, excluding optional RTP header (default 1316)" );
     msg_Raw( NULL, "    -R: size of the optional RTP header (default 12)" );
     msg_Raw( NULL, "    -w: send with RAW (needed for /srcaddr)" );
+    msg_Raw( NULL, "    -A: write compact (version 2) auxiliary files" );
+    msg_Raw( NULL, "    -c: write a self-timed container instead of TS and aux files" );
+    msg_Raw( NULL, "    -E: in directory mode, keep at most N files (in each directory with -J)" );
+    msg_Raw( NULL, "    -O: in directory mode, delete files older than this duration (in 27 MHz units)" );
+    msg_Raw( NULL, "    -W: in directory mode, delete old files when the disk usage exceeds this percentage" );
+    msg_Raw( NULL, "    -D: in directory mode, nest files in subdirectories of this duration (in 27 MHz units)" );
+    msg_Raw( NULL, "    -J: in directory mode, spread files over this directory too (may be repeated)" );
+    msg_Raw( NULL, "    -F: in directory mode, put new files in the directory with the most free space" );
+    msg_Raw( NULL, "    -j: number of threads copying extractions to a file (default 1)" );
+    msg_Raw( NULL, "    -I: write an index of the random access points of this PID (8192 = any PID)" );
+    msg_Raw( NULL, "    -K: with -k, start with the last PAT and PMTs before the position" );
+    msg_Raw( NULL, "    -x: play files and directories at this speed (default 1), restamping PCRs, DTSs and PTSs" );
+    msg_Raw( NULL, "    -g: above speed 1, only play the random access pictures of this video PID" );
+    msg_Raw( NULL, "    -L: the input is a playlist of files, played back to back with continuous timestamps" );
+    msg_Raw( NULL, "    -e: play the input file or playlist in an endless loop" );
+    msg_Raw( NULL, "    -B: smooth a live input with the PCRs of the PCR PID, adding this latency (in 27 MHz units)" );
+    msg_Raw( NULL, "    -N: send chunks to the network in datagrams of N TS packets, spread between the chunk dates" );
+    msg_Raw( NULL, "    -Z: restamp the PCRs of the PCR PID with the time they are sent" );
+    msg_Raw( NULL, "    -z: record files and directories without null packets, which are restored on playback" );
+    msg_Raw( NULL, "    -M: only keep this PID (8192 = all the others), renumbered if a new PID is given, or dropped with =- (may be repeated)" );
+    msg_Raw( NULL, "    -Y: record each program of the input in a subdirectory of the output directory" );
+    msg_Raw( NULL, "    -G: add the packets, bitrate and errors of each PID to the -T file every second" );
+    msg_Raw( NULL, "    -Q: add the TR 101 290 priority 1 and 2 errors of the input to the -T file" );
+    msg_Raw( NULL, "    -H: add the RFC 4445 media delivery index (DF:MLR) of the input to the -T file" );
+    msg_Raw( NULL, "    -q: put RTP input packets back in order in a window of this number of packets" );
+    msg_Raw( NULL, "    -o: grow the socket receive buffer (up to rmem_max) when the kernel drops input packets" );
     exit(EXIT_FAILURE);
 }
 
@@ -201,9 +259,90 @@ static ssize_t tcp_Read( void *p_buf, size_t i_len )
 
 /*****************************************************************************
  * udp_*: UDP socket handlers
+ *****************************************************************************
+ * The kernel counts the datagrams it dropped because the receive buffer was
+ * full (SO_RXQ_OVFL). With -o, the receive buffer is doubled, up to
+ * rmem_max, when it drops datagrams or gets three quarters full.
  *****************************************************************************/
+#define UDP_TUNE_PERIOD UINT64_C(2700000) /* 100 ms */
+
 static off_t i_udp_nb_skips = 0;
 static bool b_tcp = false;
+static uint32_t i_udp_drops = 0; /* since the socket was opened */
+static int i_udp_rcvbuf = 0, i_udp_rcvbuf_max;
+static bool b_udp_tune = false;
+static uint32_t i_udp_tune_drops = 0;
+static uint64_t i_udp_tune_next = 0;
+
+#ifdef HAVE_RXQ_OVFL
+static ssize_t udp_Recv( void *p_buf, size_t i_len )
+{
+    char p_control[CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *p_cmsg;
+    ssize_t i_ret;
+
+    iov.iov_base = p_buf;
+    iov.iov_len = i_len;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = p_control;
+    msg.msg_controllen = sizeof(p_control);
+
+    if ( (i_ret = recvmsg( i_input_fd, &msg, 0 )) < 0 )
+        return i_ret;
+
+    for ( p_cmsg = CMSG_FIRSTHDR( &msg ); p_cmsg != NULL;
+          p_cmsg = CMSG_NXTHDR( &msg, p_cmsg ) )
+        if ( p_cmsg->cmsg_level == SOL_SOCKET
+              && p_cmsg->cmsg_type == SO_RXQ_OVFL )
+            memcpy( &i_udp_drops, CMSG_DATA( p_cmsg ), sizeof(uint32_t) );
+    return i_ret;
+}
+#endif
+
+static void udp_GetBuffer(void)
+{
+    socklen_t i_size = sizeof(i_udp_rcvbuf);
+
+    if ( getsockopt( i_input_fd, SOL_SOCKET, SO_RCVBUF, &i_udp_rcvbuf,
+                     &i_size ) < 0 )
+        i_udp_rcvbuf = 0;
+}
+
+static void udp_Tune(void)
+{
+    bool b_grow = i_udp_drops != i_udp_tune_drops;
+    int i_rcvbuf;
+
+#ifdef HAVE_MEMINFO
+    if ( !b_grow && i_stc >= i_udp_tune_next )
+    {
+        uint32_t pi_meminfo[SK_MEMINFO_VARS];
+        socklen_t i_size = sizeof(pi_meminfo);
+
+        i_udp_tune_next = i_stc + UDP_TUNE_PERIOD;
+        if ( !getsockopt( i_input_fd, SOL_SOCKET, SO_MEMINFO, pi_meminfo,
+                          &i_size )
+              && pi_meminfo[SK_MEMINFO_RMEM_ALLOC]
+                   > pi_meminfo[SK_MEMINFO_RCVBUF] / 4 * 3 )
+            b_grow = true;
+    }
+#endif
+    i_udp_tune_drops = i_udp_drops;
+    if ( !b_grow || i_udp_rcvbuf >= i_udp_rcvbuf_max )
+        return;
+
+    /* Linux reports twice the size asked, for its own bookkeeping */
+    i_rcvbuf = i_udp_rcvbuf > i_udp_rcvbuf_max / 2 ? i_udp_rcvbuf_max / 2
+                                                   : i_udp_rcvbuf;
+    setsockopt( i_input_fd, SOL_SOCKET, SO_RCVBUF, &i_rcvbuf,
+                sizeof(i_rcvbuf) );
+    udp_GetBuffer();
+    msg_Info( NULL, "receive buffer increased to %d bytes", i_udp_rcvbuf );
+}
 
 static ssize_t udp_Read( void *p_buf, size_t i_len )
 {
@@ -219,7 +358,12 @@ static ssize_t udp_Read( void *p_buf, size_t i_len )
 
     if ( !b_tcp )
     {
-        if ( (i_ret = recv( i_input_fd, p_buf, i_len, 0 )) < 0 )
+#ifdef HAVE_RXQ_OVFL
+        i_ret = udp_Recv( p_buf, i_len );
+#else
+        i_ret = recv( i_input_fd, p_buf, i_len, 0 );
+#endif
+        if ( i_ret < 0 )
         {
             msg_Err( NULL, "recv error (%s)", strerror(errno) );
             b_die = b_error = 1;
@@ -233,9 +377,13 @@ static ssize_t udp_Read( void *p_buf, size_t i_len )
         else
 #endif
         i_stc = pf_Date();
+
+        if ( b_udp_tune )
+            udp_Tune();
     }
     else
         i_ret = tcp_Read( p_buf, i_len );
+    i_input_arrival = i_stc;
 
     if ( i_udp_nb_skips )
     {
@@ -245,6 +393,13 @@ static ssize_t udp_Read( void *p_buf, size_t i_len )
     return i_ret;
 }
 
+/* Appends the socket statistics to the -T file */
+static size_t udp_Stats( char *psz_stats )
+{
+    return sprintf( psz_stats, "<SOCKET drops=\"%"PRIu32"\" rcvbuf=\"%d\"/>",
+                    i_udp_drops, i_udp_rcvbuf );
+}
+
 static void udp_ExitRead(void)
 {
     close( i_input_fd );
@@ -261,6 +416,32 @@ static int udp_InitRead( const char *psz_arg, size_t i_len,
 
     i_udp_nb_skips = i_nb_skipped_chunks;
 
+    if ( !b_tcp )
+    {
+#ifdef HAVE_RXQ_OVFL
+        int i_on = 1;
+        setsockopt( i_input_fd, SOL_SOCKET, SO_RXQ_OVFL, &i_on,
+                    sizeof(i_on) );
+#endif
+        udp_GetBuffer();
+        if ( b_udp_tune )
+        {
+            FILE *p_file = fopen( "/proc/sys/net/core/rmem_max", "r" );
+            if ( p_file == NULL
+                  || fscanf( p_file, "%d", &i_udp_rcvbuf_max ) != 1 )
+            {
+                msg_Warn( NULL, "couldn't read rmem_max, not tuning the receive buffer" );
+                b_udp_tune = false;
+            }
+            if ( p_file != NULL )
+                fclose( p_file );
+            /* In the unit of SO_RCVBUF, which the kernel caps at INT_MAX */
+            if ( i_udp_rcvbuf_max > INT_MAX / 2 )
+                i_udp_rcvbuf_max = INT_MAX / 2;
+            i_udp_rcvbuf_max *= 2;
+        }
+    }
+
     pf_Read = udp_Read;
     pf_ExitRead = udp_ExitRead;
 #ifdef HAVE_TIMESTAMPS
@@ -373,7 +554,7 @@ static ssize_t stream_Read( void *p_buf, size_t i_len )
         return 0;
     }
 
-    i_stc = pf_Date();
+    i_input_arrival = i_stc = pf_Date();
     if ( i_stream_nb_skips )
     {
         i_stream_nb_skips--;
@@ -428,16 +609,69 @@ static int stream_InitWrite( const char *psz_arg, size_t i_len, bool b_append )
     return 0;
 }
 
+/*****************************************************************************
+ * HasRAP: check whether a chunk contains a random access point of the
+ * indexed PID
+ *****************************************************************************/
+static bool HasRAP( const uint8_t *p_buffer, size_t i_read_size )
+{
+    while ( i_read_size >= TS_SIZE )
+    {
+        uint16_t i_pid = ts_get_pid( p_buffer );
+
+        if ( ts_validate( p_buffer )
+              && (i_pid == i_rap_pid || i_rap_pid == 8192)
+              && ts_has_adaptation(p_buffer) && ts_get_adaptation(p_buffer)
+              && tsaf_has_randomaccess(p_buffer) )
+            return true;
+        p_buffer += TS_SIZE;
+        i_read_size -= TS_SIZE;
+    }
+    return false;
+}
+
+/*****************************************************************************
+ * SpeedDelay: convert a duration of the input to a duration of the output
+ *****************************************************************************/
+static uint64_t SpeedDelay( uint64_t i_delta )
+{
+    if ( i_speed == SPEED_UNIT )
+        return i_delta;
+    return i_delta * SPEED_UNIT / i_speed;
+}
+
 /*****************************************************************************
  * file_*: handler for the auxiliary file format
  *****************************************************************************/
 static uint64_t i_file_next_flush = 0;
+static off_t i_input_chunk = 0, i_output_chunk = 0;
+static int i_output_rap_fd = -1;
+static int i_input_null_fd = -1, i_output_null_fd = -1;
+static uint32_t i_output_nulls = 0; /* removed before the chunk written */
 
 static ssize_t file_Read( void *p_buf, size_t i_len )
 {
-    uint8_t p_aux[8];
     ssize_t i_ret;
 
+    if ( p_input_aux == NULL )
+    {
+        if ( (i_ret = ReadContainer( i_input_fd, i_input_chunk, &i_stc,
+                                     p_buf, i_len )) < 0 )
+        {
+            b_die = b_error = 1;
+            return 0;
+        }
+        if ( i_ret == 0 )
+        {
+            msg_Dbg( NULL, "end of file reached" );
+            b_die = 1;
+            return 0;
+        }
+        i_input_chunk++;
+        if ( !i_first_stc ) i_first_stc = i_stc;
+        return i_ret;
+    }
+
     if ( (i_ret = read( i_input_fd, p_buf, i_len )) < 0 )
     {
         msg_Err( NULL, "read error (%s)", strerror(errno) );
@@ -451,13 +685,12 @@ static ssize_t file_Read( void *p_buf, size_t i_len )
         return 0;
     }
 
-    if ( fread( p_aux, 8, 1, p_input_aux ) != 1 )
+    if ( !ReadAuxFile( p_input_aux, &i_stc ) )
     {
         msg_Warn( NULL, "premature end of aux file reached" );
         b_die = b_error = 1;
         return 0;
     }
-    i_stc = FromSTC( p_aux );
     if ( !i_first_stc ) i_first_stc = i_stc;
 
     return i_ret;
@@ -476,7 +709,7 @@ static bool file_Delay(void)
     }
     else
     {
-        int64_t i_delay = (i_stc - i_file_first_stc) -
+        int64_t i_delay = SpeedDelay( i_stc - i_file_first_stc ) -
                           (i_wall - i_file_first_wall);
         if ( i_delay > 0 )
             pf_Sleep( i_delay );
@@ -493,12 +726,57 @@ static bool file_Delay(void)
 static void file_ExitRead(void)
 {
     close( i_input_fd );
-    fclose( p_input_aux );
+    CloseAuxFile( p_input_aux );
+    if ( i_input_null_fd != -1 )
+        close( i_input_null_fd );
+}
+
+static off_t file_SnapRAP( const char *psz_arg, size_t i_len, off_t i_chunk )
+{
+    off_t i_rap = LookupRAPFile( psz_arg, i_chunk, i_len );
+    if ( i_rap < 0 )
+        return i_chunk;
+    msg_Dbg( NULL, "starting at random access point %jd instead of %jd",
+             (intmax_t)i_rap, (intmax_t)i_chunk );
+    return i_rap;
 }
 
 static int file_InitRead( const char *psz_arg, size_t i_len,
                           off_t i_nb_skipped_chunks, int64_t i_pos )
 {
+    size_t i_container_len = GetContainerPayloadSize( psz_arg );
+    if ( i_container_len )
+    {
+        if ( i_container_len != i_len )
+        {
+            msg_Err( NULL, "container has a payload size of %zu",
+                     i_container_len );
+            return -1;
+        }
+        if ( i_pos )
+        {
+            i_nb_skipped_chunks = LookupContainerFile( psz_arg, i_pos, false,
+                                                       i_len );
+            if ( i_nb_skipped_chunks < 0 )
+                return -1;
+            i_nb_skipped_chunks = file_SnapRAP( psz_arg, i_len,
+                                                i_nb_skipped_chunks );
+        }
+
+        i_input_fd = OpenFile( psz_arg, true, false );
+        p_input_aux = NULL;
+        i_input_chunk = i_nb_skipped_chunks;
+        i_input_null_fd = OpenNullFile( psz_arg, i_len, true,
+                                        i_nb_skipped_chunks );
+        lseek( i_input_fd, ct_get_offset( i_nb_skipped_chunks, i_len ),
+               SEEK_SET );
+
+        pf_Read = file_Read;
+        pf_Delay = file_Delay;
+        pf_ExitRead = file_ExitRead;
+        return 0;
+    }
+
     char *psz_aux_file = GetAuxFile( psz_arg, i_len );
     if ( i_pos )
     {
@@ -508,6 +786,8 @@ static int file_InitRead( const char *psz_arg, size_t i_len,
             free( psz_aux_file );
             return -1;
         }
+        i_nb_skipped_chunks = file_SnapRAP( psz_arg, i_len,
+                                            i_nb_skipped_chunks );
     }
 
     i_input_fd = OpenFile( psz_arg, true, false );
@@ -515,7 +795,9 @@ static int file_InitRead( const char *psz_arg, size_t i_len,
     free( psz_aux_file );
 
     lseek( i_input_fd, (off_t)i_len * i_nb_skipped_chunks, SEEK_SET );
-    fseeko( p_input_aux, 8 * i_nb_skipped_chunks, SEEK_SET );
+    SeekAuxFile( p_input_aux, i_nb_skipped_chunks );
+    i_input_null_fd = OpenNullFile( psz_arg, i_len, true,
+                                    i_nb_skipped_chunks );
 
     pf_Read = file_Read;
     pf_Delay = file_Delay;
@@ -525,13 +807,17 @@ static int file_InitRead( const char *psz_arg, size_t i_len,
 
 static ssize_t file_Write( const void *p_buf, size_t i_len )
 {
-    uint8_t p_aux[8];
     ssize_t i_ret;
 #ifdef DEBUG_WRITEBACK
     uint64_t start = pf_Date(), end;
 #endif
 
-    if ( (i_ret = write( i_output_fd, p_buf, i_len )) < 0 )
+    if ( p_output_aux == NULL )
+        i_ret = WriteContainer( i_output_fd, i_output_chunk, i_stc,
+                                p_buf, i_len );
+    else
+        i_ret = write( i_output_fd, p_buf, i_len );
+    if ( i_ret < 0 )
     {
         msg_Err( NULL, "couldn't write to file (%s)", strerror(errno) );
         b_die = b_error = 1;
@@ -543,8 +829,19 @@ static ssize_t file_Write( const void *p_buf, size_t i_len )
         msg_Err(NULL, "too long waiting in write(%"PRId64")", (end - start) / 27000);
 #endif
 
-    ToSTC( p_aux, i_stc );
-    if ( fwrite( p_aux, 8, 1, p_output_aux ) != 1 )
+    if ( i_output_rap_fd != -1 && HasRAP( p_buf, i_len )
+          && !WriteRAPFile( i_output_rap_fd, i_output_chunk ) )
+        msg_Warn( NULL, "couldn't write to RAP index (%s)", strerror(errno) );
+    if ( i_output_null_fd != -1
+          && !WriteNullFile( i_output_null_fd, i_output_nulls ) )
+        msg_Warn( NULL, "couldn't write null packet counts (%s)",
+                  strerror(errno) );
+    i_output_chunk++;
+
+    if ( p_output_aux == NULL )
+        return i_len;
+
+    if ( !WriteAuxFile( p_output_aux, i_stc ) )
     {
         msg_Err( NULL, "couldn't write to auxiliary file" );
         b_die = b_error = 1;
@@ -553,7 +850,7 @@ static ssize_t file_Write( const void *p_buf, size_t i_len )
         i_file_next_flush = i_stc + FILE_FLUSH;
     else if (i_file_next_flush <= i_stc)
     {
-        fflush( p_output_aux );
+        FlushAuxFile( p_output_aux );
         i_file_next_flush = i_stc + FILE_FLUSH;
     }
 
@@ -563,11 +860,33 @@ static ssize_t file_Write( const void *p_buf, size_t i_len )
 static void file_ExitWrite(void)
 {
     close( i_output_fd );
-    fclose( p_output_aux );
+    CloseAuxFile( p_output_aux );
+    if ( i_output_rap_fd != -1 )
+        close( i_output_rap_fd );
+    if ( i_output_null_fd != -1 )
+        close( i_output_null_fd );
 }
 
 static int file_InitWrite( const char *psz_arg, size_t i_len, bool b_append )
 {
+    if ( b_output_container )
+    {
+        i_output_chunk = b_append ? CheckContainerFile( psz_arg, i_len ) : 0;
+        if ( i_output_chunk < 0 )
+            return -1;
+        i_output_fd = OpenFile( psz_arg, false, b_append );
+        p_output_aux = NULL;
+        if ( i_rap_pid )
+            i_output_rap_fd = OpenRAPFile( psz_arg, i_len, i_output_chunk );
+        if ( b_null_strip )
+            i_output_null_fd = OpenNullFile( psz_arg, i_len, false,
+                                             i_output_chunk );
+
+        pf_Write = file_Write;
+        pf_ExitWrite = file_ExitWrite;
+        return 0;
+    }
+
     char *psz_aux_file = GetAuxFile( psz_arg, i_len );
     if ( b_append )
         CheckFileSizes( psz_arg, psz_aux_file, i_len );
@@ -575,227 +894,3533 @@ static int file_InitWrite( const char *psz_arg, size_t i_len, bool b_append )
     p_output_aux = OpenAuxFile( psz_aux_file, false, b_append );
     free( psz_aux_file );
 
+    if ( b_append )
+    {
+        struct stat st;
+        i_output_chunk = fstat( i_output_fd, &st ) < 0 ? 0 :
+                         st.st_size / i_len;
+    }
+    if ( i_rap_pid )
+        i_output_rap_fd = OpenRAPFile( psz_arg, i_len, i_output_chunk );
+    if ( b_null_strip )
+        i_output_null_fd = OpenNullFile( psz_arg, i_len, false,
+                                         i_output_chunk );
+
     pf_Write = file_Write;
     pf_ExitWrite = file_ExitWrite;
     return 0;
 }
 
 /*****************************************************************************
- * dir_*: handler for the auxiliary directory format
+ * pcr_*: handler for TS files without auxiliary file
+ *****************************************************************************
+ * Chunks are dated on the fly from the PCRs of the PCR PID, in the same way
+ * as ingests: the STC is interpolated linearly between PCRs, and the slope
+ * of the previous interval is kept across discontinuities. Chunks are read
+ * ahead until the PCR following the current chunk is known.
  *****************************************************************************/
-static char *psz_input_dir_name;
-static size_t i_input_dir_len;
-static uint64_t i_input_dir_file;
-static uint64_t i_input_dir_delay;
+#define PCR_LOOKAHEAD 4096 /* chunks, and PCRs */
+#define PCR_MAX_GAP (INT64_C(500) * 27000) /* 500 ms, as ingests */
 
-static ssize_t dir_Read( void *p_buf, size_t i_len )
+typedef struct pcr_point_t
 {
-    ssize_t i_ret;
-try_again:
-    i_ret = file_Read( p_buf, i_len );
-    if ( !i_ret )
-    {
-        b_die = 0; /* we're not dead yet */
-        close( i_input_fd );
-        fclose( p_input_aux );
-        i_input_fd = 0;
+    uint64_t i_packet, i_stc;
+} pcr_point_t;
+
+static uint8_t *p_pcr_chunks;
+static ssize_t pi_pcr_sizes[PCR_LOOKAHEAD];
+static unsigned int i_pcr_start = 0, i_pcr_nb = 0;
+static uint64_t i_pcr_read_packet = 0, i_pcr_out_packet = 0;
+static pcr_point_t p_pcr_points[PCR_LOOKAHEAD];
+static unsigned int i_pcr_points_start = 0, i_pcr_points_nb = 0;
+static uint64_t i_pcr_last_value = TS_CLOCK_MAX;
+static uint64_t i_pcr_slope_stc = 0, i_pcr_slope_packets = 0;
+static bool b_pcr_eof = false;
+static size_t i_pcr_len;
+
+#define PCR_POINT(i) \
+    p_pcr_points[(i_pcr_points_start + (i)) % PCR_LOOKAHEAD]
+
+/* Files with an aux file, and containers, don't need their PCRs */
+static bool pcr_IsRaw( const char *psz_arg, size_t i_len )
+{
+    char *psz_aux_file;
+    bool b_raw;
 
-        i_input_dir_file++;
+    if ( GetContainerPayloadSize( psz_arg ) )
+        return false;
+    psz_aux_file = GetAuxFile( psz_arg, i_len );
+    b_raw = !StatFile( psz_aux_file );
+    free( psz_aux_file );
+    return b_raw;
+}
+
+static void pcr_AddPoint( uint64_t i_packet, uint64_t i_pcr )
+{
+    pcr_point_t *p_last = i_pcr_points_nb ?
+                          &PCR_POINT(i_pcr_points_nb - 1) : NULL;
+    uint64_t i_stc;
+
+    if ( p_last == NULL )
+        i_stc = TS_CLOCK_MAX; /* leaves room to date chunks before it */
+    else
+    {
+        uint64_t i_diff = (TS_CLOCK_MAX + i_pcr - i_pcr_last_value)
+                           % TS_CLOCK_MAX;
 
-        i_input_fd = OpenDirFile( psz_input_dir_name, i_input_dir_file,
-                                  true, i_input_dir_len, &p_input_aux );
-        if ( i_input_fd < 0 )
+        if ( i_diff <= PCR_MAX_GAP )
         {
-            msg_Err( NULL, "end of files reached" );
-            b_die = 1;
-            return 0;
+            i_stc = p_last->i_stc + i_diff;
+            i_pcr_slope_stc = i_diff;
+            i_pcr_slope_packets = i_packet - p_last->i_packet;
+        }
+        else
+        {
+            /* Do not change the slope - consider CBR */
+            msg_Warn( NULL, "PCR discontinuity (%"PRIu64"->%"PRIu64")",
+                      i_pcr_last_value, i_pcr );
+            if ( !i_pcr_slope_packets )
+            {
+                /* No slope yet, start over */
+                i_stc = p_last->i_stc;
+                i_pcr_points_nb = 0;
+            }
+            else
+                i_stc = p_last->i_stc + (i_packet - p_last->i_packet)
+                                         * i_pcr_slope_stc
+                                         / i_pcr_slope_packets;
         }
-        goto try_again;
     }
-    return i_ret;
+
+    PCR_POINT(i_pcr_points_nb).i_packet = i_packet;
+    PCR_POINT(i_pcr_points_nb).i_stc = i_stc;
+    i_pcr_points_nb++;
+    i_pcr_last_value = i_pcr;
 }
 
-static bool dir_Delay(void)
+static bool pcr_ReadAhead(void)
 {
-    uint64_t i_wall = pf_Date() - i_input_dir_delay;
-    int64_t i_delay = i_stc - i_wall;
+    unsigned int i_chunk = (i_pcr_start + i_pcr_nb) % PCR_LOOKAHEAD;
+    uint8_t *p_chunk = p_pcr_chunks + (size_t)i_chunk * i_pcr_len;
+    ssize_t i_ret = read( i_input_fd, p_chunk, i_pcr_len );
+    uint8_t *p_ts;
 
-    if ( i_delay > 0 )
-        pf_Sleep( i_delay );
-    else if ( i_delay < -MAX_LATENESS )
+    if ( i_ret < 0 )
     {
-        msg_Warn( NULL, "dropping late packet" );
+        msg_Err( NULL, "read error (%s)", strerror(errno) );
         return false;
     }
+    if ( i_ret == 0 )
+    {
+        b_pcr_eof = true;
+        return true;
+    }
+
+    for ( p_ts = p_chunk; p_ts + TS_SIZE <= p_chunk + i_ret;
+          p_ts += TS_SIZE, i_pcr_read_packet++ )
+        if ( ts_validate( p_ts )
+              && (ts_get_pid( p_ts ) == i_pcr_pid || i_pcr_pid == 8192)
+              && ts_has_adaptation( p_ts ) && ts_get_adaptation( p_ts )
+              && tsaf_has_pcr( p_ts )
+              && i_pcr_points_nb < PCR_LOOKAHEAD )
+            pcr_AddPoint( i_pcr_read_packet,
+                          tsaf_get_pcr( p_ts ) * 300
+                           + tsaf_get_pcrext( p_ts ) );
+
+    pi_pcr_sizes[i_chunk] = i_ret;
+    i_pcr_nb++;
     return true;
 }
 
-static void dir_ExitRead(void)
+/* Interpolate or extrapolate the STC of a packet */
+static uint64_t pcr_Date( uint64_t i_packet )
 {
-    free( psz_input_dir_name );
-    if ( i_input_fd )
+    pcr_point_t *p0, *p1;
+
+    /* Forget the points which won't be needed anymore */
+    while ( i_pcr_points_nb > 2 && PCR_POINT(1).i_packet <= i_packet )
     {
-        close( i_input_fd );
-        fclose( p_input_aux );
+        i_pcr_points_start = (i_pcr_points_start + 1) % PCR_LOOKAHEAD;
+        i_pcr_points_nb--;
     }
+
+    p0 = &PCR_POINT(0);
+    p1 = &PCR_POINT(1);
+    if ( i_packet > p1->i_packet )
+        return p1->i_stc + (i_packet - p1->i_packet) * i_pcr_slope_stc
+                            / i_pcr_slope_packets;
+    if ( i_packet < p0->i_packet )
+        return p0->i_stc - (p0->i_packet - i_packet)
+                            * (p1->i_stc - p0->i_stc)
+                            / (p1->i_packet - p0->i_packet);
+    return p0->i_stc + (i_packet - p0->i_packet) * (p1->i_stc - p0->i_stc)
+                        / (p1->i_packet - p0->i_packet);
 }
 
-static int dir_InitRead( const char *psz_arg, size_t i_len,
-                         off_t i_nb_skipped_chunks, int64_t i_pos )
+static ssize_t pcr_Read( void *p_buf, size_t i_len )
 {
-    if ( i_nb_skipped_chunks )
+    uint64_t i_end = 0;
+    ssize_t i_ret;
+
+    /* Read ahead until the PCR following the chunk is known */
+    for ( ; ; )
     {
-        msg_Err( NULL, "unable to skip chunks with directory input" );
-        return -1;
+        if ( i_pcr_nb )
+        {
+            i_end = i_pcr_out_packet + pi_pcr_sizes[i_pcr_start] / TS_SIZE;
+            if ( b_pcr_eof || i_pcr_nb == PCR_LOOKAHEAD
+                  || i_pcr_points_nb == PCR_LOOKAHEAD
+                  || (i_pcr_points_nb >= 2
+                       && PCR_POINT(i_pcr_points_nb - 1).i_packet >= i_end) )
+                break;
+        }
+        else if ( b_pcr_eof )
+        {
+            msg_Dbg( NULL, "end of file reached" );
+            b_die = 1;
+            return 0;
+        }
+
+        if ( !pcr_ReadAhead() )
+        {
+            b_die = b_error = 1;
+            return 0;
+        }
     }
 
-    if ( i_pos <= 0 )
-        i_pos += real_Date();
-    if ( i_pos <= 0 )
+    if ( i_pcr_points_nb < 2 || !i_pcr_slope_packets )
     {
-        msg_Err( NULL, "invalid position" );
-        return -1;
+        msg_Err( NULL, "not enough PCRs on PID %hu", i_pcr_pid );
+        b_die = b_error = 1;
+        return 0;
     }
-    i_first_stc = i_stc = i_pos;
-    i_input_dir_delay = real_Date() - i_stc;
 
-    psz_input_dir_name = strdup( psz_arg );
-    i_input_dir_len = i_len;
-    i_input_dir_file = GetDirFile( i_rotate_size, i_pos );
+    i_stc = pcr_Date( i_end );
+    if ( !i_first_stc ) i_first_stc = i_stc;
 
-    i_nb_skipped_chunks = LookupDirAuxFile( psz_input_dir_name,
-                                            i_input_dir_file, i_stc,
-                                            i_input_dir_len );
-    if ( i_nb_skipped_chunks < 0 )
+    i_ret = pi_pcr_sizes[i_pcr_start];
+    memcpy( p_buf, p_pcr_chunks + (size_t)i_pcr_start * i_pcr_len, i_ret );
+    i_pcr_start = (i_pcr_start + 1) % PCR_LOOKAHEAD;
+    i_pcr_nb--;
+    i_pcr_out_packet = i_end;
+    return i_ret;
+}
+
+static void pcr_ExitRead(void)
+{
+    close( i_input_fd );
+    free( p_pcr_chunks );
+}
+
+static int pcr_InitRead( const char *psz_arg, size_t i_len,
+                         off_t i_nb_skipped_chunks, int64_t i_pos )
+{
+    if ( i_pos )
     {
-        /* Try at most one more chunk */
-        i_input_dir_file++;
-        i_nb_skipped_chunks = LookupDirAuxFile( psz_input_dir_name,
-                                                i_input_dir_file, i_stc,
-                                                i_input_dir_len );
-        if ( i_nb_skipped_chunks < 0 )
-        {
-            msg_Err( NULL, "position not found" );
-            return -1;
-        }
+        msg_Err( NULL, "unable to seek in a file without auxiliary file" );
+        return -1;
     }
 
-    i_input_fd = OpenDirFile( psz_input_dir_name, i_input_dir_file,
-                              true, i_input_dir_len, &p_input_aux );
-
+    i_input_fd = OpenFile( psz_arg, true, false );
     lseek( i_input_fd, (off_t)i_len * i_nb_skipped_chunks, SEEK_SET );
-    fseeko( p_input_aux, 8 * i_nb_skipped_chunks, SEEK_SET );
+    i_pcr_len = i_len;
+    p_pcr_chunks = malloc( (size_t)PCR_LOOKAHEAD * i_len );
 
-    pf_Date = real_Date;
-    pf_Sleep = real_Sleep;
-    pf_Read = dir_Read;
-    pf_Delay = dir_Delay;
-    pf_ExitRead = dir_ExitRead;
+    pf_Read = pcr_Read;
+    pf_Delay = file_Delay;
+    pf_ExitRead = pcr_ExitRead;
     return 0;
 }
 
-static char *psz_output_dir_name;
-static size_t i_output_dir_len;
-static uint64_t i_output_dir_file;
+/*****************************************************************************
+ * shaper_*: de-jitter buffer for live inputs
+ *****************************************************************************
+ * The stream clock is recovered from the PCRs with the pcr_* functions, and
+ * mapped to the local clock through an offset which is smoothed over
+ * SHAPER_TAU, so that it follows the clock drift but not the jitter. Chunks
+ * are released at their stream date plus the offset and the latency.
+ *****************************************************************************/
+#define SHAPER_CHUNKS 16384
+#define SHAPER_TAU INT64_C(270000000) /* 10 s */
 
-static ssize_t dir_Write( const void *p_buf, size_t i_len )
+typedef struct shaper_chunk_t
 {
-    uint64_t i_dir_file = GetDirFile( i_rotate_size, i_stc );
-    if ( !i_output_fd || i_dir_file != i_output_dir_file )
+    ssize_t i_size;
+    uint64_t i_end_packet;
+    uint64_t i_arrival, i_release;
+} shaper_chunk_t;
+
+static uint64_t i_shaper_latency = 0;
+static ssize_t (*pf_shaper_Read)( void *p_buf, size_t i_len );
+static uint8_t *p_shaper_buffer;
+static shaper_chunk_t p_shaper_chunks[SHAPER_CHUNKS];
+static unsigned int i_shaper_start = 0, i_shaper_nb = 0, i_shaper_dated = 0;
+static size_t i_shaper_len;
+static bool b_shaper_locked = false;
+static int64_t i_shaper_offset, i_shaper_window_offset;
+static uint64_t i_shaper_window_stream, i_shaper_last_stream;
+static double f_shaper_drift = 0.; /* ppm, over the last SHAPER_TAU */
+static uint64_t i_shaper_last_release = 0, i_shaper_added_latency = 0;
+static unsigned long i_shaper_late = 0, i_shaper_overflows = 0;
+
+#define SHAPER_CHUNK(i) \
+    p_shaper_chunks[(i_shaper_start + (i)) % SHAPER_CHUNKS]
+#define SHAPER_DATA(i) (p_shaper_buffer \
+    + (size_t)((i_shaper_start + (i)) % SHAPER_CHUNKS) * i_shaper_len)
+
+static void shaper_Release( shaper_chunk_t *p_chunk, uint64_t i_release )
+{
+    if ( i_release < i_shaper_last_release )
+        i_release = i_shaper_last_release;
+    p_chunk->i_release = i_shaper_last_release = i_release;
+}
+
+/* Date the chunks which are followed by a PCR */
+static void shaper_Date(void)
+{
+    while ( i_shaper_dated < i_shaper_nb && i_pcr_points_nb >= 2
+             && i_pcr_slope_packets
+             && PCR_POINT(i_pcr_points_nb - 1).i_packet
+                 >= SHAPER_CHUNK(i_shaper_dated).i_end_packet )
     {
-        if ( i_output_fd )
+        shaper_chunk_t *p_chunk = &SHAPER_CHUNK(i_shaper_dated);
+        uint64_t i_stream = pcr_Date( p_chunk->i_end_packet );
+        int64_t i_offset = p_chunk->i_arrival - i_stream;
+
+        if ( !b_shaper_locked )
         {
-            close( i_output_fd );
-            fclose( p_output_aux );
+            i_shaper_offset = i_shaper_window_offset = i_offset;
+            i_shaper_window_stream = i_stream;
+            b_shaper_locked = true;
         }
+        else if ( i_stream > i_shaper_last_stream )
+        {
+            int64_t i_dt = i_stream - i_shaper_last_stream;
+            if ( i_dt > SHAPER_TAU )
+                i_dt = SHAPER_TAU;
+            i_shaper_offset += (i_offset - i_shaper_offset) * i_dt / SHAPER_TAU;
 
-        i_output_dir_file = i_dir_file;
+            if ( i_stream - i_shaper_window_stream >= SHAPER_TAU )
+            {
+                f_shaper_drift = (double)(i_shaper_offset
+                                           - i_shaper_window_offset) * 1e6
+                                  / (i_stream - i_shaper_window_stream);
+                i_shaper_window_offset = i_shaper_offset;
+                i_shaper_window_stream = i_stream;
+            }
+        }
+        i_shaper_last_stream = i_stream;
 
-        i_output_fd = OpenDirFile( psz_output_dir_name, i_output_dir_file,
-                                   false, i_output_dir_len, &p_output_aux );
+        if ( !p_chunk->i_release )
+            shaper_Release( p_chunk, i_stream + i_shaper_offset
+                                      + i_shaper_latency );
+        if ( p_chunk->i_release < p_chunk->i_arrival )
+        {
+            i_shaper_late++;
+            shaper_Release( p_chunk, p_chunk->i_arrival );
+        }
+        i_shaper_dated++;
     }
-
-    return file_Write( p_buf, i_len );
 }
 
-static void dir_ExitWrite(void)
+/* Read one chunk from the input into the buffer */
+static bool shaper_Queue( size_t i_len )
 {
-    free( psz_output_dir_name );
-    if ( i_output_fd )
-    {
-        close( i_output_fd );
-        fclose( p_output_aux );
-    }
+    uint8_t *p_chunk = SHAPER_DATA(i_shaper_nb);
+    ssize_t i_ret = pf_shaper_Read( p_chunk, i_len );
+    uint8_t *p_ts = p_chunk;
+
+    if ( i_ret <= 0 )
+        return false;
+
+    if ( !b_input_udp )
+        p_ts = i_ret >= RTP_HEADER_SIZE ? rtp_payload( p_chunk )
+                                        : p_chunk + i_ret;
+    for ( ; p_ts + TS_SIZE <= p_chunk + i_ret;
+          p_ts += TS_SIZE, i_pcr_read_packet++ )
+        if ( ts_validate( p_ts )
+              && (ts_get_pid( p_ts ) == i_pcr_pid || i_pcr_pid == 8192)
+              && ts_has_adaptation( p_ts ) && ts_get_adaptation( p_ts )
+              && tsaf_has_pcr( p_ts )
+              && i_pcr_points_nb < PCR_LOOKAHEAD )
+            pcr_AddPoint( i_pcr_read_packet,
+                          tsaf_get_pcr( p_ts ) * 300
+                           + tsaf_get_pcrext( p_ts ) );
+
+    SHAPER_CHUNK(i_shaper_nb).i_size = i_ret;
+    SHAPER_CHUNK(i_shaper_nb).i_end_packet = i_pcr_read_packet;
+    SHAPER_CHUNK(i_shaper_nb).i_arrival = i_input_arrival;
+    SHAPER_CHUNK(i_shaper_nb).i_release = 0;
+    i_shaper_nb++;
+    shaper_Date();
+    return true;
 }
 
-static int dir_InitWrite( const char *psz_arg, size_t i_len, bool b_append )
+static bool shaper_Pending(void)
+{
+    struct pollfd pfd;
+
+    pfd.fd = i_input_fd;
+    pfd.events = POLLIN;
+    return poll( &pfd, 1, 0 ) > 0;
+}
+
+static ssize_t shaper_Read( void *p_buf, size_t i_len )
+{
+    shaper_chunk_t *p_chunk;
+    ssize_t i_ret;
+
+    for ( ; ; )
+    {
+        /* Take in what has already arrived */
+        while ( !b_die && i_shaper_nb < SHAPER_CHUNKS && shaper_Pending() )
+            shaper_Queue( i_len );
+        if ( b_die )
+            return 0;
+
+        if ( i_shaper_nb )
+        {
+            p_chunk = &SHAPER_CHUNK(0);
+            if ( p_chunk->i_release )
+                break;
+
+            /* Not dated in time (no PCR), or no more room */
+            if ( pf_Date() >= p_chunk->i_arrival + i_shaper_latency
+                  || i_shaper_nb == SHAPER_CHUNKS )
+            {
+                if ( i_shaper_nb == SHAPER_CHUNKS )
+                    i_shaper_overflows++;
+                else
+                    i_shaper_late++;
+                shaper_Release( p_chunk, pf_Date() );
+                break;
+            }
+        }
+
+        /* Wait for the input */
+        if ( !shaper_Queue( i_len ) )
+            return 0;
+    }
+
+    i_ret = p_chunk->i_size;
+    memcpy( p_buf, SHAPER_DATA(0), i_ret );
+    i_stc = p_chunk->i_release;
+    i_input_arrival = p_chunk->i_arrival;
+    i_shaper_added_latency = p_chunk->i_release - p_chunk->i_arrival;
+    i_shaper_start = (i_shaper_start + 1) % SHAPER_CHUNKS;
+    i_shaper_nb--;
+    if ( i_shaper_dated )
+        i_shaper_dated--;
+    return i_ret;
+}
+
+static bool shaper_Delay(void)
+{
+    uint64_t i_wall = pf_Date();
+
+    if ( i_stc > i_wall )
+        pf_Sleep( i_stc - i_wall );
+    return true;
+}
+
+/* Appends the buffer statistics to the -T file */
+static size_t shaper_Stats( char *psz_stats )
+{
+    return sprintf( psz_stats, "<SHAPER chunks=\"%u\" latency=\"%"PRIu64"\" drift=\"%.3f\" late=\"%lu\" overflows=\"%lu\"/>",
+                    i_shaper_nb, i_shaper_added_latency, f_shaper_drift,
+                    i_shaper_late, i_shaper_overflows );
+}
+
+static void shaper_Init( size_t i_len )
+{
+    i_shaper_len = i_len;
+    p_shaper_buffer = malloc( (size_t)SHAPER_CHUNKS * i_len );
+    pf_shaper_Read = pf_Read;
+    pf_Read = shaper_Read;
+    pf_Delay = shaper_Delay;
+}
+
+/*****************************************************************************
+ * reorder_*: re-sequencing of RTP inputs
+ *****************************************************************************
+ * Datagrams are held in a window of a few slots indexed by the distance of
+ * their RTP sequence number to the next one expected, so that the window
+ * doesn't depend on how the depth divides 65536, and released in order as
+ * soon as the next one is there.
+ * A missing datagram is given up on (and counted as lost) when the oldest
+ * datagram held has waited for REORDER_HOLD, or when a datagram arrives
+ * beyond the window.
+ *****************************************************************************/
+#define REORDER_HOLD UINT64_C(1350000) /* 50 ms */
+
+typedef struct reorder_slot_t
+{
+    ssize_t i_size; /* 0 if empty */
+    uint64_t i_arrival;
+    bool b_stored;
+    uint16_t i_seqnum; /* last stored */
+} reorder_slot_t;
+
+static unsigned int i_reorder_depth = 0;
+static ssize_t (*pf_reorder_Read)( void *p_buf, size_t i_len );
+static uint8_t *p_reorder_buffer, *p_reorder_in;
+static reorder_slot_t *p_reorder_slots;
+static size_t i_reorder_len;
+static bool b_reorder_started = false, b_reorder_pending = false;
+static uint16_t i_reorder_next, i_reorder_highest;
+static unsigned int i_reorder_head = 0; /* slot of i_reorder_next */
+static ssize_t i_reorder_in_size;
+static uint64_t i_reorder_in_arrival, i_reorder_last_stc = 0;
+static unsigned int i_reorder_held = 0;
+static unsigned long i_reorder_lost = 0, i_reorder_duplicates = 0;
+static unsigned long i_reorder_reordered = 0, i_reorder_late = 0;
+
+#define REORDER_SLOT(i_seqnum) \
+    p_reorder_slots[reorder_Index(i_seqnum)]
+#define REORDER_DATA(i_seqnum) \
+    (p_reorder_buffer + reorder_Index(i_seqnum) * i_reorder_len)
+
+/* Slot of a sequence number in the window, or of a recently released one */
+static unsigned int reorder_Index( uint16_t i_seqnum )
+{
+    uint16_t i_delta = i_seqnum - i_reorder_next;
+
+    if ( i_delta < 0x8000 )
+        return (i_reorder_head + i_delta) % i_reorder_depth;
+    i_delta = i_reorder_next - i_seqnum;
+    return (i_reorder_head + i_reorder_depth - i_delta % i_reorder_depth)
+            % i_reorder_depth;
+}
+
+/* Moves the window forward by one sequence number */
+static void reorder_Advance(void)
+{
+    i_reorder_next++;
+    i_reorder_head = (i_reorder_head + 1) % i_reorder_depth;
+}
+
+/* Places the datagram just read in the window, returns false if it is
+ * beyond the window */
+static bool reorder_Queue(void)
+{
+    uint16_t i_seqnum = rtp_get_seqnum( p_reorder_in );
+    uint16_t i_delta;
+    reorder_slot_t *p_slot;
+
+    if ( !b_reorder_started )
+    {
+        i_reorder_next = i_reorder_highest = i_seqnum;
+        b_reorder_started = true;
+    }
+
+    i_delta = i_seqnum - i_reorder_next;
+    if ( i_delta >= 0x8000 )
+    {
+        /* Already released, or given up on */
+        p_slot = &REORDER_SLOT(i_seqnum);
+        if ( p_slot->b_stored && p_slot->i_seqnum == i_seqnum )
+            i_reorder_duplicates++;
+        else
+            i_reorder_late++;
+        return true;
+    }
+    if ( i_delta >= i_reorder_depth )
+        return false;
+
+    p_slot = &REORDER_SLOT(i_seqnum);
+    if ( p_slot->i_size )
+    {
+        i_reorder_duplicates++;
+        return true;
+    }
+
+    if ( i_reorder_held
+          && (uint16_t)(i_reorder_highest - i_seqnum) < 0x8000 )
+        i_reorder_reordered++;
+    else
+        i_reorder_highest = i_seqnum;
+
+    memcpy( REORDER_DATA(i_seqnum), p_reorder_in, i_reorder_in_size );
+    p_slot->i_size = i_reorder_in_size;
+    p_slot->i_arrival = i_reorder_in_arrival;
+    p_slot->b_stored = true;
+    p_slot->i_seqnum = i_seqnum;
+    i_reorder_held++;
+    return true;
+}
+
+static uint64_t reorder_Oldest(void)
+{
+    uint64_t i_oldest = UINT64_MAX;
+    unsigned int i;
+
+    for ( i = 0; i < i_reorder_depth; i++ )
+        if ( p_reorder_slots[i].i_size
+              && p_reorder_slots[i].i_arrival < i_oldest )
+            i_oldest = p_reorder_slots[i].i_arrival;
+    return i_oldest;
+}
+
+/* Waits for the input until the oldest datagram held has to be released */
+static bool reorder_Wait(void)
+{
+    uint64_t i_deadline = reorder_Oldest() + REORDER_HOLD;
+    uint64_t i_wall = pf_Date();
+    struct pollfd pfd;
+
+    if ( i_wall >= i_deadline )
+        return false;
+    pfd.fd = i_input_fd;
+    pfd.events = POLLIN;
+    return poll( &pfd, 1, (i_deadline - i_wall) / 27000 + 1 ) > 0;
+}
+
+static ssize_t reorder_Read( void *p_buf, size_t i_len )
+{
+    for ( ; ; )
+    {
+        reorder_slot_t *p_slot = &REORDER_SLOT(i_reorder_next);
+
+        if ( b_reorder_pending && reorder_Queue() )
+            b_reorder_pending = false;
+
+        if ( p_slot->i_size )
+        {
+            ssize_t i_ret = p_slot->i_size;
+
+            memcpy( p_buf, REORDER_DATA(i_reorder_next), i_ret );
+            /* Keep the dates monotonic */
+            i_stc = p_slot->i_arrival > i_reorder_last_stc ?
+                    p_slot->i_arrival : i_reorder_last_stc;
+            i_reorder_last_stc = i_input_arrival = i_stc;
+            p_slot->i_size = 0;
+            reorder_Advance();
+            i_reorder_held--;
+            return i_ret;
+        }
+
+        /* Give up on the missing datagram */
+        if ( i_reorder_held && (b_reorder_pending
+                                 || pf_Date() >= reorder_Oldest()
+                                                  + REORDER_HOLD) )
+        {
+            i_reorder_lost++;
+            reorder_Advance();
+            continue;
+        }
+
+        /* Nothing held: start again from the datagram beyond the window */
+        if ( b_reorder_pending )
+        {
+            i_reorder_lost += (uint16_t)(rtp_get_seqnum( p_reorder_in )
+                                          - i_reorder_next);
+            i_reorder_next = rtp_get_seqnum( p_reorder_in );
+            continue;
+        }
+
+        if ( i_reorder_held && !reorder_Wait() )
+            continue;
+
+        i_reorder_in_size = pf_reorder_Read( p_reorder_in, i_len );
+        if ( i_reorder_in_size <= 0 )
+            return i_reorder_in_size;
+        if ( i_reorder_in_size < RTP_HEADER_SIZE )
+            continue;
+        i_reorder_in_arrival = i_input_arrival;
+        b_reorder_pending = !reorder_Queue();
+    }
+}
+
+/* Appends the re-sequencing statistics to the -T file */
+static size_t reorder_Stats( char *psz_stats )
+{
+    return sprintf( psz_stats, "<REORDER lost=\"%lu\" duplicates=\"%lu\" reordered=\"%lu\" late=\"%lu\"/>",
+                    i_reorder_lost, i_reorder_duplicates,
+                    i_reorder_reordered, i_reorder_late );
+}
+
+static void reorder_Init( size_t i_len )
+{
+    i_reorder_len = i_len;
+    p_reorder_buffer = malloc( (size_t)i_reorder_depth * i_len );
+    p_reorder_in = malloc( i_len );
+    p_reorder_slots = calloc( i_reorder_depth, sizeof(reorder_slot_t) );
+    pf_reorder_Read = pf_Read;
+    pf_Read = reorder_Read;
+}
+
+/*****************************************************************************
+ * dir_*: handler for the auxiliary directory format
+ *****************************************************************************/
+static char *psz_input_dir_name;
+static size_t i_input_dir_len;
+static uint64_t i_input_dir_file;
+static uint64_t i_input_dir_delay;
+
+static bool dir_NextFile(void)
+{
+    close( i_input_fd );
+    CloseAuxFile( p_input_aux );
+    p_input_aux = NULL;
+    i_input_fd = 0;
+    if ( i_input_null_fd != -1 )
+        close( i_input_null_fd );
+
+    i_input_dir_file++;
+    i_input_chunk = 0;
+
+    i_input_fd = OpenDirFile( psz_input_dir_name, i_input_dir_file,
+                              true, i_input_dir_len, &p_input_aux );
+    if ( i_input_fd < 0 )
+    {
+        msg_Err( NULL, "end of files reached" );
+        i_input_fd = 0;
+        i_input_null_fd = -1;
+        b_die = 1;
+        return false;
+    }
+    i_input_null_fd = OpenDirNullFile( psz_input_dir_name, i_input_dir_file,
+                                       i_input_dir_len, true, 0 );
+    return true;
+}
+
+static ssize_t dir_Read( void *p_buf, size_t i_len )
+{
+    ssize_t i_ret;
+try_again:
+    i_ret = file_Read( p_buf, i_len );
+    if ( !i_ret )
+    {
+        b_die = 0; /* we're not dead yet */
+        if ( !dir_NextFile() )
+            return 0;
+        goto try_again;
+    }
+    return i_ret;
+}
+
+static bool dir_Delay(void)
+{
+    uint64_t i_wall;
+    int64_t i_delay;
+
+    if ( !i_input_dir_delay )
+        i_input_dir_delay = pf_Date() - i_stc;
+    i_wall = pf_Date() - i_input_dir_delay;
+    i_delay = i_stc - i_wall;
+
+    if ( i_delay > 0 )
+        pf_Sleep( i_delay );
+    else if ( i_delay < -MAX_LATENESS )
+    {
+        msg_Warn( NULL, "dropping late packet" );
+        return false;
+    }
+    return true;
+}
+
+static void dir_ExitRead(void)
+{
+    free( psz_input_dir_name );
+    if ( i_input_fd )
+    {
+        close( i_input_fd );
+        CloseAuxFile( p_input_aux );
+    }
+    if ( i_input_null_fd != -1 )
+        close( i_input_null_fd );
+}
+
+static int dir_InitRead( const char *psz_arg, size_t i_len,
+                         off_t i_nb_skipped_chunks, int64_t i_pos )
+{
+    off_t i_rap;
+
+    if ( i_nb_skipped_chunks )
+    {
+        msg_Err( NULL, "unable to skip chunks with directory input" );
+        return -1;
+    }
+
+    if ( i_pos <= 0 )
+        i_pos += real_Date();
+    if ( i_pos <= 0 )
+    {
+        msg_Err( NULL, "invalid position" );
+        return -1;
+    }
+    i_first_stc = i_stc = i_pos;
+    i_input_dir_delay = real_Date() - i_stc;
+
+    psz_input_dir_name = strdup( psz_arg );
+    i_input_dir_len = i_len;
+    i_input_dir_file = GetDirFile( i_rotate_size, i_pos );
+
+    i_nb_skipped_chunks = LookupDirAuxFile( psz_input_dir_name,
+                                            i_input_dir_file, i_stc,
+                                            i_input_dir_len );
+    if ( i_nb_skipped_chunks < 0 )
+    {
+        /* Try at most one more chunk */
+        i_input_dir_file++;
+        i_nb_skipped_chunks = LookupDirAuxFile( psz_input_dir_name,
+                                                i_input_dir_file, i_stc,
+                                                i_input_dir_len );
+        if ( i_nb_skipped_chunks < 0 )
+        {
+            msg_Err( NULL, "position not found" );
+            return -1;
+        }
+    }
+
+    /* Start at the last random access point, possibly at the end of the
+     * previous file */
+    i_rap = LookupDirRAPFile( psz_input_dir_name, i_input_dir_file,
+                              i_nb_skipped_chunks, i_len );
+    if ( i_rap < 0 && i_input_dir_file )
+    {
+        i_rap = LookupDirRAPFile( psz_input_dir_name, i_input_dir_file - 1,
+                                  INT64_MAX, i_len );
+        if ( i_rap >= 0 )
+            i_input_dir_file--;
+    }
+    if ( i_rap >= 0 )
+    {
+        msg_Dbg( NULL, "starting at random access point %jd of file %"PRIu64,
+                 (intmax_t)i_rap, i_input_dir_file );
+        i_nb_skipped_chunks = i_rap;
+        /* Play the chunks before the position instead of dropping them */
+        i_input_dir_delay = 0;
+    }
+
+    i_input_fd = OpenDirFile( psz_input_dir_name, i_input_dir_file,
+                              true, i_input_dir_len, &p_input_aux );
+
+    if ( p_input_aux == NULL )
+    {
+        i_input_chunk = i_nb_skipped_chunks;
+        lseek( i_input_fd, ct_get_offset( i_nb_skipped_chunks, i_len ),
+               SEEK_SET );
+    }
+    else
+    {
+        lseek( i_input_fd, (off_t)i_len * i_nb_skipped_chunks, SEEK_SET );
+        SeekAuxFile( p_input_aux, i_nb_skipped_chunks );
+    }
+    i_input_null_fd = OpenDirNullFile( psz_input_dir_name, i_input_dir_file,
+                                       i_len, true, i_nb_skipped_chunks );
+
+    pf_Date = real_Date;
+    pf_Sleep = real_Sleep;
+    pf_Read = dir_Read;
+    /* Other speeds can't keep the delay to real time */
+    pf_Delay = i_speed == SPEED_UNIT ? dir_Delay : file_Delay;
+    pf_NextFile = dir_NextFile;
+    pf_ExitRead = dir_ExitRead;
+    return 0;
+}
+
+static char *psz_output_dir_name;
+static size_t i_output_dir_len;
+static uint64_t i_output_dir_file;
+static dir_retention_t *p_output_dir_retention = NULL;
+
+static ssize_t dir_Write( const void *p_buf, size_t i_len )
+{
+    uint64_t i_dir_file = GetDirFile( i_rotate_size, i_stc );
+    if ( !i_output_fd || i_dir_file != i_output_dir_file )
+    {
+        struct stat st;
+
+        if ( i_output_fd )
+        {
+            close( i_output_fd );
+            CloseAuxFile( p_output_aux );
+        }
+        if ( i_output_rap_fd != -1 )
+            close( i_output_rap_fd );
+        if ( i_output_null_fd != -1 )
+            close( i_output_null_fd );
+
+        i_output_dir_file = i_dir_file;
+
+        if ( b_output_container )
+        {
+            i_output_fd = OpenDirFile( psz_output_dir_name,
+                                       i_output_dir_file, false,
+                                       i_output_dir_len, NULL );
+            p_output_aux = NULL;
+            i_output_chunk = fstat( i_output_fd, &st ) < 0 ? 0 :
+                             ct_get_chunks( st.st_size, i_output_dir_len );
+        }
+        else
+        {
+            i_output_fd = OpenDirFile( psz_output_dir_name,
+                                       i_output_dir_file, false,
+                                       i_output_dir_len, &p_output_aux );
+            i_output_chunk = fstat( i_output_fd, &st ) < 0 ? 0 :
+                             st.st_size / i_output_dir_len;
+        }
+
+        if ( i_rap_pid )
+            i_output_rap_fd = OpenDirRAPFile( psz_output_dir_name,
+                                              i_output_dir_file,
+                                              i_output_dir_len,
+                                              i_output_chunk );
+        if ( b_null_strip )
+            i_output_null_fd = OpenDirNullFile( psz_output_dir_name,
+                                                i_output_dir_file,
+                                                i_output_dir_len, false,
+                                                i_output_chunk );
+
+        if ( p_output_dir_retention != NULL )
+            UpdateDirRetention( p_output_dir_retention, i_output_dir_file,
+                                i_stc );
+    }
+
+    return file_Write( p_buf, i_len );
+}
+
+static void dir_ExitWrite(void)
+{
+    StopDirRetention( p_output_dir_retention );
+    free( psz_output_dir_name );
+    if ( i_output_fd )
+    {
+        close( i_output_fd );
+        CloseAuxFile( p_output_aux );
+    }
+    if ( i_output_rap_fd != -1 )
+        close( i_output_rap_fd );
+    if ( i_output_null_fd != -1 )
+        close( i_output_null_fd );
+}
+
+static int dir_InitWrite( const char *psz_arg, size_t i_len, bool b_append )
 {
     psz_output_dir_name = strdup( psz_arg );
     i_output_dir_len = i_len;
     i_output_dir_file = 0;
     i_output_fd = 0;
 
-    pf_Date = real_Date;
-    pf_Sleep = real_Sleep;
-    pf_Write = dir_Write;
-    pf_ExitWrite = dir_ExitWrite;
+    if ( i_retention_files || i_retention_age || i_retention_usage )
+    {
+        p_output_dir_retention = StartDirRetention( psz_output_dir_name, i_len,
+                                    i_rotate_size, i_retention_files,
+                                    i_retention_age, i_retention_usage );
+        if ( p_output_dir_retention == NULL )
+            return -1;
+    }
+
+    pf_Date = real_Date;
+    pf_Sleep = real_Sleep;
+    pf_Write = dir_Write;
+    pf_ExitWrite = dir_ExitWrite;
+
+    return 0;
+}
+
+/*****************************************************************************
+ * null_*: recording without null packets, and playback restoring them
+ *****************************************************************************
+ * When recording, the null packets are removed and the others are packed
+ * into full chunks; the number of null packets removed before each chunk is
+ * written to a .nul file. When playing back, the null packets are spread
+ * evenly between the packets of the chunk, so that the original bitrate is
+ * restored, and the chunks are dated between the dates of the stored ones.
+ *****************************************************************************/
+static ssize_t (*pf_null_Read)( void *p_buf, size_t i_len );
+static ssize_t (*pf_null_Write)( const void *p_buf, size_t i_len );
+static void (*pf_null_ExitWrite)(void);
+static uint8_t *p_null_buffer;
+static size_t i_null_len, i_null_size = 0;
+static uint32_t i_null_dropped = 0;
+/* playback */
+static uint8_t *p_null_chunk;
+static size_t i_null_real = 0, i_null_total = 0, i_null_pos = 0;
+static size_t i_null_real_pos = 0;
+static uint64_t i_null_last_stc = 0, i_null_stc = 0;
+
+static ssize_t null_Write( const void *p_buf, size_t i_len )
+{
+    const uint8_t *p_ts = p_buf;
+
+    for ( ; p_ts + TS_SIZE <= (const uint8_t *)p_buf + i_len;
+          p_ts += TS_SIZE )
+    {
+        if ( ts_get_pid( p_ts ) == NULL_PID )
+        {
+            if ( i_null_dropped < UINT32_MAX )
+                i_null_dropped++;
+            continue;
+        }
+
+        memcpy( p_null_buffer + i_null_size, p_ts, TS_SIZE );
+        i_null_size += TS_SIZE;
+        if ( i_null_size == i_null_len )
+        {
+            i_output_nulls = i_null_dropped;
+            i_null_dropped = 0;
+            i_null_size = 0;
+            pf_null_Write( p_null_buffer, i_null_len );
+        }
+    }
+    return i_len;
+}
+
+static void null_ExitWrite(void)
+{
+    /* Complete the last chunk, the padding counting as regular packets */
+    if ( i_null_size )
+    {
+        while ( i_null_size < i_null_len )
+        {
+            ts_pad( p_null_buffer + i_null_size );
+            i_null_size += TS_SIZE;
+        }
+        i_output_nulls = i_null_dropped;
+        pf_null_Write( p_null_buffer, i_null_len );
+    }
+    pf_null_ExitWrite();
+}
+
+static ssize_t null_Read( void *p_buf, size_t i_len )
+{
+    uint8_t *p_out = p_buf;
+    size_t i_size = 0;
+
+    while ( i_size < i_null_len )
+    {
+        if ( i_null_pos == i_null_total )
+        {
+            ssize_t i_ret = pf_null_Read( p_null_chunk, i_len );
+            uint32_t i_nulls;
+
+            if ( i_ret <= 0 )
+            {
+                if ( !i_size )
+                    return i_ret;
+                break;
+            }
+            if ( i_input_null_fd == -1
+                  || !ReadNullFile( i_input_null_fd, &i_nulls ) )
+                i_nulls = 0;
+
+            i_null_last_stc = i_null_stc;
+            i_null_stc = i_stc;
+            i_null_real = i_ret / TS_SIZE;
+            i_null_total = i_null_real + i_nulls;
+            i_null_pos = i_null_real_pos = 0;
+            continue;
+        }
+
+        /* Spread the stored packets evenly among the null packets */
+        if ( i_null_real_pos < i_null_real
+              && (uint64_t)i_null_real_pos * i_null_total
+                  <= (uint64_t)i_null_pos * i_null_real )
+        {
+            memcpy( p_out + i_size, p_null_chunk + i_null_real_pos * TS_SIZE,
+                    TS_SIZE );
+            i_null_real_pos++;
+        }
+        else
+            ts_pad( p_out + i_size );
+        i_size += TS_SIZE;
+        i_null_pos++;
+    }
+
+    /* Date of the last packet */
+    if ( !i_null_last_stc || i_null_stc <= i_null_last_stc
+          || i_null_stc - i_null_last_stc > MAX_LATENESS )
+        i_stc = i_null_stc;
+    else
+        i_stc = i_null_last_stc + (i_null_stc - i_null_last_stc)
+                                   * i_null_pos / i_null_total;
+    return i_size;
+}
+
+static void null_InitWrite( size_t i_len )
+{
+    i_null_len = i_len - i_len % TS_SIZE;
+    p_null_buffer = malloc( i_null_len );
+    pf_null_Write = pf_Write;
+    pf_null_ExitWrite = pf_ExitWrite;
+    pf_Write = null_Write;
+    pf_ExitWrite = null_ExitWrite;
+}
+
+static void null_InitRead( size_t i_len )
+{
+    i_null_len = i_len - i_len % TS_SIZE;
+    p_null_chunk = malloc( i_len );
+    pf_null_Read = pf_Read;
+    pf_Read = null_Read;
+}
+
+/*****************************************************************************
+ * playlist_*: handler for a list of files played back to back
+ *****************************************************************************
+ * The playlist has the path of a file (or container) per line; empty lines
+ * and lines starting with # are ignored. The STC, PCRs, DTSs, PTSs and
+ * continuity counters run on from one file to the next, and every file is
+ * opened by a separate thread while the previous one is being played.
+ * A file played in a loop is handled as a playlist of one file.
+ *****************************************************************************/
+#define PLAYLIST_SCAN_CHUNKS 1024
+#define PLAYLIST_READAHEAD 4194304 /* bytes */
+
+typedef struct playlist_item_t
+{
+    int i_fd;
+    aux_file_t *p_aux;
+    uint64_t i_first_stc;
+    bool b_pcr;
+    uint64_t i_pcr, i_pcr_stc;
+} playlist_item_t;
+
+static bool b_playlist = false, b_loop = false;
+static char **ppsz_playlist = NULL;
+static unsigned int i_nb_playlist = 0, i_playlist_index;
+static size_t i_playlist_len;
+static playlist_item_t playlist_next;
+static pthread_t playlist_thread;
+static bool b_playlist_thread = false;
+static uint64_t i_playlist_stc_offset = 0;
+static uint64_t i_playlist_last_stc = 0, i_playlist_interval = 0;
+
+static bool playlist_Load( const char *psz_arg )
+{
+    FILE *p_file = fopen( psz_arg, "r" );
+    char psz_line[PATH_MAX + 2];
+
+    if ( p_file == NULL )
+    {
+        msg_Err( NULL, "couldn't open playlist %s (%s)", psz_arg,
+                 strerror(errno) );
+        return false;
+    }
+
+    while ( fgets( psz_line, sizeof(psz_line), p_file ) != NULL )
+    {
+        psz_line[strcspn( psz_line, "\r\n" )] = '\0';
+        if ( !psz_line[0] || psz_line[0] == '#' )
+            continue;
+        ppsz_playlist = realloc( ppsz_playlist,
+                                 (i_nb_playlist + 1) * sizeof(char *) );
+        ppsz_playlist[i_nb_playlist++] = strdup( psz_line );
+    }
+    fclose( p_file );
+
+    if ( !i_nb_playlist )
+    {
+        msg_Err( NULL, "empty playlist %s", psz_arg );
+        return false;
+    }
+    return true;
+}
+
+static bool playlist_Open( const char *psz_file, playlist_item_t *p_item )
+{
+    size_t i_container_len = GetContainerPayloadSize( psz_file );
+    uint8_t *p_buf;
+    off_t i_chunk;
+
+    memset( p_item, 0, sizeof(playlist_item_t) );
+    p_item->i_fd = -1;
+    if ( !S_ISREG( StatFile( psz_file ) ) )
+    {
+        msg_Err( NULL, "%s isn't a file", psz_file );
+        return false;
+    }
+    if ( i_container_len && i_container_len != i_playlist_len )
+    {
+        msg_Err( NULL, "%s has a payload size of %zu", psz_file,
+                 i_container_len );
+        return false;
+    }
+
+    p_item->i_fd = OpenFile( psz_file, true, false );
+    if ( !i_container_len )
+    {
+        char *psz_aux_file = GetAuxFile( psz_file, i_playlist_len );
+        p_item->p_aux = OpenAuxFile( psz_aux_file, true, false );
+        free( psz_aux_file );
+        if ( p_item->p_aux == NULL )
+        {
+            close( p_item->i_fd );
+            p_item->i_fd = -1;
+            return false;
+        }
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise( p_item->i_fd, 0, PLAYLIST_READAHEAD, POSIX_FADV_WILLNEED );
+#endif
+
+    /* Find the first STC and PCR, to join them to the previous file */
+    p_buf = malloc( i_playlist_len );
+    for ( i_chunk = 0; i_chunk < PLAYLIST_SCAN_CHUNKS && !p_item->b_pcr;
+          i_chunk++ )
+    {
+        uint64_t i_chunk_stc;
+        uint8_t *p_ts;
+
+        if ( p_item->p_aux == NULL )
+        {
+            if ( ReadContainer( p_item->i_fd, i_chunk, &i_chunk_stc, p_buf,
+                                i_playlist_len ) <= 0 )
+                break;
+        }
+        else if ( pread( p_item->i_fd, p_buf, i_playlist_len,
+                         (off_t)i_playlist_len * i_chunk ) != i_playlist_len
+                   || !ReadAuxFile( p_item->p_aux, &i_chunk_stc ) )
+            break;
+        if ( !i_chunk )
+            p_item->i_first_stc = i_chunk_stc;
+
+        for ( p_ts = p_buf; p_ts + TS_SIZE <= p_buf + i_playlist_len;
+              p_ts += TS_SIZE )
+        {
+            if ( ts_validate( p_ts )
+                  && (!i_pcr_pid || i_pcr_pid == 8192
+                       || ts_get_pid( p_ts ) == i_pcr_pid)
+                  && ts_has_adaptation( p_ts ) && ts_get_adaptation( p_ts )
+                  && tsaf_has_pcr( p_ts ) )
+            {
+                p_item->b_pcr = true;
+                p_item->i_pcr = tsaf_get_pcr( p_ts ) * 300
+                                 + tsaf_get_pcrext( p_ts );
+                p_item->i_pcr_stc = i_chunk_stc;
+                break;
+            }
+        }
+    }
+    free( p_buf );
+
+    if ( !i_chunk )
+    {
+        msg_Err( NULL, "%s is empty", psz_file );
+        close( p_item->i_fd );
+        CloseAuxFile( p_item->p_aux );
+        p_item->i_fd = -1;
+        return false;
+    }
+
+    if ( p_item->p_aux == NULL )
+        lseek( p_item->i_fd, 0, SEEK_SET );
+    else
+        SeekAuxFile( p_item->p_aux, 0 );
+    return true;
+}
+
+/* Returns the index of the next file, or -1 at the end of the playlist */
+static int playlist_NextIndex(void)
+{
+    if ( i_playlist_index + 1 < i_nb_playlist )
+        return i_playlist_index + 1;
+    return b_loop ? 0 : -1;
+}
+
+static void *playlist_Thread( void *p_arg )
+{
+    sigset_t set;
+
+    /* Leave the signals to the main thread */
+    sigfillset( &set );
+    pthread_sigmask( SIG_BLOCK, &set, NULL );
+
+    playlist_Open( ppsz_playlist[playlist_NextIndex()], &playlist_next );
+    return NULL;
+}
+
+static void playlist_Prefetch(void)
+{
+    if ( playlist_NextIndex() == -1 )
+        return;
+    if ( pthread_create( &playlist_thread, NULL, playlist_Thread, NULL ) )
+        msg_Warn( NULL, "couldn't create playlist thread" );
+    else
+        b_playlist_thread = true;
+}
+
+static void playlist_Join( const playlist_item_t *p_item )
+{
+    /* The first chunk comes one chunk interval after the last one */
+    i_playlist_stc_offset = i_playlist_last_stc + i_playlist_interval
+                             - p_item->i_first_stc;
+
+    /* Carry the PCR offset over, as if the PCR had run on */
+    if ( p_item->b_pcr && i_last_pcr != TS_CLOCK_MAX )
+    {
+        uint64_t i_pcr_stc = p_item->i_pcr_stc + i_playlist_stc_offset;
+        uint64_t i_next_pcr = (i_last_pcr + i_pcr_offset
+                                + (i_pcr_stc - i_last_pcr_date)) % TS_CLOCK_MAX;
+
+        i_pcr_offset = (TS_CLOCK_MAX + i_next_pcr - p_item->i_pcr)
+                        % TS_CLOCK_MAX;
+        i_last_pcr = p_item->i_pcr;
+        i_last_pcr_date = i_pcr_stc;
+    }
+}
+
+static bool playlist_Next(void)
+{
+    unsigned int i_failures = 0;
+
+    close( i_input_fd );
+    CloseAuxFile( p_input_aux );
+    p_input_aux = NULL;
+    i_input_fd = -1;
+
+    do
+    {
+        int i_next = playlist_NextIndex();
+        if ( i_next == -1 )
+        {
+            msg_Dbg( NULL, "end of playlist reached" );
+            return false;
+        }
+
+        if ( b_playlist_thread )
+        {
+            pthread_join( playlist_thread, NULL );
+            b_playlist_thread = false;
+        }
+        else
+            playlist_Open( ppsz_playlist[i_next], &playlist_next );
+        if ( playlist_next.i_fd == -1 )
+        {
+            msg_Warn( NULL, "skipping %s", ppsz_playlist[i_next] );
+            if ( ++i_failures >= i_nb_playlist )
+                return false; /* nothing left to play in a loop */
+        }
+        i_playlist_index = i_next;
+    }
+    while ( playlist_next.i_fd == -1 );
+
+    msg_Dbg( NULL, "playing %s", ppsz_playlist[i_playlist_index] );
+    i_input_fd = playlist_next.i_fd;
+    p_input_aux = playlist_next.p_aux;
+    i_input_chunk = 0;
+    playlist_Join( &playlist_next );
+
+    playlist_Prefetch();
+    return true;
+}
+
+static ssize_t playlist_Read( void *p_buf, size_t i_len )
+{
+    ssize_t i_ret;
+try_again:
+    i_ret = file_Read( p_buf, i_len );
+    if ( !i_ret )
+    {
+        if ( b_error )
+            return 0;
+        b_die = 0; /* we're not dead yet */
+        if ( !playlist_Next() )
+        {
+            b_die = 1;
+            return 0;
+        }
+        goto try_again;
+    }
+
+    i_stc += i_playlist_stc_offset;
+    if ( i_playlist_last_stc )
+        i_playlist_interval = i_stc - i_playlist_last_stc;
+    i_playlist_last_stc = i_stc;
+    return i_ret;
+}
+
+static void playlist_ExitRead(void)
+{
+    unsigned int i;
+
+    if ( b_playlist_thread )
+    {
+        pthread_join( playlist_thread, NULL );
+        if ( playlist_next.i_fd != -1 )
+        {
+            close( playlist_next.i_fd );
+            CloseAuxFile( playlist_next.p_aux );
+        }
+    }
+    if ( i_input_fd != -1 )
+        file_ExitRead();
+
+    for ( i = 0; i < i_nb_playlist; i++ )
+        free( ppsz_playlist[i] );
+    free( ppsz_playlist );
+}
+
+static int playlist_InitRead( const char *psz_arg, size_t i_len,
+                              off_t i_nb_skipped_chunks, int64_t i_pos )
+{
+    if ( !b_playlist )
+    {
+        if ( !S_ISREG( StatFile( psz_arg ) ) )
+        {
+            msg_Err( NULL, "only files can be played in a loop" );
+            return -1;
+        }
+        ppsz_playlist = malloc( sizeof(char *) );
+        ppsz_playlist[0] = strdup( psz_arg );
+        i_nb_playlist = 1;
+    }
+    else if ( !playlist_Load( psz_arg ) )
+        return -1;
+    i_playlist_len = i_len;
+    i_playlist_index = 0;
+
+    /* -s and -k apply to the first file */
+    if ( file_InitRead( ppsz_playlist[0], i_len, i_nb_skipped_chunks,
+                        i_pos ) < 0 )
+        return -1;
+
+    pf_Read = playlist_Read;
+    pf_ExitRead = playlist_ExitRead;
+    playlist_Prefetch();
+    return 0;
+}
+
+/*****************************************************************************
+ * stripe_*: handler for a directory spread over several disks
+ *****************************************************************************
+ * Successive files are placed in turn on the output directory and the
+ * directories given with -J, or on the one with the most free space (-F).
+ * Every directory has its own thread and write queue, so that a slow disk
+ * delays neither the others nor the input.
+ *****************************************************************************/
+#define STRIPE_QUEUE_SIZE 4096 /* chunks */
+
+typedef struct stripe_chunk_t
+{
+    uint64_t i_file, i_stc;
+    size_t i_len; /* 0 to close the file */
+    uint8_t *p_buf;
+} stripe_chunk_t;
+
+typedef struct stripe_disk_t
+{
+    char *psz_path;
+    dir_retention_t *p_retention;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wait, space;
+    stripe_chunk_t *p_queue;
+    unsigned int i_start, i_nb;
+    bool b_exit;
+
+    /* owned by the thread */
+    int i_fd, i_rap_fd;
+    aux_file_t *p_aux;
+    uint64_t i_file, i_next_flush;
+    off_t i_chunk;
+} stripe_disk_t;
+
+static const char **ppsz_stripe_dirs = NULL;
+static unsigned int i_nb_stripe_dirs = 0;
+static bool b_stripe_free_space = false;
+static stripe_disk_t *p_stripe_disks;
+static unsigned int i_nb_stripe_disks;
+static int i_stripe_disk = -1;
+static uint64_t i_stripe_file;
+static size_t i_stripe_len;
+
+static void stripe_Close( stripe_disk_t *p_disk )
+{
+    if ( !p_disk->i_fd )
+        return;
+    close( p_disk->i_fd );
+    CloseAuxFile( p_disk->p_aux );
+    p_disk->i_fd = 0;
+    if ( p_disk->i_rap_fd != -1 )
+        close( p_disk->i_rap_fd );
+    p_disk->i_rap_fd = -1;
+}
+
+static void stripe_Open( stripe_disk_t *p_disk, uint64_t i_file,
+                         uint64_t i_file_stc )
+{
+    struct stat st;
+
+    p_disk->i_file = i_file;
+    p_disk->i_next_flush = 0;
+
+    if ( b_output_container )
+    {
+        p_disk->i_fd = OpenDirFile( p_disk->psz_path, i_file, false,
+                                    i_stripe_len, NULL );
+        p_disk->p_aux = NULL;
+        p_disk->i_chunk = fstat( p_disk->i_fd, &st ) < 0 ? 0 :
+                          ct_get_chunks( st.st_size, i_stripe_len );
+    }
+    else
+    {
+        p_disk->i_fd = OpenDirFile( p_disk->psz_path, i_file, false,
+                                    i_stripe_len, &p_disk->p_aux );
+        p_disk->i_chunk = fstat( p_disk->i_fd, &st ) < 0 ? 0 :
+                          st.st_size / i_stripe_len;
+    }
+
+    if ( i_rap_pid )
+        p_disk->i_rap_fd = OpenDirRAPFile( p_disk->psz_path, i_file,
+                                           i_stripe_len, p_disk->i_chunk );
+
+    if ( p_disk->p_retention != NULL )
+        UpdateDirRetention( p_disk->p_retention, i_file, i_file_stc );
+}
+
+static void stripe_WriteChunk( stripe_disk_t *p_disk,
+                               const stripe_chunk_t *p_chunk )
+{
+    ssize_t i_ret;
+
+    if ( !p_chunk->i_len )
+    {
+        if ( p_disk->i_file == p_chunk->i_file )
+            stripe_Close( p_disk );
+        return;
+    }
+
+    if ( !p_disk->i_fd || p_disk->i_file != p_chunk->i_file )
+    {
+        stripe_Close( p_disk );
+        stripe_Open( p_disk, p_chunk->i_file, p_chunk->i_stc );
+    }
+
+    if ( p_disk->i_rap_fd != -1 && HasRAP( p_chunk->p_buf, p_chunk->i_len )
+          && !WriteRAPFile( p_disk->i_rap_fd, p_disk->i_chunk ) )
+        msg_Warn( NULL, "couldn't write to RAP index of %s (%s)",
+                  p_disk->psz_path, strerror(errno) );
+
+    if ( p_disk->p_aux == NULL )
+        i_ret = WriteContainer( p_disk->i_fd, p_disk->i_chunk++,
+                                p_chunk->i_stc, p_chunk->p_buf,
+                                p_chunk->i_len );
+    else
+    {
+        i_ret = write( p_disk->i_fd, p_chunk->p_buf, p_chunk->i_len );
+        p_disk->i_chunk++;
+        if ( i_ret >= 0 && !WriteAuxFile( p_disk->p_aux, p_chunk->i_stc ) )
+        {
+            msg_Err( NULL, "couldn't write to auxiliary file" );
+            b_die = b_error = 1;
+        }
+        if ( !p_disk->i_next_flush )
+            p_disk->i_next_flush = p_chunk->i_stc + FILE_FLUSH;
+        else if ( p_disk->i_next_flush <= p_chunk->i_stc )
+        {
+            FlushAuxFile( p_disk->p_aux );
+            p_disk->i_next_flush = p_chunk->i_stc + FILE_FLUSH;
+        }
+    }
+
+    if ( i_ret < 0 )
+    {
+        msg_Err( NULL, "couldn't write to %s (%s)", p_disk->psz_path,
+                 strerror(errno) );
+        b_die = b_error = 1;
+    }
+}
+
+static void *stripe_Thread( void *p_arg )
+{
+    stripe_disk_t *p_disk = p_arg;
+    sigset_t set;
+
+    /* Leave the signals to the main thread */
+    sigfillset( &set );
+    pthread_sigmask( SIG_BLOCK, &set, NULL );
+
+    pthread_mutex_lock( &p_disk->lock );
+    for ( ; ; )
+    {
+        stripe_chunk_t *p_chunk;
+
+        while ( !p_disk->i_nb && !p_disk->b_exit )
+            pthread_cond_wait( &p_disk->wait, &p_disk->lock );
+        if ( !p_disk->i_nb )
+            break;
+        p_chunk = &p_disk->p_queue[p_disk->i_start];
+        pthread_mutex_unlock( &p_disk->lock );
+
+        stripe_WriteChunk( p_disk, p_chunk );
+
+        pthread_mutex_lock( &p_disk->lock );
+        p_disk->i_start = (p_disk->i_start + 1) % STRIPE_QUEUE_SIZE;
+        p_disk->i_nb--;
+        pthread_cond_signal( &p_disk->space );
+    }
+    pthread_mutex_unlock( &p_disk->lock );
+
+    stripe_Close( p_disk );
+    return NULL;
+}
+
+static void stripe_Queue( stripe_disk_t *p_disk, uint64_t i_file,
+                          const void *p_buf, size_t i_len )
+{
+    stripe_chunk_t *p_chunk;
+
+    pthread_mutex_lock( &p_disk->lock );
+    if ( p_disk->i_nb == STRIPE_QUEUE_SIZE )
+    {
+        msg_Warn( NULL, "write queue of %s is full", p_disk->psz_path );
+        while ( p_disk->i_nb == STRIPE_QUEUE_SIZE )
+            pthread_cond_wait( &p_disk->space, &p_disk->lock );
+    }
+
+    p_chunk = &p_disk->p_queue[(p_disk->i_start + p_disk->i_nb)
+                                 % STRIPE_QUEUE_SIZE];
+    p_chunk->i_file = i_file;
+    p_chunk->i_stc = i_stc;
+    p_chunk->i_len = i_len;
+    if ( i_len )
+        memcpy( p_chunk->p_buf, p_buf, i_len );
+    p_disk->i_nb++;
+    pthread_cond_signal( &p_disk->wait );
+    pthread_mutex_unlock( &p_disk->lock );
+}
+
+static int stripe_Choose( uint64_t i_file )
+{
+    unsigned int i, i_best = i_file % i_nb_stripe_disks;
+    uint64_t i_best_free = 0;
+
+    /* Keep appending to an existing file */
+    for ( i = 0; i < i_nb_stripe_disks; i++ )
+        if ( ExistsDirFile( p_stripe_disks[i].psz_path, i_file ) )
+            return i;
+
+    if ( !b_stripe_free_space )
+        return i_best;
+
+    for ( i = 0; i < i_nb_stripe_disks; i++ )
+    {
+        struct statvfs st;
+        uint64_t i_free;
+
+        if ( statvfs( p_stripe_disks[i].psz_path, &st ) < 0 )
+            continue;
+        i_free = (uint64_t)st.f_bavail * st.f_frsize;
+        if ( i_free > i_best_free )
+        {
+            i_best = i;
+            i_best_free = i_free;
+        }
+    }
+    return i_best;
+}
+
+static ssize_t stripe_Write( const void *p_buf, size_t i_len )
+{
+    uint64_t i_dir_file = GetDirFile( i_rotate_size, i_stc );
+
+    if ( i_len > i_stripe_len )
+        i_len = i_stripe_len;
+
+    if ( i_stripe_disk == -1 || i_dir_file != i_stripe_file )
+    {
+        if ( i_stripe_disk != -1 )
+            stripe_Queue( &p_stripe_disks[i_stripe_disk], i_stripe_file,
+                          NULL, 0 );
+
+        i_stripe_file = i_dir_file;
+        i_stripe_disk = stripe_Choose( i_stripe_file );
+    }
+
+    stripe_Queue( &p_stripe_disks[i_stripe_disk], i_stripe_file,
+                  p_buf, i_len );
+    return i_len;
+}
+
+static void stripe_ExitWrite(void)
+{
+    unsigned int i, j;
+
+    for ( i = 0; i < i_nb_stripe_disks; i++ )
+    {
+        stripe_disk_t *p_disk = &p_stripe_disks[i];
+
+        pthread_mutex_lock( &p_disk->lock );
+        p_disk->b_exit = true;
+        pthread_cond_signal( &p_disk->wait );
+        pthread_mutex_unlock( &p_disk->lock );
+        pthread_join( p_disk->thread, NULL );
+
+        StopDirRetention( p_disk->p_retention );
+        pthread_mutex_destroy( &p_disk->lock );
+        pthread_cond_destroy( &p_disk->wait );
+        pthread_cond_destroy( &p_disk->space );
+        for ( j = 0; j < STRIPE_QUEUE_SIZE; j++ )
+            free( p_disk->p_queue[j].p_buf );
+        free( p_disk->p_queue );
+        free( p_disk->psz_path );
+    }
+    free( p_stripe_disks );
+}
+
+static int stripe_InitWrite( const char *psz_arg, size_t i_len,
+                             bool b_append )
+{
+    unsigned int i, j;
+
+    i_stripe_len = i_len;
+    i_nb_stripe_disks = i_nb_stripe_dirs + 1;
+    p_stripe_disks = calloc( i_nb_stripe_disks, sizeof(stripe_disk_t) );
+
+    for ( i = 0; i < i_nb_stripe_disks; i++ )
+    {
+        stripe_disk_t *p_disk = &p_stripe_disks[i];
+
+        p_disk->psz_path = strdup( i ? ppsz_stripe_dirs[i - 1] : psz_arg );
+        p_disk->i_rap_fd = -1;
+        if ( !S_ISDIR( StatFile( p_disk->psz_path ) ) )
+        {
+            msg_Err( NULL, "%s isn't a directory", p_disk->psz_path );
+            return -1;
+        }
+
+        if ( i_retention_files || i_retention_age || i_retention_usage )
+        {
+            p_disk->p_retention = StartDirRetention( p_disk->psz_path, i_len,
+                                    i_rotate_size, i_retention_files,
+                                    i_retention_age, i_retention_usage );
+            if ( p_disk->p_retention == NULL )
+                return -1;
+        }
+
+        p_disk->p_queue = malloc( STRIPE_QUEUE_SIZE * sizeof(stripe_chunk_t) );
+        for ( j = 0; j < STRIPE_QUEUE_SIZE; j++ )
+            p_disk->p_queue[j].p_buf = malloc( i_len );
+        pthread_mutex_init( &p_disk->lock, NULL );
+        pthread_cond_init( &p_disk->wait, NULL );
+        pthread_cond_init( &p_disk->space, NULL );
+
+        if ( pthread_create( &p_disk->thread, NULL, stripe_Thread, p_disk ) )
+        {
+            msg_Err( NULL, "couldn't create thread for %s", p_disk->psz_path );
+            return -1;
+        }
+    }
+
+    pf_Date = real_Date;
+    pf_Sleep = real_Sleep;
+    pf_Write = stripe_Write;
+    pf_ExitWrite = stripe_ExitWrite;
+
+    return 0;
+}
+
+/*****************************************************************************
+ * demux_*: handler splitting the programs of a multiplex into directories
+ *****************************************************************************
+ * Every program of the PAT is recorded in a subdirectory of the output
+ * directory named after its program number, with its PMT, PCR and
+ * elementary streams and a PAT only listing it, so that a single multicat
+ * receives and parses the multiplex once. The files are written as in
+ * stripe_*, but from the main thread. Only PATs and PMTs fitting in one TS
+ * packet are handled.
+ *****************************************************************************/
+#define DEMUX_MAX_PROGRAMS 256
+
+typedef struct demux_program_t
+{
+    uint16_t i_program, i_pmt_pid;
+    bool pb_pids[MAX_PIDS];
+    uint8_t i_pat_cc;
+    uint8_t *p_chunk;
+    size_t i_chunk_size;
+    stripe_disk_t disk;
+} demux_program_t;
+
+static bool b_demux = false;
+static char *psz_demux_dir;
+static demux_program_t *pp_demux_programs[DEMUX_MAX_PROGRAMS];
+static unsigned int i_nb_demux_programs = 0;
+static size_t i_demux_len;
+
+/* Returns the section starting in the packet if it is fully held there */
+static uint8_t *demux_Section( uint8_t *p_ts, uint8_t i_table_id )
+{
+    uint8_t *p_section;
+
+    if ( !ts_get_unitstart( p_ts ) || !ts_has_payload( p_ts )
+          || ts_get_scrambling( p_ts ) )
+        return NULL;
+    p_section = ts_next_section( p_ts );
+    if ( p_section + PSI_HEADER_SIZE > p_ts + TS_SIZE
+          || p_section + PSI_HEADER_SIZE + psi_get_length( p_section )
+               > p_ts + TS_SIZE
+          || psi_get_tableid( p_section ) != i_table_id )
+        return NULL;
+    return p_section;
+}
+
+static void demux_Flush( demux_program_t *p_program )
+{
+    stripe_chunk_t chunk;
+
+    chunk.i_file = GetDirFile( i_rotate_size, i_stc );
+    chunk.i_stc = i_stc;
+    chunk.i_len = p_program->i_chunk_size;
+    chunk.p_buf = p_program->p_chunk;
+    stripe_WriteChunk( &p_program->disk, &chunk );
+    p_program->i_chunk_size = 0;
+}
+
+static void demux_Append( demux_program_t *p_program, const uint8_t *p_ts )
+{
+    memcpy( p_program->p_chunk + p_program->i_chunk_size, p_ts, TS_SIZE );
+    p_program->i_chunk_size += TS_SIZE;
+    if ( p_program->i_chunk_size + TS_SIZE > i_demux_len )
+        demux_Flush( p_program );
+}
+
+static demux_program_t *demux_GetProgram( uint16_t i_program )
+{
+    demux_program_t *p_program;
+    char *psz_path;
+    unsigned int i;
+
+    for ( i = 0; i < i_nb_demux_programs; i++ )
+        if ( pp_demux_programs[i]->i_program == i_program )
+            return pp_demux_programs[i];
+    if ( i_nb_demux_programs == DEMUX_MAX_PROGRAMS )
+        return NULL;
+
+    psz_path = malloc( strlen( psz_demux_dir ) + sizeof("/65535") );
+    sprintf( psz_path, "%s/%u", psz_demux_dir, i_program );
+    if ( mkdir( psz_path, 0755 ) < 0 && errno != EEXIST )
+    {
+        msg_Err( NULL, "couldn't create directory %s (%s)", psz_path,
+                 strerror(errno) );
+        free( psz_path );
+        b_die = b_error = 1;
+        return NULL;
+    }
+
+    p_program = calloc( 1, sizeof(demux_program_t) );
+    p_program->i_program = i_program;
+    p_program->i_pmt_pid = NULL_PID;
+    p_program->p_chunk = malloc( i_demux_len );
+    p_program->disk.psz_path = psz_path;
+    p_program->disk.i_rap_fd = -1;
+    if ( i_retention_files || i_retention_age || i_retention_usage )
+        p_program->disk.p_retention = StartDirRetention( psz_path,
+                                    i_demux_len, i_rotate_size,
+                                    i_retention_files, i_retention_age,
+                                    i_retention_usage );
+
+    msg_Info( NULL, "recording program %u to %s", i_program, psz_path );
+    pp_demux_programs[i_nb_demux_programs++] = p_program;
+    return p_program;
+}
+
+/* Sends each program a PAT only listing it */
+static void demux_PAT( const uint8_t *p_ts, uint8_t *p_section )
+{
+    uint8_t *p_entry;
+    uint16_t n;
+
+    for ( n = 0; (p_entry = pat_get_program( p_section, n )) != NULL; n++ )
+    {
+        demux_program_t *p_program;
+        uint8_t p_pat[TS_SIZE];
+        uint8_t *p_pat_section, *p_end;
+
+        if ( !patn_get_program( p_entry ) )
+            continue; /* NIT */
+        p_program = demux_GetProgram( patn_get_program( p_entry ) );
+        if ( p_program == NULL )
+            continue;
+
+        if ( p_program->i_pmt_pid != patn_get_pid( p_entry ) )
+        {
+            p_program->i_pmt_pid = patn_get_pid( p_entry );
+            memset( p_program->pb_pids, 0, sizeof(p_program->pb_pids) );
+            p_program->pb_pids[p_program->i_pmt_pid] = true;
+        }
+
+        memcpy( p_pat, p_ts, TS_SIZE );
+        p_pat_section = p_pat + (p_section - p_ts);
+        memcpy( pat_get_program( p_pat_section, 0 ), p_entry,
+                PAT_PROGRAM_SIZE );
+        pat_set_length( p_pat_section, PAT_PROGRAM_SIZE );
+        psi_set_section( p_pat_section, 0 );
+        psi_set_lastsection( p_pat_section, 0 );
+        psi_set_crc( p_pat_section );
+        p_end = p_pat_section + PSI_HEADER_SIZE
+                 + psi_get_length( p_pat_section );
+        memset( p_end, 0xff, p_pat + TS_SIZE - p_end );
+
+        ts_set_cc( p_pat, p_program->i_pat_cc );
+        p_program->i_pat_cc = (p_program->i_pat_cc + 1) & 0xf;
+        demux_Append( p_program, p_pat );
+    }
+}
+
+static void demux_PMT( demux_program_t *p_program, uint8_t *p_section )
+{
+    uint8_t *p_es;
+    uint16_t n;
+
+    if ( pmt_get_program( p_section ) != p_program->i_program )
+        return;
+
+    memset( p_program->pb_pids, 0, sizeof(p_program->pb_pids) );
+    p_program->pb_pids[p_program->i_pmt_pid] = true;
+    if ( pmt_get_pcrpid( p_section ) != NULL_PID )
+        p_program->pb_pids[pmt_get_pcrpid( p_section )] = true;
+    for ( n = 0; (p_es = pmt_get_es( p_section, n )) != NULL; n++ )
+        p_program->pb_pids[pmtn_get_pid( p_es )] = true;
+}
+
+static ssize_t demux_Write( const void *p_buf, size_t i_len )
+{
+    uint8_t *p_ts = (uint8_t *)p_buf;
+    size_t i_size;
+
+    for ( i_size = i_len; i_size >= TS_SIZE; i_size -= TS_SIZE,
+                                             p_ts += TS_SIZE )
+    {
+        uint16_t i_pid = ts_get_pid( p_ts );
+        uint8_t *p_section;
+        unsigned int i;
+
+        if ( !ts_validate( p_ts ) )
+            continue;
+        if ( i_pid == PAT_PID )
+        {
+            if ( (p_section = demux_Section( p_ts, PAT_TABLE_ID )) != NULL )
+                demux_PAT( p_ts, p_section );
+            continue;
+        }
+
+        for ( i = 0; i < i_nb_demux_programs; i++ )
+        {
+            demux_program_t *p_program = pp_demux_programs[i];
+
+            if ( !p_program->pb_pids[i_pid] )
+                continue;
+            if ( i_pid == p_program->i_pmt_pid && (p_section =
+                    demux_Section( p_ts, PMT_TABLE_ID )) != NULL )
+                demux_PMT( p_program, p_section );
+            demux_Append( p_program, p_ts );
+        }
+    }
+    return i_len;
+}
+
+static void demux_ExitWrite(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < i_nb_demux_programs; i++ )
+    {
+        demux_program_t *p_program = pp_demux_programs[i];
+
+        if ( p_program->i_chunk_size )
+        {
+            while ( p_program->i_chunk_size + TS_SIZE <= i_demux_len )
+            {
+                ts_pad( p_program->p_chunk + p_program->i_chunk_size );
+                p_program->i_chunk_size += TS_SIZE;
+            }
+            demux_Flush( p_program );
+        }
+        stripe_Close( &p_program->disk );
+        StopDirRetention( p_program->disk.p_retention );
+        free( p_program->disk.psz_path );
+        free( p_program->p_chunk );
+        free( p_program );
+    }
+    free( psz_demux_dir );
+}
+
+static int demux_InitWrite( const char *psz_arg, size_t i_len, bool b_append )
+{
+    if ( !S_ISDIR( StatFile( psz_arg ) ) )
+    {
+        msg_Err( NULL, "%s isn't a directory", psz_arg );
+        return -1;
+    }
+
+    psz_demux_dir = strdup( psz_arg );
+    i_demux_len = i_len;
+    i_stripe_len = i_len;
+
+    pf_Date = real_Date;
+    pf_Sleep = real_Sleep;
+    pf_Write = demux_Write;
+    pf_ExitWrite = demux_ExitWrite;
+
+    return 0;
+}
+
+/*****************************************************************************
+ * psi_*: fast start with the PAT and PMTs preceding the start position
+ *****************************************************************************
+ * The last PAT and PMTs before the first chunk are looked for by a bounded
+ * backward scan of the input (and of the previous file in directory mode),
+ * and played just before the first chunk, so that receivers don't have to
+ * wait for the next ones. Only sections fitting in one TS packet are
+ * handled.
+ *****************************************************************************/
+#define PSI_SCAN_CHUNKS 8192
+#define PSI_MAX_PMTS 64
+
+typedef struct psi_packet_t
+{
+    uint16_t i_pid;
+    bool b_next_cc;
+    uint8_t p_ts[TS_SIZE];
+} psi_packet_t;
+
+static bool b_psi_start = false;
+static psi_packet_t psi_pat;
+static bool b_psi_pat = false;
+static psi_packet_t p_psi_pmts[PSI_MAX_PMTS];
+static unsigned int i_nb_psi_pmts = 0;
+
+static ssize_t (*pf_psi_Read)( void *p_buf, size_t i_len );
+static uint8_t *p_psi_buffer = NULL;
+static size_t i_psi_size, i_psi_pos;
+static uint8_t *p_psi_first = NULL;
+static ssize_t i_psi_first_size;
+
+static bool psi_ReadChunk( int i_fd, bool b_container, off_t i_chunk,
+                           uint8_t *p_buf, size_t i_len )
+{
+    off_t i_offset = b_container ?
+        ct_get_stc_offset( i_chunk, i_len ) + sizeof(uint64_t) :
+        (off_t)i_len * i_chunk;
+    return pread( i_fd, p_buf, i_len, i_offset ) == i_len;
+}
+
+static psi_packet_t *psi_FindPMT( uint16_t i_pid )
+{
+    unsigned int i;
+
+    for ( i = 0; i < i_nb_psi_pmts; i++ )
+        if ( p_psi_pmts[i].i_pid == i_pid )
+            return &p_psi_pmts[i];
+    return NULL;
+}
+
+static void psi_Packet( uint8_t *p_ts )
+{
+    uint16_t i_pid = ts_get_pid( p_ts );
+    uint8_t *p_section;
+
+    if ( !ts_validate( p_ts ) || !ts_get_unitstart( p_ts )
+          || !ts_has_payload( p_ts ) || ts_get_scrambling( p_ts ) )
+        return;
+    p_section = ts_next_section( p_ts );
+    if ( p_section + PSI_HEADER_SIZE > p_ts + TS_SIZE
+          || p_section + PSI_HEADER_SIZE + psi_get_length( p_section )
+               > p_ts + TS_SIZE )
+        return;
+
+    if ( i_pid == PAT_PID && psi_get_tableid( p_section ) == PAT_TABLE_ID )
+    {
+        if ( b_psi_pat )
+            return;
+        psi_pat.i_pid = i_pid;
+        memcpy( psi_pat.p_ts, p_ts, TS_SIZE );
+        b_psi_pat = true;
+    }
+    else if ( psi_get_tableid( p_section ) == PMT_TABLE_ID )
+    {
+        if ( psi_FindPMT( i_pid ) != NULL || i_nb_psi_pmts == PSI_MAX_PMTS )
+            return;
+        p_psi_pmts[i_nb_psi_pmts].i_pid = i_pid;
+        memcpy( p_psi_pmts[i_nb_psi_pmts].p_ts, p_ts, TS_SIZE );
+        i_nb_psi_pmts++;
+    }
+}
+
+/* Call f on the PAT, then on the PMTs in the order of the PAT, returns false
+ * if a PMT is missing */
+static bool psi_Walk( void (*f)( psi_packet_t * ) )
+{
+    uint8_t *p_program;
+    int i;
+
+    if ( !b_psi_pat )
+        return false;
+    if ( f != NULL )
+        f( &psi_pat );
+
+    for ( i = 0; i < 256 && (p_program =
+             pat_get_program( ts_next_section( psi_pat.p_ts ), i )) != NULL;
+          i++ )
+    {
+        psi_packet_t *p_pmt;
+
+        if ( !patn_get_program( p_program ) )
+            continue; /* NIT */
+        p_pmt = psi_FindPMT( patn_get_pid( p_program ) );
+        if ( p_pmt == NULL )
+            return false;
+        if ( f != NULL )
+            f( p_pmt );
+    }
+    return true;
+}
+
+static bool psi_Scan( int i_fd, bool b_container, off_t i_chunk,
+                      size_t i_len, unsigned int *pi_budget )
+{
+    uint8_t *p_chunk = malloc( i_len );
+    bool b_ret = false;
+
+    while ( i_chunk > 0 && *pi_budget && !b_ret )
+    {
+        uint8_t *p_ts;
+
+        i_chunk--;
+        (*pi_budget)--;
+        if ( !psi_ReadChunk( i_fd, b_container, i_chunk, p_chunk, i_len ) )
+            break;
+
+        for ( p_ts = p_chunk + (i_len / TS_SIZE - 1) * TS_SIZE;
+              p_ts >= p_chunk; p_ts -= TS_SIZE )
+            psi_Packet( p_ts );
+        b_ret = psi_Walk( NULL );
+    }
+
+    free( p_chunk );
+    return b_ret;
+}
+
+/* Number the cached packets so that the stream stays continuous with the
+ * next packets of their PIDs */
+static void psi_NextCC( int i_fd, bool b_container, off_t i_chunk,
+                        size_t i_len )
+{
+    uint8_t *p_chunk = malloc( i_len );
+    unsigned int i_budget = PSI_SCAN_CHUNKS;
+
+    while ( i_budget-- )
+    {
+        uint8_t *p_ts;
+
+        if ( !psi_ReadChunk( i_fd, b_container, i_chunk++, p_chunk,
+                             i_len ) )
+            break;
+
+        for ( p_ts = p_chunk; p_ts + TS_SIZE <= p_chunk + i_len;
+              p_ts += TS_SIZE )
+        {
+            uint16_t i_pid = ts_get_pid( p_ts );
+            psi_packet_t *p_packet = i_pid == PAT_PID ? &psi_pat :
+                                     psi_FindPMT( i_pid );
+
+            if ( !ts_validate( p_ts ) || p_packet == NULL
+                  || p_packet->b_next_cc || !ts_has_payload( p_ts ) )
+                continue;
+            ts_set_cc( p_packet->p_ts, (ts_get_cc( p_ts ) + 0xf) & 0xf );
+            p_packet->b_next_cc = true;
+        }
+    }
+
+    free( p_chunk );
+}
+
+static void psi_Append( psi_packet_t *p_packet )
+{
+    p_psi_buffer = realloc( p_psi_buffer, i_psi_size + TS_SIZE );
+    memcpy( p_psi_buffer + i_psi_size, p_packet->p_ts, TS_SIZE );
+    i_psi_size += TS_SIZE;
+}
+
+static ssize_t psi_Read( void *p_buf, size_t i_len )
+{
+    ssize_t i_ret;
+
+    if ( p_psi_first == NULL )
+    {
+        /* Read the first chunk to know its STC */
+        p_psi_first = malloc( i_len );
+        i_psi_first_size = pf_psi_Read( p_psi_first, i_len );
+        if ( i_psi_first_size <= 0 )
+            i_psi_pos = i_psi_size;
+    }
+
+    if ( i_psi_pos < i_psi_size )
+    {
+        /* The main loop pads the last chunk */
+        i_ret = i_psi_size - i_psi_pos;
+        if ( i_ret > i_len - i_len % TS_SIZE )
+            i_ret = i_len - i_len % TS_SIZE;
+        memcpy( p_buf, p_psi_buffer + i_psi_pos, i_ret );
+        i_psi_pos += i_ret;
+        return i_ret;
+    }
+
+    i_ret = i_psi_first_size;
+    if ( i_ret > 0 )
+        memcpy( p_buf, p_psi_first, i_ret );
+    free( p_psi_first );
+    free( p_psi_buffer );
+    pf_Read = pf_psi_Read;
+    return i_ret;
+}
+
+/* Returns the number of chunks played before the input */
+static off_t psi_Init( size_t i_len )
+{
+    unsigned int i_budget = PSI_SCAN_CHUNKS;
+    bool b_container = p_input_aux == NULL;
+    off_t i_chunk = b_container ? i_input_chunk :
+                    lseek( i_input_fd, 0, SEEK_CUR ) / i_len;
+    bool b_found = psi_Scan( i_input_fd, b_container, i_chunk, i_len,
+                             &i_budget );
+
+    if ( !b_found && (pf_Read == dir_Read || pf_null_Read == dir_Read)
+          && i_input_dir_file && i_budget )
+    {
+        aux_file_t *p_aux;
+        int i_fd = OpenDirFile( psz_input_dir_name, i_input_dir_file - 1,
+                                true, i_len, &p_aux );
+        if ( i_fd >= 0 )
+        {
+            struct stat st;
+            off_t i_size = fstat( i_fd, &st ) < 0 ? 0 : st.st_size;
+
+            b_found = psi_Scan( i_fd, p_aux == NULL,
+                                p_aux == NULL ?
+                                    ct_get_chunks( i_size, i_len ) :
+                                    i_size / i_len,
+                                i_len, &i_budget );
+            close( i_fd );
+            CloseAuxFile( p_aux );
+        }
+    }
+
+    if ( !b_found )
+    {
+        msg_Warn( NULL, "no PAT and PMT found before the start position" );
+        return 0;
+    }
+
+    psi_NextCC( i_input_fd, b_container, i_chunk, i_len );
+
+    i_psi_size = i_psi_pos = 0;
+    psi_Walk( psi_Append );
+    msg_Dbg( NULL, "starting with %zu PSI packets", i_psi_size / TS_SIZE );
+
+    pf_psi_Read = pf_Read;
+    pf_Read = psi_Read;
+    return (i_psi_size + (i_len - i_len % TS_SIZE) - 1)
+            / (i_len - i_len % TS_SIZE);
+}
+
+/*****************************************************************************
+ * Extract: copy chunks from file or directory input to a file, as long as
+ * they need no processing, without going through user space
+ *****************************************************************************
+ * Only aux files are read and written chunk by chunk; TS data is copied
+ * with copy_file_range(), which shares extents on file systems supporting
+ * reflinks. Extract stops at the first chunk it can't copy as is (last
+ * incomplete chunk, container input...), where the main loop takes over.
+ *****************************************************************************/
+#define EXTRACT_BATCH 65536 /* chunks */
+#define EXTRACT_BUFFER_SIZE 1048576
+
+static bool CopyRange( int i_in_fd, int i_out_fd, off_t i_len )
+{
+    uint8_t *p_buf;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while ( i_len > 0 )
+    {
+        ssize_t i_ret = copy_file_range( i_in_fd, NULL, i_out_fd, NULL,
+                                         i_len, 0 );
+        if ( i_ret <= 0 )
+            break; /* not supported between these files, copy by hand */
+        i_len -= i_ret;
+    }
+    if ( !i_len )
+        return true;
+#endif
+
+    p_buf = malloc( EXTRACT_BUFFER_SIZE );
+    while ( i_len > 0 )
+    {
+        ssize_t i_ret = read( i_in_fd, p_buf, i_len > EXTRACT_BUFFER_SIZE ?
+                                              EXTRACT_BUFFER_SIZE : i_len );
+        if ( i_ret <= 0 || write( i_out_fd, p_buf, i_ret ) != i_ret )
+            break;
+        i_len -= i_ret;
+    }
+    free( p_buf );
+    return !i_len;
+}
+
+/*****************************************************************************
+ * ExtractParallel: same as Extract, but the TS data of all the files is
+ * copied by a pool of threads, at precomputed offsets of the output
+ *****************************************************************************/
+#define EXPORT_PIECE_SIZE (64 * 1048576)
+
+typedef struct export_piece_t
+{
+    int i_in_fd;
+    off_t i_in_offset, i_out_offset, i_len;
+} export_piece_t;
+
+static export_piece_t *p_export_pieces;
+static unsigned int i_nb_export_pieces, i_export_piece;
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool b_export_error;
+
+static bool CopyPiece( const export_piece_t *p_piece, uint8_t **pp_buf )
+{
+    off_t i_in_offset = p_piece->i_in_offset;
+    off_t i_out_offset = p_piece->i_out_offset;
+    off_t i_len = p_piece->i_len;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while ( i_len > 0 )
+    {
+        ssize_t i_ret = copy_file_range( p_piece->i_in_fd, &i_in_offset,
+                                         i_output_fd, &i_out_offset,
+                                         i_len, 0 );
+        if ( i_ret <= 0 )
+            break; /* not supported between these files, copy by hand */
+        i_len -= i_ret;
+    }
+    if ( !i_len )
+        return true;
+#endif
+
+    if ( *pp_buf == NULL )
+        *pp_buf = malloc( EXTRACT_BUFFER_SIZE );
+    while ( i_len > 0 )
+    {
+        ssize_t i_ret = pread( p_piece->i_in_fd, *pp_buf,
+                               i_len > EXTRACT_BUFFER_SIZE ?
+                               EXTRACT_BUFFER_SIZE : i_len, i_in_offset );
+        if ( i_ret <= 0 || pwrite( i_output_fd, *pp_buf, i_ret,
+                                   i_out_offset ) != i_ret )
+            return false;
+        i_in_offset += i_ret;
+        i_out_offset += i_ret;
+        i_len -= i_ret;
+    }
+    return true;
+}
+
+static void *ExportThread( void *p_arg )
+{
+    uint8_t *p_buf = NULL;
+
+    for ( ; ; )
+    {
+        export_piece_t *p_piece;
+
+        pthread_mutex_lock( &export_lock );
+        if ( i_export_piece == i_nb_export_pieces || b_export_error )
+        {
+            pthread_mutex_unlock( &export_lock );
+            break;
+        }
+        p_piece = &p_export_pieces[i_export_piece++];
+        pthread_mutex_unlock( &export_lock );
+
+        if ( !CopyPiece( p_piece, &p_buf ) )
+        {
+            msg_Err( NULL, "couldn't copy to file (%s)", strerror(errno) );
+            pthread_mutex_lock( &export_lock );
+            b_export_error = true;
+            pthread_mutex_unlock( &export_lock );
+        }
+    }
+    free( p_buf );
+    return NULL;
+}
+
+static void ExportAddFile( int i_in_fd, off_t i_in_offset,
+                           off_t i_out_offset, off_t i_len )
+{
+    while ( i_len > 0 )
+    {
+        export_piece_t *p_piece;
+
+        p_export_pieces = realloc( p_export_pieces,
+                    (i_nb_export_pieces + 1) * sizeof(export_piece_t) );
+        p_piece = &p_export_pieces[i_nb_export_pieces++];
+        p_piece->i_in_fd = i_in_fd;
+        p_piece->i_in_offset = i_in_offset;
+        p_piece->i_out_offset = i_out_offset;
+        p_piece->i_len = i_len > EXPORT_PIECE_SIZE ? EXPORT_PIECE_SIZE : i_len;
+
+        i_in_offset += p_piece->i_len;
+        i_out_offset += p_piece->i_len;
+        i_len -= p_piece->i_len;
+    }
+}
+
+static bool ExtractParallel( uint64_t i_duration, off_t *pi_nb_chunks )
+{
+    size_t i_len = i_asked_payload_size;
+    off_t i_out_pos = lseek( i_output_fd, 0, SEEK_CUR );
+    int *pi_fds = NULL;
+    unsigned int i_nb_fds = 0, i;
+    pthread_t *p_threads;
+    bool b_ret = true;
+
+    /* pwrite() ignores the offset with O_APPEND */
+    if ( i_out_pos == (off_t)-1 || (fcntl( i_output_fd, F_GETFL ) & O_APPEND) )
+        return true;
+
+    /* Stitch the aux files, and list the TS data to copy */
+    while ( !b_die && p_input_aux != NULL )
+    {
+        struct stat st;
+        off_t i_pos = lseek( i_input_fd, 0, SEEK_CUR );
+        off_t i_avail, i_nb = 0;
+        uint64_t i_chunk_stc;
+        bool b_end = false;
+
+        if ( i_pos == (off_t)-1 || fstat( i_input_fd, &st ) < 0 )
+            break;
+        i_avail = (st.st_size - i_pos) / i_len;
+        if ( *pi_nb_chunks > 0 && i_avail > *pi_nb_chunks )
+            i_avail = *pi_nb_chunks;
+
+        while ( i_nb < i_avail && ReadAuxFile( p_input_aux, &i_chunk_stc ) )
+        {
+            if ( !i_first_stc ) i_first_stc = i_chunk_stc;
+            if ( i_duration && i_chunk_stc > i_first_stc + i_duration )
+            {
+                b_end = true;
+                break;
+            }
+            if ( !WriteAuxFile( p_output_aux, i_chunk_stc ) )
+            {
+                msg_Err( NULL, "couldn't write to auxiliary file" );
+                b_die = b_error = 1;
+                b_ret = false;
+                break;
+            }
+            i_stc = i_chunk_stc;
+            i_nb++;
+        }
+
+        if ( i_nb )
+        {
+            pi_fds = realloc( pi_fds, (i_nb_fds + 1) * sizeof(int) );
+            pi_fds[i_nb_fds] = dup( i_input_fd );
+            ExportAddFile( pi_fds[i_nb_fds++], i_pos, i_out_pos,
+                           i_nb * i_len );
+            i_out_pos += i_nb * i_len;
+        }
+        lseek( i_input_fd, i_pos + i_nb * i_len, SEEK_SET );
+        SeekAuxFile( p_input_aux, i_pos / i_len + i_nb );
+
+        if ( !b_ret )
+            break;
+        if ( *pi_nb_chunks > 0 )
+        {
+            *pi_nb_chunks -= i_nb;
+            if ( !*pi_nb_chunks )
+            {
+                b_ret = false;
+                break;
+            }
+        }
+        if ( b_end || pf_NextFile == NULL
+              || i_pos + i_nb * i_len != st.st_size || !pf_NextFile() )
+            break;
+    }
+
+    /* Copy */
+    msg_Dbg( NULL, "copying %u pieces with %u threads", i_nb_export_pieces,
+             i_extract_threads );
+    p_threads = malloc( i_extract_threads * sizeof(pthread_t) );
+    for ( i = 0; i < i_extract_threads; i++ )
+        if ( pthread_create( &p_threads[i], NULL, ExportThread, NULL ) )
+            break;
+    if ( !i ) /* do it ourselves */
+        ExportThread( NULL );
+    while ( i-- )
+        pthread_join( p_threads[i], NULL );
+    free( p_threads );
+
+    for ( i = 0; i < i_nb_fds; i++ )
+        close( pi_fds[i] );
+    free( pi_fds );
+    free( p_export_pieces );
+    p_export_pieces = NULL;
+    i_nb_export_pieces = i_export_piece = 0;
+
+    if ( b_export_error )
+    {
+        b_die = b_error = 1;
+        return false;
+    }
+    lseek( i_output_fd, i_out_pos, SEEK_SET );
+    return b_ret;
+}
+
+static bool Extract( uint64_t i_duration, off_t *pi_nb_chunks )
+{
+    size_t i_len = i_asked_payload_size;
+
+    if ( i_extract_threads > 1 && !ExtractParallel( i_duration, pi_nb_chunks ) )
+        return false;
+
+    while ( !b_die && p_input_aux != NULL )
+    {
+        struct stat st;
+        off_t i_pos = lseek( i_input_fd, 0, SEEK_CUR );
+        off_t i_avail, i_nb = 0;
+        uint64_t i_chunk_stc;
+        bool b_end = false;
+
+        if ( i_pos == (off_t)-1 || fstat( i_input_fd, &st ) < 0 )
+            break;
+        i_avail = (st.st_size - i_pos) / i_len;
+        if ( i_avail > EXTRACT_BATCH )
+            i_avail = EXTRACT_BATCH;
+        if ( *pi_nb_chunks > 0 && i_avail > *pi_nb_chunks )
+            i_avail = *pi_nb_chunks;
+
+        while ( i_nb < i_avail && ReadAuxFile( p_input_aux, &i_chunk_stc ) )
+        {
+            if ( !i_first_stc ) i_first_stc = i_chunk_stc;
+            if ( i_duration && i_chunk_stc > i_first_stc + i_duration )
+            {
+                b_end = true;
+                break;
+            }
+            if ( !WriteAuxFile( p_output_aux, i_chunk_stc ) )
+            {
+                msg_Err( NULL, "couldn't write to auxiliary file" );
+                b_die = b_error = 1;
+                return false;
+            }
+            i_stc = i_chunk_stc;
+            i_nb++;
+        }
+
+        if ( !CopyRange( i_input_fd, i_output_fd, i_nb * i_len ) )
+        {
+            msg_Err( NULL, "couldn't copy to file (%s)", strerror(errno) );
+            b_die = b_error = 1;
+            return false;
+        }
+        /* Give back the STC we peeked at */
+        SeekAuxFile( p_input_aux, i_pos / i_len + i_nb );
+
+        if ( *pi_nb_chunks > 0 )
+        {
+            *pi_nb_chunks -= i_nb;
+            if ( !*pi_nb_chunks )
+                return false;
+        }
+        if ( b_end )
+            break;
+        if ( i_nb == EXTRACT_BATCH )
+            continue;
+
+        /* End of this file: carry on with the next one if it is complete */
+        if ( pf_NextFile == NULL || i_pos + i_nb * i_len != st.st_size
+              || !pf_NextFile() )
+            break;
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * GetPCR: read PCRs to align RTP timestamps with PCR scale (RFC compliance)
+ *****************************************************************************/
+static void GetPCR( const uint8_t *p_buffer, size_t i_read_size )
+{
+    while ( i_read_size >= TS_SIZE )
+    {
+        uint16_t i_pid = ts_get_pid( p_buffer );
+
+        if ( !ts_validate( p_buffer ) )
+        {
+            msg_Warn( NULL, "invalid TS packet (sync=0x%x)", p_buffer[0] );
+        }
+        else if ( (i_pid == i_pcr_pid || i_pcr_pid == 8192)
+              && ts_has_adaptation(p_buffer) && ts_get_adaptation(p_buffer)
+              && tsaf_has_pcr(p_buffer) )
+        {
+            i_pcr = tsaf_get_pcr( p_buffer ) * 300 + tsaf_get_pcrext( p_buffer );
+            i_pcr_stc = i_stc;
+        }
+        p_buffer += TS_SIZE;
+        i_read_size -= TS_SIZE;
+    }
+}
+
+/*****************************************************************************
+ * FixCC: fix continuity counters
+ *****************************************************************************/
+static void FixCC( uint8_t *p_buffer, size_t i_read_size )
+{
+    while ( i_read_size >= TS_SIZE )
+    {
+        uint16_t i_pid = ts_get_pid( p_buffer );
+
+        if ( !ts_validate( p_buffer ) )
+        {
+            msg_Warn( NULL, "invalid TS packet (sync=0x%x)", p_buffer[0] );
+        }
+        else
+        {
+            if ( pi_pid_cc_table[i_pid] == 0x10 )
+            {
+                msg_Dbg( NULL, "new pid entry %d", i_pid );
+                pi_pid_cc_table[i_pid] = 0;
+            }
+            else if ( ts_has_payload( p_buffer ) )
+            {
+                pi_pid_cc_table[i_pid] = (pi_pid_cc_table[i_pid] + 1) % 0x10; 
+            }
+            ts_set_cc( p_buffer, pi_pid_cc_table[i_pid] );
+        }
+        p_buffer += TS_SIZE;
+        i_read_size -= TS_SIZE;
+    }
+}
+
+/*****************************************************************************
+ * CheckCC: check the continuity counters of the input
+ *****************************************************************************
+ * The input statistics share the last continuity counter and the continuity
+ * errors of each PID, kept in a flat array indexed by PID like FixCC's
+ * table, and every packet is checked once by CheckInput.
+ *****************************************************************************/
+typedef struct pid_input_t
+{
+    uint8_t i_cc; /* 0x10 before the first packet */
+    uint32_t i_cc_errors;
+} pid_input_t;
+
+static pid_input_t *p_pid_inputs = NULL;
+
+/* Returns the number of packets missing before this one */
+static unsigned int CheckCC( const uint8_t *p_ts, pid_input_t *p_input )
+{
+    uint8_t i_cc = ts_get_cc( p_ts );
+    uint8_t i_last_cc = p_input->i_cc;
+    unsigned int i_missing = 0;
+
+    if ( ts_get_pid( p_ts ) == NULL_PID || !ts_has_payload( p_ts ) )
+        return 0;
+
+    if ( i_last_cc != 0x10 && ts_check_discontinuity( i_cc, i_last_cc )
+          && !ts_check_duplicate( i_cc, i_last_cc )
+          && !(ts_has_adaptation( p_ts ) && ts_get_adaptation( p_ts )
+                && tsaf_has_discontinuity( p_ts )) )
+    {
+        i_missing = (i_cc - i_last_cc - 1) & 0xf;
+        p_input->i_cc_errors++;
+    }
+    p_input->i_cc = i_cc;
+    return i_missing;
+}
+
+static void CheckInit(void)
+{
+    unsigned int i;
+
+    if ( p_pid_inputs != NULL )
+        return;
+    p_pid_inputs = calloc( MAX_PIDS, sizeof(pid_input_t) );
+    for ( i = 0; i < MAX_PIDS; i++ )
+        p_pid_inputs[i].i_cc = 0x10;
+}
+
+/*****************************************************************************
+ * CountPIDs: account the packets of each PID of the input
+ *****************************************************************************
+ * Counters are kept in a flat array indexed by PID, like the CC table, and
+ * only read by the main thread, which writes them to the statistics file
+ * (-T) every PIDS_PERIOD, with the continuity errors found by CheckCC.
+ *****************************************************************************/
+#define PIDS_PERIOD UINT64_C(27000000) /* 1 s */
+#define PIDS_ENTRY_SIZE 160 /* maximum size of a PID element */
+
+typedef struct pid_counters_t
+{
+    uint64_t i_packets;
+    uint32_t i_scrambled;
+} pid_counters_t;
+
+static bool b_pid_stats = false;
+static pid_counters_t *p_pid_counters;
+static uint64_t *pi_pid_snapshot; /* packets at the last snapshot */
+static uint64_t i_pid_snapshot_stc = 0;
+static char *psz_pid_stats;
+static size_t i_pid_stats_len = 0;
+
+static void CountPIDs( const uint8_t *p_ts, uint16_t i_pid )
+{
+    p_pid_counters[i_pid].i_packets++;
+    if ( ts_get_scrambling( p_ts ) )
+        p_pid_counters[i_pid].i_scrambled++;
+}
+
+/* Writes the PID statistics at the start of the statistics file when they
+ * are due, and returns their length; they never get shorter, so that the
+ * rest of the file may be rewritten after them at every chunk */
+static size_t PIDStats( int i_fd )
+{
+    uint64_t i_period = i_stc - i_pid_snapshot_stc;
+    size_t i_len;
+    unsigned int i;
+
+    if ( i_pid_stats_len && i_period < PIDS_PERIOD )
+        return i_pid_stats_len;
+    if ( !i_pid_stats_len )
+        i_period = 0;
+
+    i_len = sprintf( psz_pid_stats, "<?xml version=\"1.0\" encoding=\"utf-8\"?><MULTICAT><PIDS>" );
+    for ( i = 0; i < MAX_PIDS; i++ )
+    {
+        const pid_counters_t *p_counters = &p_pid_counters[i];
+        uint64_t i_bitrate = 0;
+
+        if ( !p_counters->i_packets )
+            continue;
+        if ( i_period )
+            i_bitrate = (p_counters->i_packets - pi_pid_snapshot[i])
+                         * TS_SIZE * 8 * UINT64_C(27000000) / i_period;
+        pi_pid_snapshot[i] = p_counters->i_packets;
+
+        i_len += sprintf( psz_pid_stats + i_len, "<PID pid=\"%u\" packets=\"%"PRIu64"\" bytes=\"%"PRIu64"\" bitrate=\"%"PRIu64"\" cc_errors=\"%"PRIu32"\" scrambled=\"%"PRIu32"\"/>",
+                          i, p_counters->i_packets,
+                          p_counters->i_packets * TS_SIZE, i_bitrate,
+                          p_pid_inputs[i].i_cc_errors,
+                          p_counters->i_scrambled );
+    }
+    i_len += sprintf( psz_pid_stats + i_len, "</PIDS>" );
+    if ( i_len < i_pid_stats_len )
+    {
+        memset( psz_pid_stats + i_len, '\n', i_pid_stats_len - i_len );
+        i_len = i_pid_stats_len;
+    }
+    i_pid_snapshot_stc = i_stc;
+    i_pid_stats_len = i_len;
+
+    if ( pwrite( i_fd, psz_pid_stats, i_len, 0 ) != i_len )
+        msg_Warn( NULL, "write PID statistics error (%s)", strerror(errno) );
+    return i_len;
+}
+
+static void CountInit(void)
+{
+    CheckInit();
+    p_pid_counters = calloc( MAX_PIDS, sizeof(pid_counters_t) );
+    pi_pid_snapshot = calloc( MAX_PIDS, sizeof(uint64_t) );
+    psz_pid_stats = malloc( MAX_PIDS * PIDS_ENTRY_SIZE + 128 );
+}
+
+/*****************************************************************************
+ * Monitor: TR 101 290 priority 1 and 2 indicators of the input
+ *****************************************************************************
+ * Every packet is checked once by CheckInput, dated with its chunk, and
+ * continuity errors come from CheckCC. PSI sections are only parsed when
+ * they fit in one TS packet, and missing tables and PIDs are looked for once
+ * per chunk in the lists of the PIDs referenced by the PAT and PMTs. The PCR accuracy (2.4) isn't checked, since the dates of the
+ * packets within a chunk aren't known.
+ *****************************************************************************/
+#define MONITOR_PSI_PERIOD UINT64_C(13500000) /* 500 ms */
+#define MONITOR_PID_PERIOD UINT64_C(135000000) /* 5 s */
+#define MONITOR_PCR_PERIOD UINT64_C(1080000) /* 40 ms */
+#define MONITOR_PCR_JUMP UINT64_C(2700000) /* 100 ms */
+#define MONITOR_PTS_PERIOD UINT64_C(18900000) /* 700 ms */
+
+enum
+{
+    /* priority 1 */
+    MONITOR_SYNC_LOSS,
+    MONITOR_SYNC_BYTE,
+    MONITOR_PAT,
+    MONITOR_CC,
+    MONITOR_PMT,
+    MONITOR_PID,
+    /* priority 2 */
+    MONITOR_TRANSPORT,
+    MONITOR_CRC,
+    MONITOR_PCR_REPETITION,
+    MONITOR_PCR_DISCONTINUITY,
+    MONITOR_PTS,
+    MONITOR_CAT,
+    MONITOR_NB_ERRORS
+};
+#define MONITOR_PRIORITY_2 MONITOR_TRANSPORT
+
+static const char *ppsz_monitor_errors[MONITOR_NB_ERRORS] = {
+    "TS_sync_loss", "Sync_byte_error", "PAT_error", "Continuity_count_error",
+    "PMT_error", "PID_error", "Transport_error", "CRC_error",
+    "PCR_repetition_error", "PCR_discontinuity_indicator_error",
+    "PTS_error", "CAT_error"
+};
+
+typedef struct monitor_error_t
+{
+    unsigned long i_count;
+    uint64_t i_last_stc;
+} monitor_error_t;
+
+typedef struct monitor_pid_t
+{
+    uint64_t i_seen_stc; /* last packet or PID_error */
+    uint64_t i_psi_stc; /* last PMT or PMT_error */
+    uint64_t i_ref_stc; /* last referenced by the PAT or a PMT */
+    uint64_t i_pcr, i_pcr_stc, i_pts_stc;
+    bool b_pmt, b_es;
+} monitor_pid_t;
+
+static bool b_monitor = false;
+static monitor_error_t p_monitor_errors[MONITOR_NB_ERRORS];
+static monitor_pid_t *p_monitor_pids;
+static uint16_t *pi_monitor_pmts, *pi_monitor_es;
+static unsigned int i_nb_monitor_pmts = 0, i_nb_monitor_es = 0;
+static uint64_t i_monitor_pat_stc = 0;
+static unsigned int i_monitor_bad_syncs = 0;
+static bool b_monitor_cat = false;
+
+static void MonitorError( int i_error )
+{
+    p_monitor_errors[i_error].i_count++;
+    p_monitor_errors[i_error].i_last_stc = i_stc;
+}
+
+/* Returns the section starting in the packet if it is fully held there,
+ * after checking its CRC */
+static const uint8_t *MonitorSection( const uint8_t *p_ts )
+{
+    const uint8_t *p_section = ts_next_section( (uint8_t *)p_ts );
+
+    if ( p_section + PSI_HEADER_SIZE > p_ts + TS_SIZE
+          || p_section + PSI_HEADER_SIZE + psi_get_length( p_section )
+               > p_ts + TS_SIZE )
+        return NULL;
+    if ( !psi_check_crc( p_section ) )
+    {
+        MonitorError( MONITOR_CRC );
+        return NULL;
+    }
+    return p_section;
+}
+
+static void MonitorReference( uint16_t i_pid, bool b_pmt )
+{
+    monitor_pid_t *p_pid = &p_monitor_pids[i_pid];
+
+    if ( b_pmt && !p_pid->b_pmt )
+    {
+        p_pid->b_pmt = true;
+        p_pid->i_psi_stc = i_stc;
+        pi_monitor_pmts[i_nb_monitor_pmts++] = i_pid;
+    }
+    else if ( !b_pmt && !p_pid->b_es )
+    {
+        p_pid->b_es = true;
+        if ( p_pid->i_seen_stc < i_stc )
+            p_pid->i_seen_stc = i_stc;
+        pi_monitor_es[i_nb_monitor_es++] = i_pid;
+    }
+    p_pid->i_ref_stc = i_stc;
+}
+
+static void MonitorPSI( const uint8_t *p_ts, uint16_t i_pid )
+{
+    monitor_pid_t *p_pid = &p_monitor_pids[i_pid];
+    const uint8_t *p_section = ts_next_section( (uint8_t *)p_ts );
+    uint8_t *p_entry;
+    uint16_t n;
+
+    if ( i_pid == PAT_PID )
+    {
+        if ( p_section < p_ts + TS_SIZE
+              && psi_get_tableid( p_section ) != PAT_TABLE_ID )
+        {
+            MonitorError( MONITOR_PAT );
+            return;
+        }
+        i_monitor_pat_stc = i_stc;
+        if ( (p_section = MonitorSection( p_ts )) == NULL )
+            return;
+        for ( n = 0; (p_entry = pat_get_program( (uint8_t *)p_section, n ))
+                       != NULL; n++ )
+            if ( patn_get_program( p_entry ) )
+                MonitorReference( patn_get_pid( p_entry ), true );
+    }
+    else if ( i_pid == CAT_PID )
+    {
+        if ( MonitorSection( p_ts ) != NULL
+              && psi_get_tableid( p_section ) == CAT_TABLE_ID )
+            b_monitor_cat = true;
+    }
+    else if ( p_pid->b_pmt && p_section < p_ts + TS_SIZE
+               && psi_get_tableid( p_section ) == PMT_TABLE_ID )
+    {
+        p_pid->i_psi_stc = i_stc;
+        if ( (p_section = MonitorSection( p_ts )) == NULL )
+            return;
+        if ( pmt_get_pcrpid( p_section ) != NULL_PID )
+            MonitorReference( pmt_get_pcrpid( p_section ), false );
+        for ( n = 0; (p_entry = pmt_get_es( (uint8_t *)p_section, n ))
+                       != NULL; n++ )
+            MonitorReference( pmtn_get_pid( p_entry ), false );
+    }
+}
+
+static void MonitorTimestamps( const uint8_t *p_ts, monitor_pid_t *p_pid )
+{
+    const uint8_t *p_pes;
+
+    if ( ts_has_adaptation( p_ts ) && ts_get_adaptation( p_ts )
+          && tsaf_has_pcr( p_ts ) )
+    {
+        uint64_t i_pcr = tsaf_get_pcr( p_ts ) * 300 + tsaf_get_pcrext( p_ts );
+
+        if ( p_pid->i_pcr_stc )
+        {
+            if ( i_stc - p_pid->i_pcr_stc > MONITOR_PCR_PERIOD )
+                MonitorError( MONITOR_PCR_REPETITION );
+            if ( !tsaf_has_discontinuity( p_ts )
+                  && (TS_CLOCK_MAX + i_pcr - p_pid->i_pcr) % TS_CLOCK_MAX
+                       > MONITOR_PCR_JUMP )
+                MonitorError( MONITOR_PCR_DISCONTINUITY );
+        }
+        p_pid->i_pcr = i_pcr;
+        p_pid->i_pcr_stc = i_stc;
+    }
+
+    if ( !ts_get_unitstart( p_ts ) || !ts_has_payload( p_ts )
+          || ts_get_scrambling( p_ts ) )
+        return;
+    p_pes = ts_payload( (uint8_t *)p_ts );
+    if ( p_pes + PES_HEADER_SIZE_PTS <= p_ts + TS_SIZE
+          && pes_validate( p_pes )
+          && pes_get_streamid( p_pes ) != PES_STREAM_ID_PRIVATE_2
+          && pes_validate_header( p_pes ) && pes_has_pts( p_pes ) )
+    {
+        if ( p_pid->i_pts_stc && i_stc - p_pid->i_pts_stc > MONITOR_PTS_PERIOD )
+            MonitorError( MONITOR_PTS );
+        p_pid->i_pts_stc = i_stc;
+    }
+}
+
+/* Tables and PIDs missing for too long, once per period of absence */
+static void MonitorCheck(void)
+{
+    unsigned int i;
+
+    if ( !i_monitor_pat_stc )
+        i_monitor_pat_stc = i_stc;
+    else if ( i_stc - i_monitor_pat_stc > MONITOR_PSI_PERIOD )
+    {
+        MonitorError( MONITOR_PAT );
+        i_monitor_pat_stc = i_stc;
+    }
+
+    for ( i = 0; i < i_nb_monitor_pmts; i++ )
+    {
+        monitor_pid_t *p_pid = &p_monitor_pids[pi_monitor_pmts[i]];
+
+        if ( i_stc - p_pid->i_ref_stc <= MONITOR_PID_PERIOD
+              && i_stc - p_pid->i_psi_stc > MONITOR_PSI_PERIOD )
+        {
+            MonitorError( MONITOR_PMT );
+            p_pid->i_psi_stc = i_stc;
+        }
+    }
+
+    for ( i = 0; i < i_nb_monitor_es; i++ )
+    {
+        monitor_pid_t *p_pid = &p_monitor_pids[pi_monitor_es[i]];
+
+        if ( i_stc - p_pid->i_ref_stc <= MONITOR_PID_PERIOD
+              && i_stc - p_pid->i_seen_stc > MONITOR_PID_PERIOD )
+        {
+            MonitorError( MONITOR_PID );
+            p_pid->i_seen_stc = i_stc;
+        }
+    }
+}
+
+static void MonitorBadSync(void)
+{
+    MonitorError( MONITOR_SYNC_BYTE );
+    if ( ++i_monitor_bad_syncs == 2 )
+        MonitorError( MONITOR_SYNC_LOSS );
+}
+
+/* The continuity counter was checked by CheckCC */
+static void Monitor( const uint8_t *p_ts, uint16_t i_pid, bool b_cc_error )
+{
+    monitor_pid_t *p_pid = &p_monitor_pids[i_pid];
+
+    i_monitor_bad_syncs = 0;
+    p_pid->i_seen_stc = i_stc;
+
+    if ( ts_get_transporterror( p_ts ) )
+    {
+        MonitorError( MONITOR_TRANSPORT );
+        return;
+    }
+
+    if ( ts_get_scrambling( p_ts ) )
+    {
+        if ( i_pid == PAT_PID )
+            MonitorError( MONITOR_PAT );
+        else if ( p_pid->b_pmt )
+            MonitorError( MONITOR_PMT );
+        if ( !b_monitor_cat )
+            MonitorError( MONITOR_CAT );
+    }
+    else if ( ts_get_unitstart( p_ts ) && ts_has_payload( p_ts )
+               && (i_pid == PAT_PID || i_pid == CAT_PID || p_pid->b_pmt) )
+        MonitorPSI( p_ts, i_pid );
+
+    if ( b_cc_error )
+        MonitorError( MONITOR_CC );
+
+    MonitorTimestamps( p_ts, p_pid );
+}
+
+static size_t MonitorStats( char *psz_stats )
+{
+    size_t i_len = sprintf( psz_stats, "<TR101290>" );
+    int i;
+
+    for ( i = 0; i < MONITOR_NB_ERRORS; i++ )
+        i_len += sprintf( psz_stats + i_len, "<ERROR name=\"%s\" priority=\"%d\" count=\"%lu\" last=\"%"PRIu64"\"/>",
+                          ppsz_monitor_errors[i],
+                          i < MONITOR_PRIORITY_2 ? 1 : 2,
+                          p_monitor_errors[i].i_count,
+                          p_monitor_errors[i].i_last_stc );
+    return i_len + sprintf( psz_stats + i_len, "</TR101290>" );
+}
+
+static void MonitorInit(void)
+{
+    CheckInit();
+    p_monitor_pids = calloc( MAX_PIDS, sizeof(monitor_pid_t) );
+    pi_monitor_pmts = malloc( MAX_PIDS * sizeof(uint16_t) );
+    pi_monitor_es = malloc( MAX_PIDS * sizeof(uint16_t) );
+}
+
+/*****************************************************************************
+ * MeasureMDI: RFC 4445 media delivery index of the input
+ *****************************************************************************
+ * The delay factor is the spread of a virtual buffer filled with the chunks
+ * at their arrival date, and drained at the rate of the stream measured
+ * between its PCRs, over MDI_PERIOD. The media loss rate counts the TS
+ * packets lost per second, from the RTP sequence numbers when the input has
+ * RTP headers, and from the continuity counters checked by CheckCC
+ * otherwise.
+ *****************************************************************************/
+#define MDI_PERIOD UINT64_C(27000000) /* 1 s */
+#define MDI_MAX_PCR_GAP UINT64_C(27000000) /* 1 s */
+
+static bool b_mdi = false;
+static uint64_t i_mdi_start = 0, i_mdi_bytes;
+static double f_mdi_vb_min, f_mdi_vb_max;
+static uint64_t i_mdi_position = 0; /* bytes received */
+static uint64_t i_mdi_first_pcr = TS_CLOCK_MAX, i_mdi_first_position;
+static uint64_t i_mdi_last_pcr = TS_CLOCK_MAX, i_mdi_last_position;
+static double f_mdi_rate = 0.; /* bytes per 27 MHz tick */
+static bool b_mdi_seqnum = false;
+static uint16_t i_mdi_seqnum;
+static unsigned long i_mdi_rtp_lost = 0, i_mdi_cc_lost = 0;
+static unsigned long i_mdi_lost = 0; /* in the current period */
+static double f_mdi_df = 0., f_mdi_df_max = 0.; /* ms */
+static unsigned long i_mdi_mlr = 0, i_mdi_mlr_max = 0;
+
+static void MDIPeriod( uint64_t i_arrival )
+{
+    uint64_t i_pcr_delta = (TS_CLOCK_MAX + i_mdi_last_pcr - i_mdi_first_pcr)
+                            % TS_CLOCK_MAX;
+
+    /* The buffer was drained at the rate of the previous period */
+    if ( f_mdi_rate > 0. )
+    {
+        f_mdi_df = (f_mdi_vb_max - f_mdi_vb_min) / f_mdi_rate / 27000.;
+        if ( f_mdi_df > f_mdi_df_max )
+            f_mdi_df_max = f_mdi_df;
+    }
+
+    /* Rate of the stream between the first and last PCRs of the period */
+    if ( i_mdi_first_pcr != TS_CLOCK_MAX && i_pcr_delta )
+    {
+        f_mdi_rate = (double)(i_mdi_last_position - i_mdi_first_position)
+                      / i_pcr_delta;
+        i_mdi_first_pcr = i_mdi_last_pcr;
+        i_mdi_first_position = i_mdi_last_position;
+    }
+
+    i_mdi_mlr = i_mdi_lost * MDI_PERIOD / (i_arrival - i_mdi_start);
+    if ( i_mdi_mlr > i_mdi_mlr_max )
+        i_mdi_mlr_max = i_mdi_mlr;
+
+    i_mdi_start = i_arrival;
+    i_mdi_bytes = 0;
+    f_mdi_vb_min = f_mdi_vb_max = 0.;
+    i_mdi_lost = 0;
+}
+
+static void MDIPCR( const uint8_t *p_ts, uint64_t i_position )
+{
+    uint64_t i_pcr = tsaf_get_pcr( p_ts ) * 300 + tsaf_get_pcrext( p_ts );
+
+    if ( i_mdi_last_pcr == TS_CLOCK_MAX || tsaf_has_discontinuity( p_ts )
+          || (TS_CLOCK_MAX + i_pcr - i_mdi_last_pcr) % TS_CLOCK_MAX
+               > MDI_MAX_PCR_GAP )
+    {
+        /* Restart the measure of the rate */
+        i_mdi_first_pcr = i_pcr;
+        i_mdi_first_position = i_position;
+    }
+    i_mdi_last_pcr = i_pcr;
+    i_mdi_last_position = i_position;
+}
+
+static void MeasureMDI( const uint8_t *p_rtp, size_t i_payload_size,
+                        uint64_t i_arrival )
+{
+    double f_drained;
+
+    if ( !i_mdi_start || i_arrival - i_mdi_start >= MDI_PERIOD )
+        MDIPeriod( i_arrival );
+
+    /* Virtual buffer before and after the arrival of the chunk */
+    f_drained = f_mdi_rate * (i_arrival - i_mdi_start);
+    if ( (double)i_mdi_bytes - f_drained < f_mdi_vb_min )
+        f_mdi_vb_min = (double)i_mdi_bytes - f_drained;
+    i_mdi_bytes += i_payload_size;
+    if ( (double)i_mdi_bytes - f_drained > f_mdi_vb_max )
+        f_mdi_vb_max = (double)i_mdi_bytes - f_drained;
+
+    if ( p_rtp != NULL )
+    {
+        uint16_t i_seqnum = rtp_get_seqnum( (uint8_t *)p_rtp );
+        uint16_t i_gap = i_seqnum - i_mdi_seqnum;
+
+        /* Late and duplicate packets aren't losses */
+        if ( !b_mdi_seqnum || i_gap < 0x8000 )
+        {
+            if ( b_mdi_seqnum && i_gap > 1 )
+            {
+                i_mdi_rtp_lost += (i_gap - 1) * (i_payload_size / TS_SIZE);
+                i_mdi_lost += (i_gap - 1) * (i_payload_size / TS_SIZE);
+            }
+            i_mdi_seqnum = i_seqnum;
+            b_mdi_seqnum = true;
+        }
+    }
+}
+
+/* Packets missing according to CheckCC only count as losses without RTP */
+static void MDIPacket( const uint8_t *p_ts, uint16_t i_pid,
+                       unsigned int i_missing, size_t i_offset )
+{
+    if ( (i_pid == i_pcr_pid || i_pcr_pid == 8192)
+          && ts_has_adaptation( p_ts ) && ts_get_adaptation( p_ts )
+          && tsaf_has_pcr( p_ts ) )
+        MDIPCR( p_ts, i_mdi_position + i_offset );
+
+    i_mdi_cc_lost += i_missing;
+    if ( !b_mdi_seqnum )
+        i_mdi_lost += i_missing;
+}
+
+static size_t MDIStats( char *psz_stats )
+{
+    return sprintf( psz_stats, "<MDI df=\"%.2f\" mlr=\"%lu\" rate=\"%"PRIu64"\" df_max=\"%.2f\" mlr_max=\"%lu\" rtp_lost=\"%lu\" cc_lost=\"%lu\"/>",
+                    f_mdi_df, i_mdi_mlr,
+                    (uint64_t)(f_mdi_rate * 8 * 27000000), f_mdi_df_max,
+                    i_mdi_mlr_max, i_mdi_rtp_lost, i_mdi_cc_lost );
+}
+
+static void MDIInit(void)
+{
+    CheckInit();
+}
+
+/*****************************************************************************
+ * CheckInput: account and check each packet of the input once
+ *****************************************************************************/
+static void CheckInput( const uint8_t *p_rtp, const uint8_t *p_payload,
+                        size_t i_payload_size, uint64_t i_arrival )
+{
+    size_t i;
+
+    if ( b_mdi )
+        MeasureMDI( p_rtp, i_payload_size, i_arrival );
+
+    for ( i = 0; i + TS_SIZE <= i_payload_size; i += TS_SIZE )
+    {
+        const uint8_t *p_ts = p_payload + i;
+        uint16_t i_pid = ts_get_pid( p_ts );
+        unsigned int i_missing;
+
+        if ( !ts_validate( p_ts ) )
+        {
+            if ( b_monitor )
+                MonitorBadSync();
+            continue;
+        }
+        i_missing = CheckCC( p_ts, &p_pid_inputs[i_pid] );
+        if ( b_pid_stats )
+            CountPIDs( p_ts, i_pid );
+        if ( b_monitor )
+            Monitor( p_ts, i_pid, i_missing != 0 );
+        if ( b_mdi )
+            MDIPacket( p_ts, i_pid, i_missing, i );
+    }
+
+    /* Tables and PIDs missing */
+    if ( b_monitor )
+        MonitorCheck();
+    if ( b_mdi )
+        i_mdi_position += i_payload_size;
+}
+
+/*****************************************************************************
+ * MapPIDs: only keep the selected PIDs, renumbered, and return the new size
+ *****************************************************************************
+ * PATs and PMTs held in a single packet are updated with the new PIDs.
+ * Packets mapped to the null PID are replaced with stuffing.
+ *****************************************************************************/
+#define MAP_UNSET 0xffff
+
+static uint16_t *pi_pid_map = NULL; /* new PID, or MAX_PIDS to drop */
+static bool b_map_all = false;
+static bool pb_map_pmt[MAX_PIDS];
+static uint8_t *p_map_carry, *p_map_spare;
+static size_t i_map_carry = 0, i_map_chunk;
+
+/* PIDs dropped or turned into stuffing keep their number in the PSI */
+static uint16_t MapPID( uint16_t i_pid )
+{
+    if ( pi_pid_map[i_pid] == MAX_PIDS || pi_pid_map[i_pid] == NULL_PID )
+        return i_pid;
+    return pi_pid_map[i_pid];
+}
+
+static void MapPSI( uint8_t *p_ts )
+{
+    uint16_t i_pid = ts_get_pid( p_ts );
+    uint8_t *p_section, *p_program, *p_es;
+    uint16_t n;
+
+    if ( !ts_get_unitstart( p_ts ) || !ts_has_payload( p_ts )
+          || ts_get_scrambling( p_ts ) )
+        return;
+    p_section = ts_next_section( p_ts );
+    if ( p_section + PSI_HEADER_SIZE > p_ts + TS_SIZE
+          || p_section + PSI_HEADER_SIZE + psi_get_length( p_section )
+               > p_ts + TS_SIZE )
+        return;
+
+    if ( i_pid == PAT_PID && psi_get_tableid( p_section ) == PAT_TABLE_ID )
+    {
+        for ( n = 0; (p_program = pat_get_program( p_section, n )) != NULL;
+              n++ )
+        {
+            uint16_t i_pmt_pid = patn_get_pid( p_program );
+            if ( patn_get_program( p_program ) )
+                pb_map_pmt[i_pmt_pid] = true;
+            patn_set_pid( p_program, MapPID( i_pmt_pid ) );
+        }
+        psi_set_crc( p_section );
+    }
+    else if ( pb_map_pmt[i_pid]
+               && psi_get_tableid( p_section ) == PMT_TABLE_ID )
+    {
+        pmt_set_pcrpid( p_section, MapPID( pmt_get_pcrpid( p_section ) ) );
+        for ( n = 0; (p_es = pmt_get_es( p_section, n )) != NULL; n++ )
+            pmtn_set_pid( p_es, MapPID( pmtn_get_pid( p_es ) ) );
+        psi_set_crc( p_section );
+    }
+}
+
+static size_t MapPIDs( uint8_t *p_buffer, size_t i_read_size )
+{
+    uint8_t *p_ts = p_buffer, *p_out = p_buffer;
+
+    for ( ; i_read_size >= TS_SIZE; i_read_size -= TS_SIZE, p_ts += TS_SIZE )
+    {
+        uint16_t i_pid = ts_get_pid( p_ts );
+        uint16_t i_new_pid = pi_pid_map[i_pid];
+
+        if ( !ts_validate( p_ts ) || i_new_pid == MAX_PIDS )
+            continue;
+
+        if ( i_new_pid == NULL_PID && i_pid != NULL_PID )
+            ts_pad( p_ts );
+        else
+        {
+            MapPSI( p_ts );
+            ts_set_pid( p_ts, i_new_pid );
+        }
+
+        if ( p_out != p_ts )
+            memcpy( p_out, p_ts, TS_SIZE );
+        p_out += TS_SIZE;
+    }
+    return p_out - p_buffer;
+}
+
+/* Returns the size of the full chunk to send, or 0 while the packets kept
+ * are less than a chunk */
+static size_t MapChunk( uint8_t *p_payload, size_t i_payload_size )
+{
+    size_t i_kept = MapPIDs( p_payload, i_payload_size );
+    size_t i_fill;
+    uint8_t *p_tmp;
+
+    if ( i_map_carry + i_kept < i_map_chunk )
+    {
+        memcpy( p_map_carry + i_map_carry, p_payload, i_kept );
+        i_map_carry += i_kept;
+        return 0;
+    }
+
+    /* Complete the pending packets with the first ones of this chunk */
+    i_fill = i_map_chunk - i_map_carry;
+    memcpy( p_map_spare, p_payload + i_fill, i_kept - i_fill );
+    memmove( p_payload + i_map_carry, p_payload, i_fill );
+    memcpy( p_payload, p_map_carry, i_map_carry );
+
+    p_tmp = p_map_carry;
+    p_map_carry = p_map_spare;
+    p_map_spare = p_tmp;
+    i_map_carry = i_kept - i_fill;
+    return i_map_chunk;
+}
+
+/* Returns the size of the last chunk, completed with stuffing, or 0 if no
+ * packets are pending */
+static size_t MapFlush( uint8_t *p_payload )
+{
+    size_t i_size = i_map_carry;
+
+    if ( !i_map_carry )
+        return 0;
+    memcpy( p_payload, p_map_carry, i_map_carry );
+    for ( ; i_size < i_map_chunk; i_size += TS_SIZE )
+        ts_pad( p_payload + i_size );
+    i_map_carry = 0;
+    return i_map_chunk;
+}
+
+static void MapInit( size_t i_len )
+{
+    uint16_t pi_targets[MAX_PIDS];
+    bool b_merge = false;
+    unsigned int i;
+
+    memset( pi_targets, 0, sizeof(pi_targets) );
+    for ( i = 0; i < MAX_PIDS; i++ )
+    {
+        if ( pi_pid_map[i] == MAP_UNSET )
+            pi_pid_map[i] = b_map_all ? i : MAX_PIDS;
+        if ( pi_pid_map[i] != MAX_PIDS && pi_pid_map[i] != NULL_PID
+              && pi_targets[pi_pid_map[i]]++ )
+            b_merge = true;
+    }
+
+    /* Merged PIDs need new continuity counters */
+    if ( b_merge && pi_pid_cc_table == NULL )
+    {
+        pi_pid_cc_table = malloc(MAX_PIDS * sizeof(uint8_t));
+        memset(pi_pid_cc_table, 0x10, MAX_PIDS * sizeof(uint8_t));
+    }
+
+    i_map_chunk = i_len - i_len % TS_SIZE;
+    p_map_carry = malloc( i_map_chunk );
+    p_map_spare = malloc( i_map_chunk );
+}
+
+/*****************************************************************************
+ * SpeedTS: scale a timestamp for the playback speed
+ *****************************************************************************
+ * Timestamps are scaled around an origin, which PCRs move forward from time
+ * to time so that the differences stay far from the wrap-around.
+ *****************************************************************************/
+static uint64_t i_speed_origin = TS_CLOCK_MAX, i_speed_output;
+
+static uint64_t SpeedTS(uint64_t i_ts, bool b_pcr)
+{
+    int64_t i_delta;
+    uint64_t i_output;
+
+    if (i_speed == SPEED_UNIT)
+        return i_ts;
+    if (i_speed_origin == TS_CLOCK_MAX)
+        i_speed_origin = i_speed_output = i_ts;
 
-    return 0;
+    i_delta = (TS_CLOCK_MAX + i_ts - i_speed_origin) % TS_CLOCK_MAX;
+    if (i_delta >= (int64_t)(TS_CLOCK_MAX / 2))
+        i_delta -= TS_CLOCK_MAX; /* before the origin */
+    i_delta = i_delta * SPEED_UNIT / (int64_t)i_speed;
+    i_output = (TS_CLOCK_MAX + i_speed_output + i_delta) % TS_CLOCK_MAX;
+
+    if (b_pcr && i_delta > (int64_t)(TS_CLOCK_MAX / 8))
+    {
+        i_speed_origin = i_ts;
+        i_speed_output = i_output;
+    }
+    return i_output;
 }
 
 /*****************************************************************************
- * GetPCR: read PCRs to align RTP timestamps with PCR scale (RFC compliance)
+ * Thin: when playing fast, only keep the random access pictures of the
+ * video PID, the packets which aren't PES, and the PCRs; returns the new size
  *****************************************************************************/
-static void GetPCR( const uint8_t *p_buffer, size_t i_read_size )
+#define THIN_PCR_INTERVAL (27000000 / 25) /* of output time */
+
+static bool b_thin_keep = false, b_thin_cc = false;
+static uint8_t i_thin_cc;
+static uint64_t i_thin_pcr_stc = 0;
+static bool pb_thin_pes[MAX_PIDS];
+
+static size_t Thin( uint8_t *p_buffer, size_t i_read_size )
 {
-    while ( i_read_size >= TS_SIZE )
+    uint8_t *p_ts = p_buffer, *p_out = p_buffer;
+
+    for ( ; i_read_size >= TS_SIZE; i_read_size -= TS_SIZE, p_ts += TS_SIZE )
     {
-        uint16_t i_pid = ts_get_pid( p_buffer );
+        uint16_t i_pid = ts_get_pid( p_ts );
+        bool b_keep;
 
-        if ( !ts_validate( p_buffer ) )
+        if ( !ts_validate( p_ts ) || i_pid == NULL_PID )
+            continue;
+
+        if ( ts_get_unitstart( p_ts ) && ts_has_payload( p_ts ) )
         {
-            msg_Warn( NULL, "invalid TS packet (sync=0x%x)", p_buffer[0] );
+            uint8_t *p_payload = ts_payload( p_ts );
+            pb_thin_pes[i_pid] = p_payload + PES_HEADER_SIZE <= p_ts + TS_SIZE
+                                  && pes_validate( p_payload );
+            if ( i_pid == i_thin_pid )
+                b_thin_keep = ts_has_adaptation( p_ts )
+                               && ts_get_adaptation( p_ts )
+                               && tsaf_has_randomaccess( p_ts );
         }
-        else if ( (i_pid == i_pcr_pid || i_pcr_pid == 8192)
-              && ts_has_adaptation(p_buffer) && ts_get_adaptation(p_buffer)
-              && tsaf_has_pcr(p_buffer) )
+        b_keep = i_pid == i_thin_pid ? b_thin_keep : !pb_thin_pes[i_pid];
+
+        if ( !b_keep )
         {
-            i_pcr = tsaf_get_pcr( p_buffer ) * 300 + tsaf_get_pcrext( p_buffer );
-            i_pcr_stc = i_stc;
+            if ( !ts_has_adaptation( p_ts ) || !ts_get_adaptation( p_ts )
+                  || !tsaf_has_pcr( p_ts )
+                  || (i_thin_pcr_stc && SpeedDelay( i_stc - i_thin_pcr_stc )
+                                          < THIN_PCR_INTERVAL) )
+                continue;
+            i_thin_pcr_stc = i_stc;
+
+            /* Only keep the PCR, in a packet without payload */
+            p_ts[1] &= ~0x40;
+            p_ts[3] = (p_ts[3] & 0xcf) | 0x20;
+            p_ts[4] = TS_SIZE - TS_HEADER_SIZE - 1;
+            p_ts[5] &= 0x90;
+            memset( p_ts + TS_HEADER_SIZE_PCR, 0xff,
+                    TS_SIZE - TS_HEADER_SIZE_PCR );
         }
-        p_buffer += TS_SIZE;
-        i_read_size -= TS_SIZE;
+
+        /* Keep the video PID continuous */
+        if ( i_pid == i_thin_pid )
+        {
+            if ( !b_thin_cc )
+            {
+                i_thin_cc = (ts_get_cc( p_ts ) + 0xf) & 0xf;
+                b_thin_cc = true;
+            }
+            if ( ts_has_payload( p_ts ) )
+                i_thin_cc = (i_thin_cc + 1) & 0xf;
+            ts_set_cc( p_ts, i_thin_cc );
+        }
+
+        if ( p_out != p_ts )
+            memcpy( p_out, p_ts, TS_SIZE );
+        p_out += TS_SIZE;
     }
+    return p_out - p_buffer;
 }
 
 /*****************************************************************************
- * FixCC: fix continuity counters
+ * SplitDate: date of a piece of a chunk sent in several datagrams, spread
+ * between the dates of the previous chunk and of this one
  *****************************************************************************/
-static void FixCC( uint8_t *p_buffer, size_t i_read_size )
+static uint64_t i_split_last_stc = 0;
+
+static uint64_t SplitDate( uint64_t i_chunk_stc, size_t i_piece,
+                           size_t i_nb_pieces )
 {
-    while ( i_read_size >= TS_SIZE )
-    {
-        uint16_t i_pid = ts_get_pid( p_buffer );
+    if ( !i_split_last_stc || i_chunk_stc <= i_split_last_stc
+          || i_chunk_stc - i_split_last_stc > MAX_LATENESS )
+        return i_chunk_stc;
+    return i_split_last_stc + (i_chunk_stc - i_split_last_stc)
+                               * (i_piece + 1) / i_nb_pieces;
+}
 
-        if ( !ts_validate( p_buffer ) )
-        {
-            msg_Warn( NULL, "invalid TS packet (sync=0x%x)", p_buffer[0] );
-        }
-        else
+/*****************************************************************************
+ * DepartPCR: stamp the PCRs of the PCR PID with their departure time
+ *****************************************************************************
+ * The offset between the local clock and the PCRs is smoothed over
+ * DEPART_TAU, so that it follows the drift; the difference with the current
+ * offset is the scheduling jitter, which is added to the PCR.
+ *****************************************************************************/
+#define DEPART_TAU INT64_C(270000000) /* 10 s */
+#define DEPART_MAX_JITTER INT64_C(2700000) /* 100 ms */
+
+static bool b_depart_locked = false;
+static int64_t i_depart_offset;
+static uint64_t i_depart_last_pcr;
+
+static void DepartPCR( uint8_t *p_buffer, size_t i_size )
+{
+    uint64_t i_wall = pf_Date();
+
+    for ( ; i_size >= TS_SIZE; i_size -= TS_SIZE, p_buffer += TS_SIZE )
+    {
+        uint64_t i_pcr, i_dt;
+        int64_t i_jitter;
+
+        if ( !ts_validate( p_buffer )
+              || (ts_get_pid( p_buffer ) != i_pcr_pid && i_pcr_pid != 8192)
+              || !ts_has_adaptation( p_buffer )
+              || !ts_get_adaptation( p_buffer ) || !tsaf_has_pcr( p_buffer ) )
+            continue;
+
+        i_pcr = tsaf_get_pcr( p_buffer ) * 300 + tsaf_get_pcrext( p_buffer );
+        i_jitter = (int64_t)(i_wall - i_pcr) - i_depart_offset;
+        if ( !b_depart_locked || i_jitter > DEPART_MAX_JITTER
+              || i_jitter < -DEPART_MAX_JITTER )
         {
-            if ( pi_pid_cc_table[i_pid] == 0x10 )
-            {
-                msg_Dbg( NULL, "new pid entry %d", i_pid );
-                pi_pid_cc_table[i_pid] = 0;
-            }
-            else if ( ts_has_payload( p_buffer ) )
-            {
-                pi_pid_cc_table[i_pid] = (pi_pid_cc_table[i_pid] + 1) % 0x10; 
-            }
-            ts_set_cc( p_buffer, pi_pid_cc_table[i_pid] );
+            /* Start over after a discontinuity */
+            i_depart_offset = i_wall - i_pcr;
+            i_depart_last_pcr = i_pcr;
+            b_depart_locked = true;
+            continue;
         }
-        p_buffer += TS_SIZE;
-        i_read_size -= TS_SIZE;
+
+        i_dt = (TS_CLOCK_MAX + i_pcr - i_depart_last_pcr) % TS_CLOCK_MAX;
+        if ( i_dt > DEPART_TAU )
+            i_dt = DEPART_TAU;
+        i_depart_offset += i_jitter * (int64_t)i_dt / DEPART_TAU;
+        i_depart_last_pcr = i_pcr;
+
+        i_pcr = (TS_CLOCK_MAX + i_pcr + (int64_t)(i_wall - i_pcr)
+                  - i_depart_offset) % TS_CLOCK_MAX;
+        tsaf_set_pcr( p_buffer, i_pcr / 300 );
+        tsaf_set_pcrext( p_buffer, i_pcr % 300 );
     }
 }
 
@@ -826,11 +4451,12 @@ static void RestampPCR(uint8_t *p_ts)
         }
     }
     i_last_pcr_date = i_stc;
-    if (!i_pcr_offset)
+    if (!i_pcr_offset && i_speed == SPEED_UNIT)
         return;
 
     i_pcr += i_pcr_offset;
     i_pcr %= TS_CLOCK_MAX;
+    i_pcr = SpeedTS(i_pcr, true);
     tsaf_set_pcr(p_ts, i_pcr / 300);
     tsaf_set_pcrext(p_ts, i_pcr % 300);
     tsaf_clear_discontinuity(p_ts);
@@ -843,7 +4469,7 @@ static uint64_t RestampTS(uint64_t i_ts)
 {
     i_ts += i_pcr_offset;
     i_ts %= TS_CLOCK_MAX;
-    return i_ts;
+    return SpeedTS(i_ts, false);
 }
 
 /*****************************************************************************
@@ -901,6 +4527,7 @@ int main( int i_argc, char **pp_argv )
     bool b_passthrough = false;
     bool b_restamp = false;
     int i_stc_fd = -1;
+    size_t i_stc_size = 256; /* only grows, with the statistics */
     off_t i_skip_chunks = 0, i_nb_chunks = -1;
     int64_t i_seek = 0;
     uint64_t i_duration = 0;
@@ -912,7 +4539,7 @@ int main( int i_argc, char **pp_argv )
     sigset_t set;
 
     /* Parse options */
-    while ( (c = getopt( i_argc, pp_argv, "i:l:t:XT:fp:CPs:n:k:d:ar:S:uUm:R:wh" )) != -1 )
+    while ( (c = getopt( i_argc, pp_argv, "i:l:t:XT:fp:CPs:n:k:d:ar:S:uUm:R:wAcE:O:W:D:J:Fj:I:Kx:g:LeB:N:ZzM:YGQHq:oh" )) != -1 )
     {
         switch ( c )
         {
@@ -1010,6 +4637,138 @@ int main( int i_argc, char **pp_argv )
             b_raw_packets = true;
             break;
 
+        case 'A':
+            i_aux_version = 2;
+            break;
+
+        case 'c':
+            b_output_container = true;
+            break;
+
+        case 'E':
+            i_retention_files = strtoul( optarg, NULL, 0 );
+            break;
+
+        case 'O':
+            i_retention_age = strtoull( optarg, NULL, 0 );
+            break;
+
+        case 'W':
+            i_retention_usage = strtoul( optarg, NULL, 0 );
+            break;
+
+        case 'D':
+            i_bucket_size = strtoull( optarg, NULL, 0 );
+            break;
+
+        case 'J':
+            ppsz_stripe_dirs = realloc( ppsz_stripe_dirs,
+                                (i_nb_stripe_dirs + 1) * sizeof(char *) );
+            ppsz_stripe_dirs[i_nb_stripe_dirs++] = optarg;
+            AddDirRoot( optarg );
+            break;
+
+        case 'F':
+            b_stripe_free_space = true;
+            break;
+
+        case 'j':
+            i_extract_threads = strtoul( optarg, NULL, 0 );
+            if ( !i_extract_threads )
+                i_extract_threads = 1;
+            break;
+
+        case 'I':
+            i_rap_pid = strtol( optarg, NULL, 0 );
+            break;
+
+        case 'K':
+            b_psi_start = true;
+            break;
+
+        case 'x':
+            i_speed = strtod( optarg, NULL ) * SPEED_UNIT;
+            if ( !i_speed )
+                usage();
+            break;
+
+        case 'g':
+            i_thin_pid = strtol( optarg, NULL, 0 );
+            break;
+
+        case 'L':
+            b_playlist = true;
+            break;
+
+        case 'e':
+            b_loop = true;
+            break;
+
+        case 'B':
+            i_shaper_latency = strtoull( optarg, NULL, 0 );
+            break;
+
+        case 'N':
+            i_split_packets = strtoul( optarg, NULL, 0 );
+            break;
+
+        case 'Z':
+            b_depart_pcr = true;
+            break;
+
+        case 'z':
+            b_null_strip = true;
+            break;
+
+        case 'M':
+        {
+            char *psz_end;
+            unsigned long i_pid = strtoul( optarg, &psz_end, 0 );
+            unsigned long i_new_pid = i_pid;
+            unsigned int i;
+
+            if ( *psz_end == '=' )
+                i_new_pid = psz_end[1] == '-' ? MAX_PIDS
+                                              : strtoul( psz_end + 1, NULL, 0 );
+            if ( i_pid > MAX_PIDS || i_new_pid > MAX_PIDS )
+                usage();
+            if ( pi_pid_map == NULL )
+            {
+                pi_pid_map = malloc(MAX_PIDS * sizeof(uint16_t));
+                for ( i = 0; i < MAX_PIDS; i++ )
+                    pi_pid_map[i] = MAP_UNSET;
+            }
+            if ( i_pid == MAX_PIDS )
+                b_map_all = true;
+            else
+                pi_pid_map[i_pid] = i_new_pid;
+            break;
+        }
+
+        case 'Y':
+            b_demux = true;
+            break;
+
+        case 'G':
+            b_pid_stats = true;
+            break;
+
+        case 'Q':
+            b_monitor = true;
+            break;
+
+        case 'H':
+            b_mdi = true;
+            break;
+
+        case 'q':
+            i_reorder_depth = strtoul( optarg, NULL, 0 );
+            break;
+
+        case 'o':
+            b_udp_tune = true;
+            break;
+
         case 'h':
         default:
             usage();
@@ -1022,9 +4781,33 @@ int main( int i_argc, char **pp_argv )
     if ( psz_syslog_tag != NULL )
         msg_Openlog( psz_syslog_tag, LOG_NDELAY, LOG_USER );
 
+    if ( i_bucket_size )
+        SetDirLayout( i_rotate_size, i_bucket_size );
+
+    if ( pi_pid_map != NULL )
+        MapInit( i_asked_payload_size );
+
     /* Open sockets */
-    if ( udp_InitRead( pp_argv[optind], i_asked_payload_size, i_skip_chunks,
-                       i_seek ) < 0 )
+    if ( b_playlist || b_loop )
+    {
+        if ( playlist_InitRead( pp_argv[optind], i_asked_payload_size,
+                                i_skip_chunks, i_seek ) < 0 )
+        {
+            msg_Err( NULL, "couldn't open input, exiting" );
+            exit(EXIT_FAILURE);
+        }
+        b_input_udp = true;
+
+        /* Keep the stream continuous from one file to the next */
+        b_restamp = true;
+        if ( pi_pid_cc_table == NULL )
+        {
+            pi_pid_cc_table = malloc(MAX_PIDS * sizeof(uint8_t));
+            memset(pi_pid_cc_table, 0x10, MAX_PIDS * sizeof(uint8_t));
+        }
+    }
+    else if ( udp_InitRead( pp_argv[optind], i_asked_payload_size,
+                            i_skip_chunks, i_seek ) < 0 )
     {
         int i_ret;
         mode_t i_mode = StatFile( pp_argv[optind] );
@@ -1040,6 +4823,10 @@ int main( int i_argc, char **pp_argv )
         else if ( S_ISCHR( i_mode ) || S_ISFIFO( i_mode ) )
             i_ret = stream_InitRead( pp_argv[optind], i_asked_payload_size,
                                      i_skip_chunks, i_seek );
+        else if ( i_pcr_pid
+                   && pcr_IsRaw( pp_argv[optind], i_asked_payload_size ) )
+            i_ret = pcr_InitRead( pp_argv[optind], i_asked_payload_size,
+                                  i_skip_chunks, i_seek );
         else
             i_ret = file_InitRead( pp_argv[optind], i_asked_payload_size,
                                    i_skip_chunks, i_seek );
@@ -1052,12 +4839,30 @@ int main( int i_argc, char **pp_argv )
     }
     optind++;
 
+    if ( i_speed != SPEED_UNIT )
+    {
+        if ( pf_Read == file_Read || pf_Read == dir_Read
+              || pf_Read == playlist_Read || pf_Read == pcr_Read )
+            b_restamp = true; /* Keep receivers locked */
+        else
+        {
+            msg_Warn( NULL, "speed only applies to files and directories" );
+            i_speed = SPEED_UNIT;
+        }
+    }
+
     if ( udp_InitWrite( pp_argv[optind], i_asked_payload_size, b_append ) < 0 )
     {
         int i_ret;
         mode_t i_mode = StatFile( pp_argv[optind] );
 
-        if ( S_ISDIR( i_mode ) )
+        if ( b_demux )
+            i_ret = demux_InitWrite( pp_argv[optind], i_asked_payload_size,
+                                     b_append );
+        else if ( S_ISDIR( i_mode ) && i_nb_stripe_dirs )
+            i_ret = stripe_InitWrite( pp_argv[optind], i_asked_payload_size,
+                                      b_append );
+        else if ( S_ISDIR( i_mode ) )
             i_ret = dir_InitWrite( pp_argv[optind], i_asked_payload_size,
                                    b_append );
         else if ( S_ISCHR( i_mode ) || S_ISFIFO( i_mode ) )
@@ -1118,6 +4923,122 @@ int main( int i_argc, char **pp_argv )
         exit(EXIT_FAILURE);
     }
 
+    if ( i_split_packets )
+    {
+        if ( pf_Write != udp_Write && pf_Write != raw_Write )
+        {
+            msg_Warn( NULL,
+                      "splitting chunks only applies to network outputs" );
+            i_split_packets = 0;
+        }
+        else if ( !b_input_udp )
+        {
+            msg_Warn( NULL,
+                      "splitting chunks needs an input without RTP header" );
+            i_split_packets = 0;
+        }
+    }
+
+    if ( b_demux && pf_Write != demux_Write )
+        msg_Warn( NULL, "splitting programs only applies to directories" );
+
+    if ( b_pid_stats )
+    {
+        if ( i_stc_fd == -1 )
+        {
+            msg_Warn( NULL, "PID statistics need a statistics file (-T)" );
+            b_pid_stats = false;
+        }
+        else
+            CountInit();
+    }
+
+    if ( b_monitor )
+    {
+        if ( i_stc_fd == -1 )
+        {
+            msg_Warn( NULL, "monitoring needs a statistics file (-T)" );
+            b_monitor = false;
+        }
+        else
+            MonitorInit();
+    }
+
+    if ( b_mdi )
+    {
+        if ( i_stc_fd == -1 )
+        {
+            msg_Warn( NULL, "MDI needs a statistics file (-T)" );
+            b_mdi = false;
+        }
+        else if ( !i_pcr_pid )
+        {
+            msg_Warn( NULL, "MDI needs a PCR PID (-p)" );
+            b_mdi = false;
+        }
+        else
+            MDIInit();
+    }
+
+    if ( b_depart_pcr && !i_pcr_pid )
+    {
+        msg_Warn( NULL, "departure PCRs need a PCR PID (-p)" );
+        b_depart_pcr = false;
+    }
+
+    /* Put RTP inputs back in order */
+    if ( i_reorder_depth )
+    {
+        if ( pf_Read != udp_Read || b_tcp || b_input_udp )
+            msg_Warn( NULL, "re-sequencing only applies to RTP inputs" );
+        else
+            reorder_Init( i_max_read_size );
+    }
+
+    /* De-jitter live inputs */
+    if ( i_shaper_latency )
+    {
+        if ( !i_pcr_pid )
+            msg_Warn( NULL, "shaping needs a PCR PID (-p)" );
+        else if ( pf_Read != udp_Read && pf_Read != stream_Read
+                   && pf_Read != reorder_Read )
+            msg_Warn( NULL, "shaping only applies to live inputs" );
+        else
+            shaper_Init( i_max_read_size );
+    }
+
+    /* Restore the null packets removed at recording */
+    if ( i_input_null_fd != -1 )
+        null_InitRead( i_max_read_size );
+
+    if ( b_null_strip )
+    {
+        if ( pf_Write == file_Write || pf_Write == dir_Write )
+            null_InitWrite( i_asked_payload_size );
+        else
+            msg_Warn( NULL,
+                "null packets are only removed from files and directories" );
+    }
+
+    /* Start with the last PAT and PMTs */
+    if ( b_psi_start && i_seek && (pf_Read == file_Read || pf_Read == dir_Read
+                                    || pf_Read == playlist_Read
+                                    || pf_Read == null_Read) )
+    {
+        off_t i_psi_chunks = psi_Init( i_asked_payload_size );
+        if ( i_nb_chunks > 0 )
+            i_nb_chunks += i_psi_chunks;
+    }
+
+    /* Fast path for extractions to a file */
+    if ( !b_sleep && (pf_Read == file_Read || pf_Read == dir_Read)
+          && pf_Write == file_Write && p_output_aux != NULL
+          && pi_pid_cc_table == NULL && !b_restamp && !b_passthrough
+          && i_stc_fd == -1 && i_output_rap_fd == -1
+          && pi_pid_map == NULL )
+        if ( !Extract( i_duration, &i_nb_chunks ) )
+            b_die = 1;
+
     /* Main loop */
     while ( !b_die )
     {
@@ -1126,13 +5047,15 @@ int main( int i_argc, char **pp_argv )
         size_t i_payload_size;
         uint8_t *p_write_buffer;
         size_t i_write_size;
+        uint64_t i_chunk_stc;
+        size_t i_piece, i_piece_size, i_nb_pieces;
 
         if ( i_duration && i_stc > i_first_stc + i_duration )
             break;
 
         if ( i_read_size <= 0 ) continue;
 
-        if ( b_sleep && pf_Delay != NULL)
+        if ( b_sleep && pf_Delay != NULL && !i_split_packets )
             if (!pf_Delay())
                 goto dropped_packet;
 
@@ -1154,6 +5077,35 @@ int main( int i_argc, char **pp_argv )
         i_read_size -= i_payload_size % TS_SIZE;
         i_payload_size -= i_payload_size % TS_SIZE;
 
+        /* Account the packets of each PID, check the TR 101 290
+         * indicators and measure the media delivery index, on the arrival
+         * dates even if -B or -q release the chunks later; files are dated
+         * from their auxiliary files, which hold the arrival dates */
+        if ( p_pid_inputs != NULL )
+            CheckInput( b_input_udp ? NULL : p_read_buffer, p_payload,
+                        i_payload_size,
+                        i_input_arrival ? i_input_arrival : i_stc );
+
+        /* Only keep random access pictures when playing fast */
+        if ( i_thin_pid && i_speed > SPEED_UNIT )
+        {
+            size_t i_thin_size = Thin( p_payload, i_payload_size );
+            if ( !i_thin_size )
+                goto dropped_packet;
+            i_read_size -= i_payload_size - i_thin_size;
+            i_payload_size = i_thin_size;
+        }
+
+        /* Filter and renumber PIDs */
+        if ( pi_pid_map != NULL )
+        {
+            size_t i_map_size = MapChunk( p_payload, i_payload_size );
+            if ( !i_map_size )
+                goto dropped_packet;
+            i_read_size = i_read_size - i_payload_size + i_map_size;
+            i_payload_size = i_map_size;
+        }
+
         /* Pad to get the asked payload size */
         while ( i_payload_size + TS_SIZE <= i_asked_payload_size )
         {
@@ -1170,72 +5122,121 @@ int main( int i_argc, char **pp_argv )
         if ( b_restamp )
             Restamp( p_payload, i_payload_size );
 
-        /* Prepare header and size of output */
-        if ( b_output_udp )
-        {
-            p_write_buffer = p_payload;
-            i_write_size = i_payload_size;
-        }
-        else /* RTP output */
+        /* Send the chunk in pieces, paced between the chunk dates */
+        i_chunk_stc = i_stc;
+        i_piece_size = i_split_packets ? i_split_packets * TS_SIZE
+                                       : i_payload_size;
+        i_nb_pieces = (i_payload_size + i_piece_size - 1) / i_piece_size;
+        for ( i_piece = 0; i_piece < i_nb_pieces; i_piece++ )
         {
-            if ( b_input_udp )
+            uint8_t *p_piece = p_payload + i_piece * i_piece_size;
+            size_t i_size = i_piece_size;
+
+            if ( i_piece == i_nb_pieces - 1 )
+                i_size = i_payload_size - i_piece * i_piece_size;
+            if ( i_split_packets )
             {
-                p_write_buffer = p_buffer;
-                i_write_size = i_payload_size + RTP_HEADER_SIZE;
+                i_stc = SplitDate( i_chunk_stc, i_piece, i_nb_pieces );
+                if ( b_sleep && pf_Delay != NULL && !pf_Delay() )
+                    continue;
+            }
 
-                rtp_set_hdr( p_write_buffer );
-                rtp_set_type( p_write_buffer, RTP_TYPE_TS );
-                rtp_set_seqnum( p_write_buffer, i_rtp_seqnum );
-                i_rtp_seqnum++;
+            /* Stamp the PCRs with the departure time */
+            if ( b_depart_pcr )
+                DepartPCR( p_piece, i_size );
 
-                if ( i_pcr_pid )
-                {
-                    GetPCR( p_payload, i_payload_size );
-                    rtp_set_timestamp( p_write_buffer,
-                                       (i_pcr + (i_stc - i_pcr_stc)) / 300 );
-                }
-                else
-                {
-                    /* This isn't RFC-compliant but no one really cares */
-                    rtp_set_timestamp( p_write_buffer, i_stc / 300 );
-                }
-                rtp_set_ssrc( p_write_buffer, (uint8_t *)&i_ssrc );
+            /* Prepare header and size of output */
+            if ( b_output_udp )
+            {
+                p_write_buffer = p_piece;
+                i_write_size = i_size;
             }
-            else /* RTP output, RTP input */
+            else /* RTP output */
             {
-                p_write_buffer = p_read_buffer;
-                i_write_size = i_read_size;
-
-                if ( i_pcr_pid )
+                if ( b_input_udp )
                 {
-                    if ( rtp_get_type( p_write_buffer ) != RTP_TYPE_TS )
-                        msg_Warn( NULL, "input isn't MPEG transport stream" );
+                    p_write_buffer = p_piece - RTP_HEADER_SIZE;
+                    i_write_size = i_size + RTP_HEADER_SIZE;
+
+                    rtp_set_hdr( p_write_buffer );
+                    rtp_set_type( p_write_buffer, RTP_TYPE_TS );
+                    rtp_set_seqnum( p_write_buffer, i_rtp_seqnum );
+                    i_rtp_seqnum++;
+
+                    if ( i_pcr_pid )
+                    {
+                        GetPCR( p_piece, i_size );
+                        rtp_set_timestamp( p_write_buffer,
+                            (i_pcr + SpeedDelay( i_stc - i_pcr_stc )) / 300 );
+                    }
                     else
-                        GetPCR( p_payload, i_payload_size );
-                    rtp_set_timestamp( p_write_buffer,
-                                       (i_pcr + (i_stc - i_pcr_stc)) / 300 );
-                }
-                if ( b_overwrite_ssrc )
+                    {
+                        /* This isn't RFC-compliant but no one really cares */
+                        rtp_set_timestamp( p_write_buffer, (i_first_stc
+                            + SpeedDelay( i_stc - i_first_stc )) / 300 );
+                    }
                     rtp_set_ssrc( p_write_buffer, (uint8_t *)&i_ssrc );
+                }
+                else /* RTP output, RTP input */
+                {
+                    p_write_buffer = p_read_buffer;
+                    i_write_size = i_read_size;
+
+                    if ( i_pcr_pid )
+                    {
+                        if ( rtp_get_type( p_write_buffer ) != RTP_TYPE_TS )
+                            msg_Warn( NULL,
+                                      "input isn't MPEG transport stream" );
+                        else
+                            GetPCR( p_piece, i_size );
+                        rtp_set_timestamp( p_write_buffer,
+                                           (i_pcr + (i_stc - i_pcr_stc)) / 300 );
+                    }
+                    if ( b_overwrite_ssrc )
+                        rtp_set_ssrc( p_write_buffer, (uint8_t *)&i_ssrc );
+                }
             }
-        }
 
-        pf_Write( p_write_buffer, i_write_size );
-        if ( b_passthrough )
-            if ( write( STDOUT_FILENO, p_write_buffer, i_write_size )
-                  != i_write_size )
-                msg_Warn( NULL, "write(stdout) error (%s)", strerror(errno) );
+            pf_Write( p_write_buffer, i_write_size );
+            if ( b_passthrough )
+                if ( write( STDOUT_FILENO, p_write_buffer, i_write_size )
+                      != i_write_size )
+                    msg_Warn( NULL, "write(stdout) error (%s)",
+                              strerror(errno) );
+        }
+        i_stc = i_chunk_stc;
+        i_split_last_stc = i_chunk_stc;
 
 dropped_packet:
         if ( i_stc_fd != -1 )
         {
-            char psz_stc[256];
-            size_t i_len = sprintf( psz_stc, "<?xml version=\"1.0\" encoding=\"utf-8\"?><MULTICAT><STC value=\"%"PRIu64"\"/></MULTICAT>", i_stc );
-            memset( psz_stc + i_len, '\n', sizeof(psz_stc) - i_len );
-            if ( lseek( i_stc_fd, 0, SEEK_SET ) == (off_t)-1 )
+            char psz_stc[4096];
+            size_t i_len = 0;
+            off_t i_offset = 0;
+
+            if ( b_pid_stats )
+                i_offset = PIDStats( i_stc_fd );
+            else
+                i_len = sprintf( psz_stc, "<?xml version=\"1.0\" encoding=\"utf-8\"?><MULTICAT>" );
+            i_len += sprintf( psz_stc + i_len, "<STC value=\"%"PRIu64"\"/>", i_stc );
+            if ( pf_Read == shaper_Read )
+                i_len += shaper_Stats( psz_stc + i_len );
+            if ( pf_Read == reorder_Read || pf_shaper_Read == reorder_Read )
+                i_len += reorder_Stats( psz_stc + i_len );
+            if ( i_udp_rcvbuf )
+                i_len += udp_Stats( psz_stc + i_len );
+            if ( b_monitor )
+                i_len += MonitorStats( psz_stc + i_len );
+            if ( b_mdi )
+                i_len += MDIStats( psz_stc + i_len );
+            i_len += sprintf( psz_stc + i_len, "</MULTICAT>" );
+            if ( i_len > i_stc_size )
+                i_stc_size = i_len;
+            memset( psz_stc + i_len, '\n', i_stc_size - i_len );
+            if ( lseek( i_stc_fd, i_offset, SEEK_SET ) == (off_t)-1 )
                 msg_Warn( NULL, "lseek date file failed (%s)",
                           strerror(errno) );
-            if ( write( i_stc_fd, psz_stc, sizeof(psz_stc) ) != sizeof(psz_stc) )
+            if ( write( i_stc_fd, psz_stc, i_stc_size ) != i_stc_size )
                 msg_Warn( NULL, "write date file error (%s)", strerror(errno) );
         }
 
@@ -1245,7 +5246,51 @@ dropped_packet:
             break;
     }
 
+    /* Send the last packets kept by -M, the padding counting as regular
+     * packets */
+    if ( pi_pid_map != NULL && i_map_carry )
+    {
+        uint8_t *p_payload = b_input_udp ? p_read_buffer
+                                         : rtp_payload( p_read_buffer );
+        size_t i_payload_size = MapFlush( p_payload );
+        uint8_t *p_write_buffer = p_payload;
+        size_t i_write_size = i_payload_size;
+
+        if ( pi_pid_cc_table != NULL )
+            FixCC( p_payload, i_payload_size );
+        if ( b_restamp )
+            Restamp( p_payload, i_payload_size );
+        if ( b_depart_pcr )
+            DepartPCR( p_payload, i_payload_size );
+
+        if ( !b_output_udp )
+        {
+            /* Same header as the previous chunk, with the next sequence
+             * number */
+            if ( b_input_udp )
+            {
+                p_write_buffer = p_payload - RTP_HEADER_SIZE;
+                rtp_set_seqnum( p_write_buffer, i_rtp_seqnum );
+                i_rtp_seqnum++;
+            }
+            else
+            {
+                p_write_buffer = p_read_buffer;
+                rtp_set_seqnum( p_write_buffer,
+                                rtp_get_seqnum( p_write_buffer ) + 1 );
+            }
+            i_write_size += p_payload - p_write_buffer;
+        }
+
+        pf_Write( p_write_buffer, i_write_size );
+        if ( b_passthrough )
+            if ( write( STDOUT_FILENO, p_write_buffer, i_write_size )
+                  != i_write_size )
+                msg_Warn( NULL, "write(stdout) error (%s)", strerror(errno) );
+    }
+
     free(pi_pid_cc_table);
+    free(ppsz_stripe_dirs);
 
     pf_ExitRead();
     pf_ExitWrite();
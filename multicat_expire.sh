@@ -35,13 +35,13 @@ DIR=$1
 WANTED_CHUNKS=$2
 
 cd "$DIR"
-NB_CHUNKS=`ls -a -1 *.ts | wc -l`
+NB_CHUNKS=`ls -a -1 *.ts *.mct 2>/dev/null | wc -l`
 
 if test $NB_CHUNKS -gt $WANTED_CHUNKS; then
-	ls -t *.ts 2>/dev/null | tail -n $(($WANTED_CHUNKS-$NB_CHUNKS)) | cut -d. -f 1 | xargs -I FILE sh -c "rm -rf FILE.*"
+	ls -t *.ts *.mct 2>/dev/null | tail -n $(($WANTED_CHUNKS-$NB_CHUNKS)) | cut -d. -f 1 | xargs -I FILE sh -c "rm -rf FILE.*"
 fi
 
-FILES=`find . -name \*.ts -size +7 -print`
+FILES=`find . \( -name \*.ts -o -name \*.mct \) -size +7 -print`
 if test -n "$FILES"; then
 	ls -t $FILES 2>/dev/null | tail -n 1 | xargs basename | cut -d. -f 1
 fi
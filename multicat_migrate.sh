@@ -0,0 +1,47 @@
+#!/bin/sh
+###############################################################################
+# multicat_migrate.sh
+###############################################################################
+# Copyright (C) 2016 VideoLAN
+#
+# Authors: Christophe Massiot <massiot@via.ecp.fr>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+###############################################################################
+
+# Moves the files of a flat multicat directory to the subdirectories used
+# with multicat -D <subdirectory duration>. It may be run while multicat is
+# reading or writing the directory.
+
+usage() {
+	echo "Usage: $0 <directory> <subdirectory duration> [<file duration>]" >&2
+	exit 1
+}
+
+if test $# -lt 2 -o $# -gt 3 -o "$1" = "-h" -o "$1" = "--help"; then
+	usage
+fi
+
+DIR=$1
+BUCKET_SIZE=$2
+ROTATE_SIZE=${3:-97200000000}
+
+cd "$DIR" || exit 1
+
+for FILE in `ls -1 | grep '^[0-9][0-9]*\.'`; do
+	BUCKET=$((${FILE%%.*} * $ROTATE_SIZE / $BUCKET_SIZE))
+	test -d $BUCKET || mkdir $BUCKET || exit 1
+	mv $FILE $BUCKET/ || exit 1
+done
@@ -41,6 +41,7 @@
  * Local declarations
  *****************************************************************************/
 static uint64_t i_rotate_size = DEFAULT_ROTATE_SIZE;
+static uint64_t i_bucket_size = 0;
 static int64_t i_tolerance = DEFAULT_TOLERANCE;
 static size_t i_asked_payload_size = DEFAULT_PAYLOAD_SIZE;
 static int64_t i_delay = 0;
@@ -50,9 +51,11 @@ static bool b_status = false;
 
 static void usage(void)
 {
-    msg_Raw( NULL, "Usage: multicat_validate [-l <syslogtag>] [-k <start time>] [-r <file duration>] [-W <tolerance>] [-m <payload size>] <input directory>" );
+    msg_Raw( NULL, "Usage: multicat_validate [-l <syslogtag>] [-k <start time>] [-r <file duration>] [-D <subdirectory duration>] [-J <directory>] [-W <tolerance>] [-m <payload size>] <input directory>" );
     msg_Raw( NULL, "    -k: start at the given position (in 27 MHz units, negative = from the end)" );
     msg_Raw( NULL, "    -r: in directory mode, rotate file after this duration (default: 97200000000 ticks = 1 hour)" );
+    msg_Raw( NULL, "    -D: in directory mode, files are nested in subdirectories of this duration (in 27 MHz units)" );
+    msg_Raw( NULL, "    -J: in directory mode, files are also spread over this directory (may be repeated)" );
     msg_Raw( NULL, "    -W: maximum tolerated wait time before the forthcoming packet (by default: 27000000 ticks = 1 second)" );
     msg_Raw( NULL, "    -m: size of the payload chunk, excluding optional RTP header (default 1316)" );
     exit(EXIT_FAILURE);
@@ -100,13 +103,13 @@ int main( int i_argc, char **pp_argv )
 {
     const char *psz_syslog_tag = NULL;
     off_t i_nb_skipped_chunks;
-    FILE *p_input_aux;
+    aux_file_t *p_input_aux;
     int c;
     uint64_t i_stc;
 
     setvbuf(stdout, NULL, _IOLBF, 0);
 
-    while ( (c = getopt( i_argc, pp_argv, "l:k:r:W:m:h" )) != -1 )
+    while ( (c = getopt( i_argc, pp_argv, "l:k:r:D:J:W:m:h" )) != -1 )
     {
         switch ( c )
         {
@@ -122,6 +125,14 @@ int main( int i_argc, char **pp_argv )
             i_rotate_size = strtoull( optarg, NULL, 0 );
             break;
 
+        case 'D':
+            i_bucket_size = strtoull( optarg, NULL, 0 );
+            break;
+
+        case 'J':
+            AddDirRoot( optarg );
+            break;
+
         case 'W':
             i_tolerance = strtoull( optarg, NULL, 0 );
             break;
@@ -144,6 +155,9 @@ int main( int i_argc, char **pp_argv )
     if ( psz_syslog_tag != NULL )
         msg_Openlog( psz_syslog_tag, LOG_NDELAY, LOG_USER );
 
+    if ( i_bucket_size )
+        SetDirLayout( i_rotate_size, i_bucket_size );
+
     if ( i_delay <= 0 )
     {
         i_delay *= -1;
@@ -174,21 +188,19 @@ int main( int i_argc, char **pp_argv )
     close( OpenDirFile( psz_dir_name, i_dir_file, true, i_asked_payload_size,
                         &p_input_aux ) );
 
-    int ret = fseeko( p_input_aux, 8 * i_nb_skipped_chunks, SEEK_SET );
+    int ret = SeekAuxFile( p_input_aux, i_nb_skipped_chunks );
     if ( ret == -1 )
     {
-        msg_Err( NULL, "fseeko failed" );
+        msg_Err( NULL, "seek failed" );
         exit(1);
     }
 
     for ( ; ; )
     {
-        uint8_t p_aux[8];
-
-        if ( fread( p_aux, 8, 1, p_input_aux ) != 1 )
+        while ( !ReadAuxFile( p_input_aux, &i_stc ) )
         {
             int i_fd;
-            fclose( p_input_aux );
+            CloseAuxFile( p_input_aux );
 
             i_dir_file++;
 
@@ -201,7 +213,6 @@ int main( int i_argc, char **pp_argv )
             }
             close( i_fd );
         }
-        i_stc = FromSTC( p_aux );
 
         HandleSTC( i_stc );
     }
@@ -43,6 +43,11 @@
 #include <net/if.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
 #include <netdb.h>
 #include <syslog.h>
 
@@ -56,6 +61,8 @@
 #define MAX_MSG 1024
 #define PSZ_AUX_EXT "aux"
 #define PSZ_TS_EXT "ts"
+#define PSZ_RAP_EXT "rap"
+#define PSZ_NULL_EXT "nul"
 
 int i_verbose = VERB_DBG;
 static int b_syslog = 0;
@@ -984,10 +991,11 @@ int OpenFile( const char *psz_arg, bool b_read, bool b_append )
 }
 
 /*****************************************************************************
- * GetAuxFile: generate a file name for the TS file
+ * GetSidecarFile: generate the name of a file accompanying the TS file
  * Remember to free the returned string
  *****************************************************************************/
-char *GetAuxFile( const char *psz_arg, size_t i_payload_size )
+static char *GetSidecarFile( const char *psz_arg, const char *psz_ext,
+                             size_t i_payload_size )
 {
     char *psz_aux = malloc( strlen(psz_arg) + 256 );
     char *psz_token;
@@ -1006,7 +1014,8 @@ char *GetAuxFile( const char *psz_arg, size_t i_payload_size )
     if ( psz_token ) *psz_token = '\0';
 
     /* Append extension */
-    strcat( psz_aux, "." PSZ_AUX_EXT );
+    strcat( psz_aux, "." );
+    strcat( psz_aux, psz_ext );
     if ( i_payload_size != DEFAULT_PAYLOAD_SIZE )
         sprintf( psz_aux + strlen(psz_aux), "%zu", i_payload_size );
 
@@ -1014,87 +1023,1335 @@ char *GetAuxFile( const char *psz_arg, size_t i_payload_size )
 }
 
 /*****************************************************************************
- * OpenAuxFile
+ * GetAuxFile: generate a file name for the TS file
+ * Remember to free the returned string
+ *****************************************************************************/
+char *GetAuxFile( const char *psz_arg, size_t i_payload_size )
+{
+    return GetSidecarFile( psz_arg, PSZ_AUX_EXT, i_payload_size );
+}
+
+/*****************************************************************************
+ * Aux files
+ *****************************************************************************
+ * Version 1 aux files are a plain array of 64-bit big-endian STCs, one per
+ * payload chunk. Version 2 aux files store the same STCs in blocks:
+ *  - file header: AUX2_MAGIC
+ *  - blocks: 'B' 'K', number of STCs (16 bits), size of the deltas
+ *    (32 bits), first STC (64 bits), then the differences between
+ *    consecutive STCs as zigzag-encoded varints
+ *  - between blocks, index records: 'I' 'X' 0 0, number of entries
+ *    (32 bits), offset of the previous record (64 bits, 0 if none), then
+ *    for every AUX2_INDEX_CHUNKS chunks the offset, first chunk and first
+ *    STC of a block (3 x 64 bits)
+ *  - at the end, a trailer: offset of the last index record (64 bits),
+ *    number of chunks (64 bits), number of entries in the chain of records
+ *    (32 bits) and 'M' 'C' 'I' 'X'.
+ * All integers are big-endian. While recording, only the last block may
+ * hold less than AUX2_BLOCK_CHUNKS STCs, and it grows in place: new deltas
+ * are written before the header which counts them, so that a reader may
+ * follow a file which is being recorded. New index entries are written in a
+ * record before the block they point to, and the trailer is rewritten after
+ * the last block, so that a file which wasn't properly closed keeps its
+ * index. Record n also repeats the entries of the records after record
+ * n - (n & -n), which it points to, so that the chain from the last one is
+ * only a few records long. Closing a file writes the whole index in a last
+ * record.
+ *****************************************************************************/
+#define AUX2_MAGIC "MCAUX\0\0\2"
+#define AUX2_MAGIC_SIZE 8
+#define AUX2_BLOCK_HEADER_SIZE 16
+#define AUX2_BLOCK_CHUNKS 4096
+#define AUX2_MAX_VARINT_SIZE 10
+#define AUX2_INDEX_CHUNKS 65536
+#define AUX2_INDEX_HEADER_SIZE 16
+#define AUX2_INDEX_ENTRY_SIZE 24
+#define AUX2_TRAILER_SIZE 24
+
+int i_aux_version = 1;
+
+typedef struct aux_index_t
+{
+    off_t i_offset;
+    off_t i_chunk;
+    uint64_t i_stc;
+} aux_index_t;
+
+typedef struct aux_record_t
+{
+    off_t i_offset;
+    unsigned int i_first; /* first entry added by the record */
+} aux_record_t;
+
+struct aux_file_t
+{
+    int i_version;
+    FILE *p_file; /* version 1 */
+
+    /* version 2 */
+    int i_fd;
+    bool b_read;
+    aux_index_t *p_index;
+    unsigned int i_nb_index;
+
+    off_t i_block_offset, i_next_offset;
+    off_t i_block_chunk;
+    unsigned int i_nb_stcs, i_cur_stc;
+    uint64_t pi_stcs[AUX2_BLOCK_CHUNKS];
+
+    /* version 2, writing */
+    uint8_t p_deltas[AUX2_BLOCK_CHUNKS * AUX2_MAX_VARINT_SIZE];
+    uint32_t i_deltas_size, i_deltas_written;
+    unsigned int i_written_stcs; /* counted in the header on disk */
+    aux_record_t *p_records;
+    unsigned int i_nb_records;
+    off_t i_last_record;
+    unsigned int i_nb_written_index; /* entries in the chain of records */
+};
+
+static inline void ToU32( uint8_t *p, uint32_t i )
+{
+    p[0] = i >> 24;
+    p[1] = (i >> 16) & 0xff;
+    p[2] = (i >> 8) & 0xff;
+    p[3] = i & 0xff;
+}
+
+static inline uint32_t FromU32( const uint8_t *p )
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+         | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*****************************************************************************
+ * Aux2ReadHeader: read the header of the block at *pi_offset, skipping the
+ * index records before it, returns false at the end
+ *****************************************************************************/
+static bool Aux2ReadHeader( aux_file_t *p_aux, off_t *pi_offset,
+                            unsigned int *pi_nb_stcs, uint32_t *pi_size,
+                            uint64_t *pi_stc )
+{
+    uint8_t p_header[AUX2_BLOCK_HEADER_SIZE];
+
+    for ( ; ; )
+    {
+        if ( pread( p_aux->i_fd, p_header, AUX2_BLOCK_HEADER_SIZE,
+                    *pi_offset ) != AUX2_BLOCK_HEADER_SIZE )
+            return false;
+        if ( p_header[0] != 'I' || p_header[1] != 'X' )
+            break;
+        *pi_offset += AUX2_INDEX_HEADER_SIZE
+                       + (off_t)FromU32( p_header + 4 ) * AUX2_INDEX_ENTRY_SIZE;
+    }
+    if ( p_header[0] != 'B' || p_header[1] != 'K' )
+        return false;
+
+    *pi_nb_stcs = ((unsigned int)p_header[2] << 8) | p_header[3];
+    *pi_size = FromU32( p_header + 4 );
+    if ( pi_stc != NULL )
+        *pi_stc = FromSTC( p_header + 8 );
+
+    if ( !*pi_nb_stcs || *pi_nb_stcs > AUX2_BLOCK_CHUNKS
+          || *pi_size > AUX2_BLOCK_CHUNKS * AUX2_MAX_VARINT_SIZE )
+    {
+        msg_Warn( NULL, "corrupt aux block at %jd", (intmax_t)*pi_offset );
+        return false;
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * Aux2ReadBlock: read and decode the block at *pi_offset, returns its size
+ * or 0 at the end
+ *****************************************************************************/
+static ssize_t Aux2ReadBlock( aux_file_t *p_aux, off_t *pi_offset )
+{
+    uint8_t p_deltas[AUX2_BLOCK_CHUNKS * AUX2_MAX_VARINT_SIZE];
+    unsigned int i_nb_stcs, i;
+    uint32_t i_size, i_pos = 0;
+    uint64_t i_stc;
+
+    if ( !Aux2ReadHeader( p_aux, pi_offset, &i_nb_stcs, &i_size, &i_stc )
+          || pread( p_aux->i_fd, p_deltas, i_size,
+                    *pi_offset + AUX2_BLOCK_HEADER_SIZE ) != i_size )
+        return 0;
+
+    p_aux->pi_stcs[0] = i_stc;
+    for ( i = 1; i < i_nb_stcs; i++ )
+    {
+        uint64_t i_zigzag = 0;
+        int i_shift = 0;
+
+        do
+        {
+            if ( i_pos >= i_size || i_shift > 63 )
+            {
+                msg_Warn( NULL, "corrupt aux block at %jd",
+                          (intmax_t)*pi_offset );
+                p_aux->i_nb_stcs = p_aux->i_cur_stc = 0;
+                return 0;
+            }
+            i_zigzag |= (uint64_t)(p_deltas[i_pos] & 0x7f) << i_shift;
+            i_shift += 7;
+        }
+        while ( p_deltas[i_pos++] & 0x80 );
+
+        i_stc += (i_zigzag >> 1) ^ -(i_zigzag & 1);
+        p_aux->pi_stcs[i] = i_stc;
+    }
+
+    p_aux->i_nb_stcs = i_nb_stcs;
+    p_aux->i_cur_stc = 0;
+    return AUX2_BLOCK_HEADER_SIZE + i_size;
+}
+
+/*****************************************************************************
+ * Aux2NeedIndex: a block starting at i_chunk starts a new index interval
+ *****************************************************************************/
+static bool Aux2NeedIndex( aux_file_t *p_aux, off_t i_chunk )
+{
+    return !p_aux->i_nb_index
+            || p_aux->p_index[p_aux->i_nb_index - 1].i_chunk
+                + AUX2_INDEX_CHUNKS <= i_chunk;
+}
+
+/*****************************************************************************
+ * Aux2AddIndex: record a block in the index if it starts a new interval
+ *****************************************************************************/
+static void Aux2AddIndex( aux_file_t *p_aux, off_t i_offset, off_t i_chunk,
+                          uint64_t i_stc )
+{
+    if ( !Aux2NeedIndex( p_aux, i_chunk ) )
+        return;
+
+    p_aux->p_index = realloc( p_aux->p_index,
+                              (p_aux->i_nb_index + 1) * sizeof(aux_index_t) );
+    p_aux->p_index[p_aux->i_nb_index].i_offset = i_offset;
+    p_aux->p_index[p_aux->i_nb_index].i_chunk = i_chunk;
+    p_aux->p_index[p_aux->i_nb_index].i_stc = i_stc;
+    p_aux->i_nb_index++;
+}
+
+/*****************************************************************************
+ * Aux2LoadIndex: read the chain of index records from the trailer
+ *****************************************************************************/
+static void Aux2LoadIndex( aux_file_t *p_aux )
+{
+    uint8_t p_trailer[AUX2_TRAILER_SIZE];
+    uint8_t p_header[AUX2_INDEX_HEADER_SIZE];
+    struct stat sb;
+    off_t i_record;
+    unsigned int i_nb_index, i_left;
+
+    if ( fstat( p_aux->i_fd, &sb ) < 0
+          || sb.st_size < AUX2_MAGIC_SIZE + AUX2_TRAILER_SIZE
+          || pread( p_aux->i_fd, p_trailer, AUX2_TRAILER_SIZE,
+                    sb.st_size - AUX2_TRAILER_SIZE ) != AUX2_TRAILER_SIZE
+          || memcmp( p_trailer + 20, "MCIX", 4 ) )
+        return;
+
+    i_record = FromSTC( p_trailer );
+    i_nb_index = i_left = FromU32( p_trailer + 16 );
+    if ( !i_nb_index )
+        return;
+
+    /* Fill the index backwards, from the last record */
+    p_aux->p_index = malloc( i_nb_index * sizeof(aux_index_t) );
+    while ( i_left )
+    {
+        unsigned int i_nb, i;
+        uint8_t *p_entries;
+        off_t i_prev;
+
+        if ( i_record < AUX2_MAGIC_SIZE
+              || pread( p_aux->i_fd, p_header, AUX2_INDEX_HEADER_SIZE,
+                        i_record ) != AUX2_INDEX_HEADER_SIZE
+              || p_header[0] != 'I' || p_header[1] != 'X'
+              || !(i_nb = FromU32( p_header + 4 )) || i_nb > i_left )
+            break;
+        i_prev = FromSTC( p_header + 8 );
+
+        p_entries = malloc( i_nb * AUX2_INDEX_ENTRY_SIZE );
+        if ( pread( p_aux->i_fd, p_entries, i_nb * AUX2_INDEX_ENTRY_SIZE,
+                    i_record + AUX2_INDEX_HEADER_SIZE )
+               != i_nb * AUX2_INDEX_ENTRY_SIZE )
+        {
+            free( p_entries );
+            break;
+        }
+
+        i_left -= i_nb;
+        for ( i = 0; i < i_nb; i++ )
+        {
+            uint8_t *p_entry = p_entries + i * AUX2_INDEX_ENTRY_SIZE;
+            p_aux->p_index[i_left + i].i_offset = FromSTC( p_entry );
+            p_aux->p_index[i_left + i].i_chunk = FromSTC( p_entry + 8 );
+            p_aux->p_index[i_left + i].i_stc = FromSTC( p_entry + 16 );
+        }
+        free( p_entries );
+
+        if ( i_prev >= i_record )
+            break;
+        i_record = i_prev;
+    }
+
+    if ( i_left )
+    {
+        msg_Warn( NULL, "invalid aux index, ignoring" );
+        free( p_aux->p_index );
+        p_aux->p_index = NULL;
+        return;
+    }
+    p_aux->i_nb_index = i_nb_index;
+}
+
+/*****************************************************************************
+ * Aux2Walk: find the block containing i_chunk (the last one if it is at
+ * the end of a block) by walking block headers from the closest index
+ * entry; stops at the end of the blocks
+ *****************************************************************************/
+static void Aux2Walk( aux_file_t *p_aux, off_t i_chunk, bool b_build_index,
+                      off_t *pi_offset, off_t *pi_chunk )
+{
+    off_t i_offset = AUX2_MAGIC_SIZE, i_cur_chunk = 0;
+    unsigned int i_nb_stcs, i;
+    uint32_t i_size;
+    uint64_t i_stc;
+
+    for ( i = 0; i < p_aux->i_nb_index
+                  && p_aux->p_index[i].i_chunk <= i_chunk; i++ )
+    {
+        i_offset = p_aux->p_index[i].i_offset;
+        i_cur_chunk = p_aux->p_index[i].i_chunk;
+    }
+
+    while ( Aux2ReadHeader( p_aux, &i_offset, &i_nb_stcs, &i_size, &i_stc )
+             && i_cur_chunk + i_nb_stcs < i_chunk )
+    {
+        if ( b_build_index )
+            Aux2AddIndex( p_aux, i_offset, i_cur_chunk, i_stc );
+        i_offset += AUX2_BLOCK_HEADER_SIZE + i_size;
+        i_cur_chunk += i_nb_stcs;
+    }
+
+    *pi_offset = i_offset;
+    *pi_chunk = i_cur_chunk;
+}
+
+/*****************************************************************************
+ * Aux2Encode: write a zigzag-encoded varint, returns its size
  *****************************************************************************/
-FILE *OpenAuxFile( const char *psz_arg, bool b_read, bool b_append )
+static uint32_t Aux2Encode( uint8_t *p, int64_t i_delta )
 {
-    FILE *p_aux;
+    uint64_t i_zigzag = ((uint64_t)i_delta << 1) ^ (i_delta >> 63);
+    uint32_t i_size = 0;
 
-    if ( (p_aux = fopen( psz_arg,
-                         b_read ? "rb" : (b_append ? "ab" : "wb") )) == NULL )
+    while ( i_zigzag >= 0x80 )
+    {
+        p[i_size++] = (i_zigzag & 0x7f) | 0x80;
+        i_zigzag >>= 7;
+    }
+    p[i_size++] = i_zigzag;
+    return i_size;
+}
+
+/*****************************************************************************
+ * Aux2EncodeBlock: encode the STCs of the open block, to rewrite it
+ *****************************************************************************/
+static void Aux2EncodeBlock( aux_file_t *p_aux )
+{
+    unsigned int i;
+
+    p_aux->i_deltas_size = 0;
+    for ( i = 1; i < p_aux->i_nb_stcs; i++ )
+        p_aux->i_deltas_size += Aux2Encode(
+                p_aux->p_deltas + p_aux->i_deltas_size,
+                p_aux->pi_stcs[i] - p_aux->pi_stcs[i - 1] );
+    p_aux->i_deltas_written = 0;
+    p_aux->i_written_stcs = 0;
+}
+
+/*****************************************************************************
+ * Aux2WriteRecord: write the index entries from i_first in a record
+ *****************************************************************************/
+static bool Aux2WriteRecord( aux_file_t *p_aux, off_t i_offset,
+                             unsigned int i_first, off_t i_prev )
+{
+    unsigned int i_nb = p_aux->i_nb_index - i_first, i;
+    size_t i_size = AUX2_INDEX_HEADER_SIZE + i_nb * AUX2_INDEX_ENTRY_SIZE;
+    uint8_t *p_record = malloc( i_size ), *p = p_record;
+    bool b_ret;
+
+    p[0] = 'I';
+    p[1] = 'X';
+    p[2] = p[3] = 0;
+    ToU32( p + 4, i_nb );
+    ToSTC( p + 8, i_prev );
+    p += AUX2_INDEX_HEADER_SIZE;
+
+    for ( i = i_first; i < p_aux->i_nb_index; i++ )
+    {
+        ToSTC( p, p_aux->p_index[i].i_offset );
+        ToSTC( p + 8, p_aux->p_index[i].i_chunk );
+        ToSTC( p + 16, p_aux->p_index[i].i_stc );
+        p += AUX2_INDEX_ENTRY_SIZE;
+    }
+
+    b_ret = pwrite( p_aux->i_fd, p_record, i_size, i_offset ) == i_size;
+    free( p_record );
+    if ( b_ret )
+    {
+        p_aux->i_last_record = i_offset;
+        p_aux->i_nb_written_index = p_aux->i_nb_index;
+    }
+    return b_ret;
+}
+
+/*****************************************************************************
+ * Aux2WriteTrailer: write the trailer at the given offset
+ *****************************************************************************/
+static bool Aux2WriteTrailer( aux_file_t *p_aux, off_t i_offset )
+{
+    uint8_t p_trailer[AUX2_TRAILER_SIZE];
+
+    ToSTC( p_trailer, p_aux->i_last_record );
+    ToSTC( p_trailer + 8, p_aux->i_block_chunk + p_aux->i_nb_stcs );
+    ToU32( p_trailer + 16, p_aux->i_nb_written_index );
+    memcpy( p_trailer + 20, "MCIX", 4 );
+    return pwrite( p_aux->i_fd, p_trailer, AUX2_TRAILER_SIZE, i_offset )
+             == AUX2_TRAILER_SIZE;
+}
+
+/*****************************************************************************
+ * Aux2WriteBlock: write the STCs of the open block which aren't on disk
+ * yet, followed by the trailer
+ *****************************************************************************/
+static bool Aux2WriteBlock( aux_file_t *p_aux )
+{
+    uint8_t p_header[AUX2_BLOCK_HEADER_SIZE];
+
+    if ( p_aux->i_written_stcs == p_aux->i_nb_stcs )
+        return true;
+
+    /* A new block: the index entries which aren't in a record go before it,
+     * with its own if it starts a new interval */
+    if ( !p_aux->i_written_stcs )
+    {
+        unsigned int i_first = p_aux->i_nb_written_index;
+        unsigned int i_nb = p_aux->i_nb_index - i_first
+                             + Aux2NeedIndex( p_aux, p_aux->i_block_chunk );
+
+        if ( i_nb )
+        {
+            unsigned int i_record = p_aux->i_nb_records + 1;
+            unsigned int i_prev = i_record - (i_record & -i_record);
+            off_t i_offset = p_aux->i_block_offset;
+
+            /* Also repeat the entries of the records after i_prev */
+            if ( i_prev + 1 < i_record )
+            {
+                i_nb += i_first - p_aux->p_records[i_prev].i_first;
+                i_first = p_aux->p_records[i_prev].i_first;
+            }
+
+            p_aux->i_block_offset += AUX2_INDEX_HEADER_SIZE
+                                      + i_nb * AUX2_INDEX_ENTRY_SIZE;
+            Aux2AddIndex( p_aux, p_aux->i_block_offset, p_aux->i_block_chunk,
+                          p_aux->pi_stcs[0] );
+            p_aux->p_records = realloc( p_aux->p_records,
+                                        i_record * sizeof(aux_record_t) );
+            p_aux->p_records[i_record - 1].i_offset = i_offset;
+            p_aux->p_records[i_record - 1].i_first =
+                p_aux->i_nb_written_index;
+            p_aux->i_nb_records = i_record;
+            if ( !Aux2WriteRecord( p_aux, i_offset, i_first,
+                      i_prev ? p_aux->p_records[i_prev - 1].i_offset : 0 ) )
+                return false;
+        }
+    }
+
+    if ( pwrite( p_aux->i_fd, p_aux->p_deltas + p_aux->i_deltas_written,
+                 p_aux->i_deltas_size - p_aux->i_deltas_written,
+                 p_aux->i_block_offset + AUX2_BLOCK_HEADER_SIZE
+                  + p_aux->i_deltas_written )
+           != p_aux->i_deltas_size - p_aux->i_deltas_written )
+        return false;
+
+    p_header[0] = 'B';
+    p_header[1] = 'K';
+    p_header[2] = p_aux->i_nb_stcs >> 8;
+    p_header[3] = p_aux->i_nb_stcs & 0xff;
+    ToU32( p_header + 4, p_aux->i_deltas_size );
+    ToSTC( p_header + 8, p_aux->pi_stcs[0] );
+    if ( pwrite( p_aux->i_fd, p_header, AUX2_BLOCK_HEADER_SIZE,
+                 p_aux->i_block_offset ) != AUX2_BLOCK_HEADER_SIZE )
+        return false;
+
+    p_aux->i_deltas_written = p_aux->i_deltas_size;
+    p_aux->i_written_stcs = p_aux->i_nb_stcs;
+    return Aux2WriteTrailer( p_aux, p_aux->i_block_offset
+                                     + AUX2_BLOCK_HEADER_SIZE
+                                     + p_aux->i_deltas_size );
+}
+
+/*****************************************************************************
+ * Aux2CloseBlock: start a new block after the open one
+ *****************************************************************************/
+static void Aux2CloseBlock( aux_file_t *p_aux )
+{
+    p_aux->i_block_offset += AUX2_BLOCK_HEADER_SIZE + p_aux->i_deltas_size;
+    p_aux->i_block_chunk += p_aux->i_nb_stcs;
+    p_aux->i_nb_stcs = 0;
+    p_aux->i_deltas_size = p_aux->i_deltas_written = 0;
+    p_aux->i_written_stcs = 0;
+}
+
+/*****************************************************************************
+ * Aux2WriteIndex: append the whole index and the trailer to a closing file
+ *****************************************************************************/
+static void Aux2WriteIndex( aux_file_t *p_aux )
+{
+    off_t i_record = p_aux->i_block_offset;
+
+    if ( p_aux->i_nb_stcs )
+        i_record += AUX2_BLOCK_HEADER_SIZE + p_aux->i_deltas_size;
+
+    if ( !Aux2WriteRecord( p_aux, i_record, 0, 0 )
+          || !Aux2WriteTrailer( p_aux, i_record + AUX2_INDEX_HEADER_SIZE
+                                 + p_aux->i_nb_index * AUX2_INDEX_ENTRY_SIZE ) )
+        msg_Warn( NULL, "couldn't write aux index (%s)", strerror(errno) );
+}
+
+/*****************************************************************************
+ * GetAuxVersion: return the version of an existing aux file, or 0
+ *****************************************************************************/
+static int GetAuxVersion( const char *psz_arg )
+{
+    uint8_t p_magic[AUX2_MAGIC_SIZE];
+    int i_fd = open( psz_arg, O_RDONLY );
+    ssize_t i_ret;
+
+    if ( i_fd < 0 )
+        return 0;
+    i_ret = read( i_fd, p_magic, AUX2_MAGIC_SIZE );
+    close( i_fd );
+
+    if ( i_ret == AUX2_MAGIC_SIZE
+          && !memcmp( p_magic, AUX2_MAGIC, AUX2_MAGIC_SIZE ) )
+        return 2;
+    return i_ret > 0 ? 1 : 0;
+}
+
+/*****************************************************************************
+ * Aux2ReopenBlock: make the block which contains i_chunk the open block, with
+ * the STCs before i_chunk, and drop what follows
+ *****************************************************************************/
+static void Aux2ReopenBlock( aux_file_t *p_aux, off_t i_chunk )
+{
+    off_t i_offset, i_block_chunk;
+    ssize_t i_size;
+
+    Aux2Walk( p_aux, i_chunk, false, &i_offset, &i_block_chunk );
+    p_aux->i_nb_stcs = 0;
+    if ( i_block_chunk < i_chunk
+          && (i_size = Aux2ReadBlock( p_aux, &i_offset )) > 0 )
+    {
+        p_aux->i_nb_stcs = i_chunk - i_block_chunk;
+        if ( p_aux->i_nb_stcs == AUX2_BLOCK_CHUNKS )
+        {
+            /* Full block, start a new one after it */
+            i_offset += i_size;
+            i_block_chunk = i_chunk;
+            p_aux->i_nb_stcs = 0;
+        }
+    }
+
+    while ( p_aux->i_nb_index
+             && p_aux->p_index[p_aux->i_nb_index - 1].i_offset >= i_offset )
+        p_aux->i_nb_index--;
+    p_aux->i_block_offset = i_offset;
+    p_aux->i_block_chunk = i_block_chunk;
+    p_aux->i_nb_records = 0;
+    p_aux->i_last_record = 0;
+    p_aux->i_nb_written_index = 0;
+    Aux2EncodeBlock( p_aux );
+    if ( ftruncate( p_aux->i_fd, i_offset ) < 0 )
+        msg_Err( NULL, "truncate failed (%s)", strerror(errno) );
+}
+
+/*****************************************************************************
+ * OpenAuxFile: the format of new files is given by i_aux_version
+ *****************************************************************************/
+aux_file_t *OpenAuxFile( const char *psz_arg, bool b_read, bool b_append )
+{
+    aux_file_t *p_aux;
+    int i_version = GetAuxVersion( psz_arg );
+    off_t i_offset, i_nb_chunks;
+
+    if ( !i_version || (!b_read && !b_append) )
+        i_version = b_read ? 1 : i_aux_version;
+
+    p_aux = malloc( sizeof(aux_file_t) );
+    p_aux->i_version = i_version;
+    p_aux->p_file = NULL;
+    p_aux->i_fd = -1;
+
+    if ( i_version == 1 )
+    {
+        if ( (p_aux->p_file = fopen( psz_arg,
+                    b_read ? "rb" : (b_append ? "ab" : "wb") )) == NULL )
+        {
+            msg_Err( NULL, "couldn't open file %s (%s)", psz_arg,
+                     strerror(errno) );
+            exit(EXIT_FAILURE);
+        }
+        return p_aux;
+    }
+
+    p_aux->i_fd = open( psz_arg, b_read ? O_RDONLY :
+                        (O_RDWR | O_CREAT | (b_append ? 0 : O_TRUNC)), 0644 );
+    if ( p_aux->i_fd < 0 )
     {
         msg_Err( NULL, "couldn't open file %s (%s)", psz_arg,
                  strerror(errno) );
         exit(EXIT_FAILURE);
     }
+    p_aux->b_read = b_read;
+    p_aux->p_index = NULL;
+    p_aux->i_nb_index = 0;
+    p_aux->i_nb_stcs = p_aux->i_cur_stc = 0;
+    p_aux->i_block_offset = p_aux->i_next_offset = AUX2_MAGIC_SIZE;
+    p_aux->i_block_chunk = 0;
+    p_aux->i_deltas_size = p_aux->i_deltas_written = 0;
+    p_aux->i_written_stcs = 0;
+    p_aux->p_records = NULL;
+    p_aux->i_nb_records = 0;
+    p_aux->i_last_record = 0;
+    p_aux->i_nb_written_index = 0;
+
+    if ( b_read )
+    {
+        Aux2LoadIndex( p_aux );
+        return p_aux;
+    }
+
+    if ( GetAuxVersion( psz_arg ) != 2 )
+    {
+        if ( pwrite( p_aux->i_fd, AUX2_MAGIC, AUX2_MAGIC_SIZE, 0 )
+               != AUX2_MAGIC_SIZE )
+        {
+            msg_Err( NULL, "couldn't write to file %s (%s)", psz_arg,
+                     strerror(errno) );
+            exit(EXIT_FAILURE);
+        }
+        return p_aux;
+    }
 
+    /* Append: go on with the last block if it isn't full */
+    Aux2LoadIndex( p_aux );
+    Aux2Walk( p_aux, INT64_MAX, !p_aux->i_nb_index, &i_offset, &i_nb_chunks );
+    Aux2ReopenBlock( p_aux, i_nb_chunks );
     return p_aux;
 }
 
+/*****************************************************************************
+ * ReadAuxFile: read the STC of the next chunk
+ *****************************************************************************/
+bool ReadAuxFile( aux_file_t *p_aux, uint64_t *pi_stc )
+{
+    if ( p_aux->i_version == 1 )
+    {
+        uint8_t p_stc[8];
+        if ( fread( p_stc, 8, 1, p_aux->p_file ) != 1 )
+            return false;
+        *pi_stc = FromSTC( p_stc );
+        return true;
+    }
+
+    if ( p_aux->i_cur_stc >= p_aux->i_nb_stcs )
+    {
+        off_t i_offset = p_aux->i_next_offset;
+        off_t i_chunk = p_aux->i_block_chunk + p_aux->i_nb_stcs;
+        unsigned int i_cur_stc = 0;
+        ssize_t i_size;
+
+        /* Only the last block isn't full, and it may have grown since */
+        if ( p_aux->i_nb_stcs && p_aux->i_nb_stcs < AUX2_BLOCK_CHUNKS )
+        {
+            i_offset = p_aux->i_block_offset;
+            i_chunk = p_aux->i_block_chunk;
+            i_cur_stc = p_aux->i_cur_stc;
+        }
+
+        i_size = Aux2ReadBlock( p_aux, &i_offset );
+        if ( i_size <= 0 )
+            return false;
+        p_aux->i_block_offset = i_offset;
+        p_aux->i_next_offset = i_offset + i_size;
+        p_aux->i_block_chunk = i_chunk;
+        p_aux->i_cur_stc = i_cur_stc;
+        if ( i_cur_stc >= p_aux->i_nb_stcs )
+            return false;
+    }
+
+    *pi_stc = p_aux->pi_stcs[p_aux->i_cur_stc++];
+    return true;
+}
 
 /*****************************************************************************
- * LookupAuxFile: find an STC in an auxiliary file
+ * SeekAuxFile: position the file before the given chunk
  *****************************************************************************/
-off_t LookupAuxFile( const char *psz_arg, int64_t i_wanted, bool b_absolute )
+int SeekAuxFile( aux_file_t *p_aux, off_t i_chunk )
+{
+    off_t i_offset, i_block_chunk;
+    ssize_t i_size;
+
+    if ( p_aux->i_version == 1 )
+        return fseeko( p_aux->p_file, 8 * i_chunk, SEEK_SET );
+
+    Aux2Walk( p_aux, i_chunk, false, &i_offset, &i_block_chunk );
+    p_aux->i_nb_stcs = p_aux->i_cur_stc = 0;
+    p_aux->i_block_offset = p_aux->i_next_offset = i_offset;
+    p_aux->i_block_chunk = i_block_chunk;
+    if ( i_block_chunk == i_chunk )
+        return 0;
+
+    if ( (i_size = Aux2ReadBlock( p_aux, &i_offset )) <= 0 )
+        return -1;
+    p_aux->i_block_offset = i_offset;
+    p_aux->i_next_offset = i_offset + i_size;
+    p_aux->i_cur_stc = i_chunk - i_block_chunk;
+    return 0;
+}
+
+/*****************************************************************************
+ * CountAuxFile: return the number of chunks of an aux file
+ *****************************************************************************/
+off_t CountAuxFile( aux_file_t *p_aux )
+{
+    off_t i_offset, i_nb_chunks;
+    struct stat sb;
+
+    if ( p_aux->i_version == 1 )
+    {
+        if ( fstat( fileno( p_aux->p_file ), &sb ) < 0 )
+            return 0;
+        return sb.st_size / sizeof(uint64_t);
+    }
+
+    if ( !p_aux->b_read )
+        return p_aux->i_block_chunk + p_aux->i_nb_stcs;
+    Aux2Walk( p_aux, INT64_MAX, false, &i_offset, &i_nb_chunks );
+    return i_nb_chunks;
+}
+
+/*****************************************************************************
+ * WriteAuxFile: append the STC of a chunk
+ *****************************************************************************/
+bool WriteAuxFile( aux_file_t *p_aux, uint64_t i_stc )
+{
+    if ( p_aux->i_version == 1 )
+    {
+        uint8_t p_stc[8];
+        ToSTC( p_stc, i_stc );
+        return fwrite( p_stc, 8, 1, p_aux->p_file ) == 1;
+    }
+
+    if ( p_aux->i_nb_stcs )
+        p_aux->i_deltas_size += Aux2Encode(
+                p_aux->p_deltas + p_aux->i_deltas_size,
+                i_stc - p_aux->pi_stcs[p_aux->i_nb_stcs - 1] );
+    p_aux->pi_stcs[p_aux->i_nb_stcs++] = i_stc;
+    if ( p_aux->i_nb_stcs == AUX2_BLOCK_CHUNKS )
+    {
+        if ( !Aux2WriteBlock( p_aux ) )
+            return false;
+        Aux2CloseBlock( p_aux );
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * FlushAuxFile: make the written STCs visible to readers
+ *****************************************************************************/
+void FlushAuxFile( aux_file_t *p_aux )
+{
+    if ( p_aux->i_version == 1 )
+        fflush( p_aux->p_file );
+    else if ( !Aux2WriteBlock( p_aux ) )
+        msg_Err( NULL, "couldn't write to auxiliary file (%s)",
+                 strerror(errno) );
+}
+
+/*****************************************************************************
+ * CloseAuxFile
+ *****************************************************************************/
+void CloseAuxFile( aux_file_t *p_aux )
+{
+    if ( p_aux == NULL )
+        return;
+    if ( p_aux->i_version == 1 )
+        fclose( p_aux->p_file );
+    else
+    {
+        if ( !p_aux->b_read )
+        {
+            FlushAuxFile( p_aux );
+            Aux2WriteIndex( p_aux );
+        }
+        close( p_aux->i_fd );
+        free( p_aux->p_index );
+        free( p_aux->p_records );
+    }
+    free( p_aux );
+}
+
+/*****************************************************************************
+ * TruncateAuxFile: only keep the first i_nb_chunks chunks
+ *****************************************************************************/
+static void TruncateAuxFile( const char *psz_arg, off_t i_nb_chunks )
+{
+    aux_file_t *p_aux;
+
+    if ( GetAuxVersion( psz_arg ) != 2 )
+    {
+        if ( truncate( psz_arg, i_nb_chunks * sizeof(uint64_t) ) < 0 )
+            msg_Err( NULL, "truncate failed (%s)", strerror(errno) );
+        return;
+    }
+
+    /* Opening for append drops the index, and the last block, which is
+     * only kept in memory until the file is closed */
+    p_aux = OpenAuxFile( psz_arg, false, true );
+    if ( i_nb_chunks < p_aux->i_block_chunk )
+        Aux2ReopenBlock( p_aux, i_nb_chunks );
+    else if ( i_nb_chunks < p_aux->i_block_chunk + p_aux->i_nb_stcs )
+    {
+        p_aux->i_nb_stcs = i_nb_chunks - p_aux->i_block_chunk;
+        Aux2EncodeBlock( p_aux );
+    }
+    CloseAuxFile( p_aux );
+}
+
+/*****************************************************************************
+ * GetSTC: STC of a chunk in a mapped aux file (i_payload_size == 0) or
+ * container
+ *****************************************************************************/
+static inline uint64_t GetSTC( const uint8_t *p_aux, off_t i_chunk,
+                               size_t i_payload_size )
+{
+    if ( !i_payload_size )
+        return FromSTC( p_aux + i_chunk * sizeof(uint64_t) );
+    return FromSTC( p_aux + ct_get_stc_offset( i_chunk, i_payload_size ) );
+}
+
+/*****************************************************************************
+ * SearchAux: return the first chunk in ]i_low, i_high] whose STC is greater
+ * than or equal to i_wanted, assuming chunk i_low is before it.
+ *****************************************************************************
+ * STCs are almost linear in the chunk number, so interpolating between the
+ * bounds finds the chunk in a couple of probes, that is a couple of pages
+ * read from disk. A bisection step is forced whenever the interpolation
+ * doesn't at least halve the window, to keep a logarithmic worst case.
+ *****************************************************************************/
+#define AUX_LINEAR_WINDOW 8
+
+static off_t SearchAux( const uint8_t *p_aux, size_t i_payload_size,
+                        off_t i_low, off_t i_high, off_t i_nb_chunks,
+                        uint64_t i_wanted )
+{
+    bool b_bisect = false;
+
+    while ( i_high - i_low > 1 )
+    {
+        off_t i_mid;
+
+        if ( i_high - i_low <= AUX_LINEAR_WINDOW )
+        {
+            for ( i_mid = i_low + 1; i_mid < i_high; i_mid++ )
+                if ( GetSTC( p_aux, i_mid, i_payload_size ) >= i_wanted )
+                    break;
+            return i_mid;
+        }
+
+        if ( b_bisect )
+            i_mid = (i_low + i_high) / 2;
+        else
+        {
+            off_t i_last = i_high < i_nb_chunks ? i_high : i_nb_chunks - 1;
+            uint64_t i_low_stc = GetSTC( p_aux, i_low, i_payload_size );
+            uint64_t i_last_stc = GetSTC( p_aux, i_last, i_payload_size );
+
+            if ( i_wanted <= i_low_stc || i_last_stc <= i_low_stc )
+                i_mid = i_low + 1;
+            else if ( i_wanted >= i_last_stc )
+                i_mid = i_last;
+            else
+                i_mid = i_low + (off_t)((double)(i_wanted - i_low_stc)
+                                         * (i_last - i_low)
+                                         / (i_last_stc - i_low_stc));
+
+            if ( i_mid <= i_low )
+                i_mid = i_low + 1;
+            if ( i_mid >= i_high )
+                i_mid = i_high - 1;
+        }
+
+        off_t i_window = i_high - i_low;
+        if ( GetSTC( p_aux, i_mid, i_payload_size ) >= i_wanted )
+            i_high = i_mid;
+        else
+            i_low = i_mid;
+        b_bisect = !b_bisect && (i_high - i_low) * 2 > i_window;
+    }
+
+    return i_high;
+}
+
+/*****************************************************************************
+ * Aux2Lookup: find an STC in a version 2 auxiliary file, with the same
+ * semantics as LookupAuxFile
+ *****************************************************************************/
+static off_t Aux2Lookup( const char *psz_arg, int64_t i_wanted,
+                         bool b_absolute )
+{
+    aux_file_t *p_aux = OpenAuxFile( psz_arg, true, false );
+    off_t i_nb_chunks = CountAuxFile( p_aux );
+    off_t i_offset = AUX2_MAGIC_SIZE, i_chunk = 0, i_ret;
+    off_t i_prev_offset = -1, i_prev_chunk = 0;
+    unsigned int i_nb_stcs, i;
+    uint32_t i_size;
+    uint64_t i_stc;
+
+    if ( !i_nb_chunks )
+    {
+        msg_Err( NULL, "empty aux file %s", psz_arg );
+        CloseAuxFile( p_aux );
+        return -1;
+    }
+
+    if ( i_wanted < 0 )
+    {
+        SeekAuxFile( p_aux, i_nb_chunks - 1 );
+        if ( ReadAuxFile( p_aux, &i_stc ) )
+            i_wanted += i_stc;
+    }
+    else if ( !b_absolute )
+    {
+        SeekAuxFile( p_aux, 0 );
+        if ( ReadAuxFile( p_aux, &i_stc ) )
+            i_wanted += i_stc;
+    }
+
+    if ( i_wanted < 0 )
+    {
+        msg_Err( NULL, "invalid offset" );
+        CloseAuxFile( p_aux );
+        return -1;
+    }
+
+    /* Start from the last indexed block which begins before the STC */
+    for ( i = 0; i < p_aux->i_nb_index
+                  && p_aux->p_index[i].i_stc < i_wanted; i++ )
+    {
+        i_offset = p_aux->p_index[i].i_offset;
+        i_chunk = p_aux->p_index[i].i_chunk;
+    }
+
+    /* Walk to the first block which begins after the STC */
+    while ( Aux2ReadHeader( p_aux, &i_offset, &i_nb_stcs, &i_size, &i_stc )
+             && (i_stc < i_wanted || !i_chunk) )
+    {
+        i_prev_offset = i_offset;
+        i_prev_chunk = i_chunk;
+        i_offset += AUX2_BLOCK_HEADER_SIZE + i_size;
+        i_chunk += i_nb_stcs;
+    }
+
+    /* The STC is in the previous block, or at the start of this one */
+    i_ret = i_chunk;
+    if ( i_prev_offset != -1 && Aux2ReadBlock( p_aux, &i_prev_offset ) > 0 )
+    {
+        for ( i = i_prev_chunk ? 0 : 1; i < p_aux->i_nb_stcs; i++ )
+            if ( p_aux->pi_stcs[i] >= i_wanted )
+            {
+                i_ret = i_prev_chunk + i;
+                break;
+            }
+    }
+    if ( !i_ret )
+        i_ret = 1;
+
+    CloseAuxFile( p_aux );
+    return i_ret;
+}
+
+/*****************************************************************************
+ * LookupSTC: find an STC in a mapped aux file (i_payload_size == 0) or
+ * container
+ *****************************************************************************/
+static off_t LookupSTC( const char *psz_arg, int64_t i_wanted,
+                        bool b_absolute, size_t i_payload_size )
 {
     uint8_t *p_aux;
-    off_t i_offset1 = 0, i_offset2;
+    off_t i_offset2, i_nb_chunks;
     int i_stc_fd;
     struct stat stc_stat;
 
-    if ( (i_stc_fd = open( psz_arg, O_RDONLY )) == -1 )
-    {
-        msg_Err( NULL, "unable to open %s (%s)", psz_arg, strerror(errno) );
+    if ( (i_stc_fd = open( psz_arg, O_RDONLY )) == -1 )
+    {
+        msg_Err( NULL, "unable to open %s (%s)", psz_arg, strerror(errno) );
+        return -1;
+    }
+
+    if ( fstat( i_stc_fd, &stc_stat ) == -1
+          || stc_stat.st_size < (i_payload_size ? ct_get_offset( 1,
+                                    i_payload_size ) : sizeof(uint64_t)) )
+    {
+        msg_Err( NULL, "unable to stat %s (%s)", psz_arg, strerror(errno) );
+        close( i_stc_fd );
+        return -1;
+    }
+
+    p_aux = mmap( NULL, stc_stat.st_size, PROT_READ, MAP_SHARED,
+                  i_stc_fd, 0 );
+    if ( p_aux == MAP_FAILED )
+    {
+        msg_Err( NULL, "unable to mmap %s (%s)", psz_arg, strerror(errno) );
+        close( i_stc_fd );
+        return -1;
+    }
+    /* We only touch a handful of pages, don't let the kernel read ahead */
+    madvise( p_aux, stc_stat.st_size, MADV_RANDOM );
+
+    if ( i_payload_size )
+        i_nb_chunks = ct_get_chunks( stc_stat.st_size, i_payload_size );
+    else
+        i_nb_chunks = stc_stat.st_size / sizeof(uint64_t);
+    i_offset2 = i_nb_chunks;
+
+    if ( i_wanted < 0 )
+        i_wanted += GetSTC( p_aux, i_offset2 - 1, i_payload_size );
+    else if ( !b_absolute )
+        i_wanted += GetSTC( p_aux, 0, i_payload_size );
+
+    if ( i_wanted < 0 )
+    {
+        msg_Err( NULL, "invalid offset" );
+        munmap( p_aux, stc_stat.st_size );
+        close( i_stc_fd );
+        return -1;
+    }
+
+    i_offset2 = SearchAux( p_aux, i_payload_size, 0, i_offset2,
+                           i_nb_chunks, i_wanted );
+
+    munmap( p_aux, stc_stat.st_size );
+    close( i_stc_fd );
+
+    return i_offset2;
+}
+
+/*****************************************************************************
+ * LookupAuxFile: find an STC in an auxiliary file
+ *****************************************************************************/
+off_t LookupAuxFile( const char *psz_arg, int64_t i_wanted, bool b_absolute )
+{
+    if ( GetAuxVersion( psz_arg ) == 2 )
+        return Aux2Lookup( psz_arg, i_wanted, b_absolute );
+    return LookupSTC( psz_arg, i_wanted, b_absolute, 0 );
+}
+
+/*****************************************************************************
+ * GetContainerPayloadSize: return the payload size of a self-timed
+ * container, or 0 if the file isn't one
+ *****************************************************************************/
+size_t GetContainerPayloadSize( const char *psz_arg )
+{
+    uint8_t p_header[CT_HEADER_SIZE];
+    int i_fd = open( psz_arg, O_RDONLY );
+    size_t i_ret = 0;
+
+    if ( i_fd < 0 )
+        return 0;
+    if ( read( i_fd, p_header, CT_HEADER_SIZE ) == CT_HEADER_SIZE
+          && ct_check_header( p_header ) )
+        i_ret = ct_get_payload_size( p_header );
+    close( i_fd );
+    return i_ret;
+}
+
+/*****************************************************************************
+ * CheckContainerFile: check that an existing file is a container with this
+ * payload size, truncate an incomplete record, and return the number of
+ * chunks, or -1 if the file can't be appended to
+ *****************************************************************************/
+off_t CheckContainerFile( const char *psz_file, size_t i_payload_size )
+{
+    struct stat st;
+    off_t i_nb_chunks, i_size;
+    size_t i_container_len;
+
+    if ( stat( psz_file, &st ) < 0 || !st.st_size )
+        return 0;
+
+    i_container_len = GetContainerPayloadSize( psz_file );
+    if ( !i_container_len )
+    {
+        msg_Err( NULL, "%s isn't a self-timed container", psz_file );
+        return -1;
+    }
+    if ( i_container_len != i_payload_size )
+    {
+        msg_Err( NULL, "container has a payload size of %zu",
+                 i_container_len );
+        return -1;
+    }
+
+    i_nb_chunks = ct_get_chunks( st.st_size, i_payload_size );
+    i_size = ct_get_offset( i_nb_chunks, i_payload_size );
+    if ( i_size != st.st_size )
+    {
+        msg_Warn( NULL, "incomplete container record, truncating" );
+        if ( truncate( psz_file, i_size ) < 0 )
+            msg_Err( NULL, "truncate failed (%s)", strerror(errno) );
+    }
+    return i_nb_chunks;
+}
+
+/*****************************************************************************
+ * ReadContainer: read the next chunk and its STC from a container, returns
+ * 0 at the end of the file and -1 on error
+ *****************************************************************************/
+ssize_t ReadContainer( int i_fd, off_t i_chunk, uint64_t *pi_stc,
+                       void *p_buf, size_t i_len )
+{
+    uint8_t p_header[CT_HEADER_SIZE], p_stc[sizeof(uint64_t)];
+    struct iovec p_iov[3];
+    int i_iov = 0;
+    ssize_t i_ret, i_size = sizeof(uint64_t) + i_len;
+
+    if ( !(i_chunk % CT_BLOCK_CHUNKS) )
+    {
+        p_iov[i_iov].iov_base = p_header;
+        p_iov[i_iov++].iov_len = CT_HEADER_SIZE;
+        i_size += CT_HEADER_SIZE;
+    }
+    p_iov[i_iov].iov_base = p_stc;
+    p_iov[i_iov++].iov_len = sizeof(uint64_t);
+    p_iov[i_iov].iov_base = p_buf;
+    p_iov[i_iov++].iov_len = i_len;
+
+    if ( (i_ret = readv( i_fd, p_iov, i_iov )) < 0 )
+    {
+        msg_Err( NULL, "read error (%s)", strerror(errno) );
+        return -1;
+    }
+    if ( i_ret != i_size )
+    {
+        /* The record may still be being written */
+        if ( i_ret && lseek( i_fd, -i_ret, SEEK_CUR ) == (off_t)-1 )
+            return -1;
+        return 0;
+    }
+
+    if ( !(i_chunk % CT_BLOCK_CHUNKS) && (!ct_check_header( p_header )
+           || ct_get_payload_size( p_header ) != i_len) )
+    {
+        msg_Err( NULL, "invalid container block (payload size %zu)",
+                 ct_check_header( p_header ) ?
+                     ct_get_payload_size( p_header ) : 0 );
+        return -1;
+    }
+
+    *pi_stc = FromSTC( p_stc );
+    return i_len;
+}
+
+/*****************************************************************************
+ * WriteContainer: append a chunk and its STC to a container
+ *****************************************************************************/
+ssize_t WriteContainer( int i_fd, off_t i_chunk, uint64_t i_stc,
+                        const void *p_buf, size_t i_len )
+{
+    uint8_t p_header[CT_HEADER_SIZE], p_stc[sizeof(uint64_t)];
+    struct iovec p_iov[3];
+    int i_iov = 0;
+
+    if ( !(i_chunk % CT_BLOCK_CHUNKS) )
+    {
+        ct_set_header( p_header, i_len, i_chunk / CT_BLOCK_CHUNKS );
+        p_iov[i_iov].iov_base = p_header;
+        p_iov[i_iov++].iov_len = CT_HEADER_SIZE;
+    }
+    ToSTC( p_stc, i_stc );
+    p_iov[i_iov].iov_base = p_stc;
+    p_iov[i_iov++].iov_len = sizeof(uint64_t);
+    p_iov[i_iov].iov_base = (void *)p_buf;
+    p_iov[i_iov++].iov_len = i_len;
+
+    return writev( i_fd, p_iov, i_iov );
+}
+
+/*****************************************************************************
+ * LookupContainerFile: find an STC in a container
+ *****************************************************************************/
+off_t LookupContainerFile( const char *psz_arg, int64_t i_wanted,
+                           bool b_absolute, size_t i_payload_size )
+{
+    return LookupSTC( psz_arg, i_wanted, b_absolute, i_payload_size );
+}
+
+/*****************************************************************************
+ * Random access point index
+ *****************************************************************************
+ * The index (example.rap accompanies example.ts or example.mct) is a plain
+ * array of the 64-bit big-endian numbers of the chunks containing a random
+ * access point, in increasing order.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * OpenRAPFile: open the index of a file for appending, forgetting the
+ * entries of chunks past i_nb_chunks
+ *****************************************************************************/
+int OpenRAPFile( const char *psz_arg, size_t i_payload_size,
+                 off_t i_nb_chunks )
+{
+    char *psz_rap_file = GetSidecarFile( psz_arg, PSZ_RAP_EXT,
+                                         i_payload_size );
+    int i_fd = open( psz_rap_file, O_RDWR | O_CREAT, 0644 );
+    struct stat st;
+    off_t i_nb_entries;
+    uint8_t p_entry[sizeof(uint64_t)];
+
+    if ( i_fd < 0 )
+    {
+        msg_Err( NULL, "couldn't open file %s (%s)", psz_rap_file,
+                 strerror(errno) );
+        free( psz_rap_file );
+        return -1;
+    }
+    free( psz_rap_file );
+
+    i_nb_entries = fstat( i_fd, &st ) < 0 ? 0 : st.st_size / sizeof(uint64_t);
+    while ( i_nb_entries
+             && (pread( i_fd, p_entry, sizeof(uint64_t),
+                        (i_nb_entries - 1) * sizeof(uint64_t) )
+                   != sizeof(uint64_t)
+                  || (off_t)FromSTC( p_entry ) >= i_nb_chunks) )
+        i_nb_entries--;
+    if ( ftruncate( i_fd, i_nb_entries * sizeof(uint64_t) ) < 0 )
+        msg_Err( NULL, "truncate failed (%s)", strerror(errno) );
+    lseek( i_fd, 0, SEEK_END );
+    return i_fd;
+}
+
+/*****************************************************************************
+ * WriteRAPFile: append a chunk to the index
+ *****************************************************************************/
+bool WriteRAPFile( int i_fd, off_t i_chunk )
+{
+    uint8_t p_entry[sizeof(uint64_t)];
+
+    ToSTC( p_entry, i_chunk );
+    return write( i_fd, p_entry, sizeof(uint64_t) ) == sizeof(uint64_t);
+}
+
+/*****************************************************************************
+ * LookupRAPFile: return the last random access point at or before a chunk,
+ * or -1 if there is no index or no such point
+ *****************************************************************************/
+off_t LookupRAPFile( const char *psz_arg, off_t i_chunk,
+                     size_t i_payload_size )
+{
+    char *psz_rap_file = GetSidecarFile( psz_arg, PSZ_RAP_EXT,
+                                         i_payload_size );
+    int i_fd = open( psz_rap_file, O_RDONLY );
+    struct stat st;
+    off_t i_low = 0, i_high, i_ret = -1;
+    uint8_t p_entry[sizeof(uint64_t)];
+
+    free( psz_rap_file );
+    if ( i_fd < 0 )
         return -1;
-    }
-
-    if ( fstat( i_stc_fd, &stc_stat ) == -1
-          || stc_stat.st_size < sizeof(uint64_t) )
+    if ( fstat( i_fd, &st ) < 0 )
     {
-        msg_Err( NULL, "unable to stat %s (%s)", psz_arg, strerror(errno) );
+        close( i_fd );
         return -1;
     }
 
-    p_aux = mmap( NULL, stc_stat.st_size, PROT_READ, MAP_SHARED,
-                  i_stc_fd, 0 );
-    if ( p_aux == MAP_FAILED )
+    i_high = st.st_size / sizeof(uint64_t);
+    while ( i_low < i_high )
     {
-        msg_Err( NULL, "unable to mmap %s (%s)", psz_arg, strerror(errno) );
-        return -1;
+        off_t i_mid = i_low + (i_high - i_low) / 2;
+        off_t i_entry;
+
+        if ( pread( i_fd, p_entry, sizeof(uint64_t),
+                    i_mid * sizeof(uint64_t) ) != sizeof(uint64_t) )
+            break;
+        i_entry = FromSTC( p_entry );
+        if ( i_entry <= i_chunk )
+        {
+            i_ret = i_entry;
+            i_low = i_mid + 1;
+        }
+        else
+            i_high = i_mid;
     }
 
-    i_offset2 = stc_stat.st_size / sizeof(uint64_t);
+    close( i_fd );
+    return i_ret;
+}
 
-    if ( i_wanted < 0 )
-        i_wanted += FromSTC( p_aux + (i_offset2 - 1) * sizeof(uint64_t) );
-    else if ( !b_absolute )
-        i_wanted += FromSTC( p_aux );
+/*****************************************************************************
+ * OpenNullFile: open the null packet counts of a file at a chunk; when
+ * reading, returns -1 if the file has none, and when writing, forgets the
+ * counts of chunks past i_chunk
+ *****************************************************************************/
+int OpenNullFile( const char *psz_arg, size_t i_payload_size, bool b_read,
+                  off_t i_chunk )
+{
+    char *psz_null_file = GetSidecarFile( psz_arg, PSZ_NULL_EXT,
+                                          i_payload_size );
+    int i_fd = b_read ? open( psz_null_file, O_RDONLY ) :
+                        open( psz_null_file, O_RDWR | O_CREAT, 0644 );
 
-    if ( i_wanted < 0 )
+    if ( i_fd < 0 )
     {
-        msg_Err( NULL, "invalid offset" );
+        if ( !b_read )
+            msg_Err( NULL, "couldn't open file %s (%s)", psz_null_file,
+                     strerror(errno) );
+        free( psz_null_file );
         return -1;
     }
+    free( psz_null_file );
 
-    for ( ; ; )
-    {
-        off_t i_mid_offset = (i_offset1 + i_offset2) / 2;
-        uint8_t *p_mid_aux = p_aux + i_mid_offset * sizeof(uint64_t);
-        uint64_t i_mid_stc = FromSTC( p_mid_aux );
+    if ( !b_read && ftruncate( i_fd, i_chunk * sizeof(uint32_t) ) < 0 )
+        msg_Err( NULL, "truncate failed (%s)", strerror(errno) );
+    lseek( i_fd, i_chunk * sizeof(uint32_t), SEEK_SET );
+    return i_fd;
+}
 
-        if ( i_offset1 == i_mid_offset )
-            break;
+/*****************************************************************************
+ * ReadNullFile/WriteNullFile: number of null packets removed before the
+ * next chunk
+ *****************************************************************************/
+bool ReadNullFile( int i_fd, uint32_t *pi_nulls )
+{
+    uint8_t p_entry[sizeof(uint32_t)];
 
-        if ( i_mid_stc >= i_wanted )
-            i_offset2 = i_mid_offset;
-        else
-            i_offset1 = i_mid_offset;
-    }
+    if ( read( i_fd, p_entry, sizeof(uint32_t) ) != sizeof(uint32_t) )
+        return false;
+    *pi_nulls = FromU32( p_entry );
+    return true;
+}
 
-    munmap( p_aux, stc_stat.st_size );
-    close( i_stc_fd );
+bool WriteNullFile( int i_fd, uint32_t i_nulls )
+{
+    uint8_t p_entry[sizeof(uint32_t)];
 
-    return i_offset2;
+    ToU32( p_entry, i_nulls );
+    return write( i_fd, p_entry, sizeof(uint32_t) ) == sizeof(uint32_t);
 }
 
 /*****************************************************************************
@@ -1120,7 +2377,13 @@ void CheckFileSizes( const char *psz_file, const char *psz_aux_file,
         }
     }
 
-    if ( stat( psz_aux_file, &st ) < 0 )
+    if ( GetAuxVersion( psz_aux_file ) == 2 )
+    {
+        aux_file_t *p_aux = OpenAuxFile( psz_aux_file, true, false );
+        i_aux_packets = CountAuxFile( p_aux );
+        CloseAuxFile( p_aux );
+    }
+    else if ( stat( psz_aux_file, &st ) < 0 )
         i_aux_packets = 0;
     else
     {
@@ -1137,8 +2400,7 @@ void CheckFileSizes( const char *psz_file, const char *psz_aux_file,
     if ( i_file_packets < i_aux_packets )
     {
         msg_Warn( NULL, "truncating aux file" );
-        if ( truncate( psz_aux_file, i_file_packets * sizeof(uint64_t) ) < 0 )
-            msg_Err( NULL, "truncate failed (%s)", strerror(errno) );
+        TruncateAuxFile( psz_aux_file, i_file_packets );
     }
     else if ( i_aux_packets < i_file_packets )
     {
@@ -1161,24 +2423,189 @@ uint64_t GetDirFile( uint64_t i_rotate_size, int64_t i_wanted )
     return i_wanted / i_rotate_size;
 }
 
+/*****************************************************************************
+ * Directory layout
+ *****************************************************************************
+ * Segments are either all in the directory (flat layout), or nested in
+ * subdirectories covering i_dir_bucket_size ticks each, named after the
+ * STC divided by i_dir_bucket_size. When reading, a segment that isn't
+ * found in its subdirectory is looked up in the directory itself, so that
+ * archives may be migrated while in use.
+ *****************************************************************************/
+static uint64_t i_dir_rotate_size = 0, i_dir_bucket_size = 0;
+static char **ppsz_dir_roots = NULL;
+static unsigned int i_nb_dir_roots = 0;
+
+/*****************************************************************************
+ * SetDirLayout: nest segments in subdirectories of i_bucket_size ticks
+ * (0 for a flat directory)
+ *****************************************************************************/
+void SetDirLayout( uint64_t i_rotate_size, uint64_t i_bucket_size )
+{
+    i_dir_rotate_size = i_rotate_size;
+    i_dir_bucket_size = i_bucket_size;
+}
+
+/*****************************************************************************
+ * AddDirRoot: also look for segments in another directory (for archives
+ * spread over several disks)
+ *****************************************************************************/
+void AddDirRoot( const char *psz_path )
+{
+    ppsz_dir_roots = realloc( ppsz_dir_roots,
+                              (i_nb_dir_roots + 1) * sizeof(char *) );
+    ppsz_dir_roots[i_nb_dir_roots++] = strdup( psz_path );
+}
+
+/*****************************************************************************
+ * GetDirBucket: return the subdirectory of a segment
+ *****************************************************************************/
+static uint64_t GetDirBucket( uint64_t i_file )
+{
+    return i_file * i_dir_rotate_size / i_dir_bucket_size;
+}
+
+/*****************************************************************************
+ * GetDirFileName: return the (malloc'ed) path of a segment file
+ *****************************************************************************/
+static char *GetDirFileName( const char *psz_dir_path, uint64_t i_file,
+                             const char *psz_ext, bool b_nested )
+{
+    char *psz_file = malloc( strlen(psz_dir_path) + strlen(psz_ext)
+                              + 2 * sizeof("/18446744073709551615") + 1 );
+
+    if ( b_nested && i_dir_bucket_size )
+        sprintf( psz_file, "%s/%"PRIu64"/%"PRIu64".%s", psz_dir_path,
+                 GetDirBucket( i_file ), i_file, psz_ext );
+    else
+        sprintf( psz_file, "%s/%"PRIu64".%s", psz_dir_path, i_file,
+                 psz_ext );
+    return psz_file;
+}
+
+/*****************************************************************************
+ * FindRootFile: return the (malloc'ed) path of an existing segment in a
+ * directory, or NULL
+ *****************************************************************************/
+static char *FindRootFile( const char *psz_dir_path, uint64_t i_file,
+                           bool *pb_container )
+{
+    int i;
+
+    for ( i = i_dir_bucket_size ? 0 : 1; i < 2; i++ )
+    {
+        char *psz_file = GetDirFileName( psz_dir_path, i_file, PSZ_CT_EXT,
+                                         !i );
+        if ( StatFile( psz_file ) )
+        {
+            *pb_container = true;
+            return psz_file;
+        }
+        free( psz_file );
+
+        psz_file = GetDirFileName( psz_dir_path, i_file, PSZ_TS_EXT, !i );
+        if ( StatFile( psz_file ) )
+        {
+            *pb_container = false;
+            return psz_file;
+        }
+        free( psz_file );
+    }
+    return NULL;
+}
+
+/*****************************************************************************
+ * ExistsDirFile: check whether a segment exists in a directory
+ *****************************************************************************/
+bool ExistsDirFile( const char *psz_dir_path, uint64_t i_file )
+{
+    bool b_container;
+    char *psz_file = FindRootFile( psz_dir_path, i_file, &b_container );
+
+    free( psz_file );
+    return psz_file != NULL;
+}
+
+/*****************************************************************************
+ * FindDirFile: return the (malloc'ed) path of an existing segment in the
+ * directory or the other roots, or of the TS file of the current layout if
+ * there is none
+ *****************************************************************************/
+static char *FindDirFile( const char *psz_dir_path, uint64_t i_file,
+                          bool *pb_container )
+{
+    char *psz_file = FindRootFile( psz_dir_path, i_file, pb_container );
+    unsigned int i;
+
+    for ( i = 0; psz_file == NULL && i < i_nb_dir_roots; i++ )
+        if ( strcmp( ppsz_dir_roots[i], psz_dir_path ) )
+            psz_file = FindRootFile( ppsz_dir_roots[i], i_file,
+                                     pb_container );
+    if ( psz_file != NULL )
+        return psz_file;
+
+    *pb_container = false;
+    return GetDirFileName( psz_dir_path, i_file, PSZ_TS_EXT, true );
+}
+
 /*****************************************************************************
  * OpenDirFile: return fd + aux file pointer
+ *****************************************************************************
+ * Segments recorded as containers have no aux file: pass a NULL
+ * pp_aux_file to write one; when reading one, *pp_aux_file is set to NULL.
  *****************************************************************************/
 int OpenDirFile( const char *psz_dir_path, uint64_t i_file, bool b_read,
-                 size_t i_payload_size, FILE **pp_aux_file )
+                 size_t i_payload_size, aux_file_t **pp_aux_file )
 {
     int i_fd;
-    char psz_file[strlen(psz_dir_path) + sizeof(PSZ_TS_EXT) +
-                  sizeof(".18446744073709551615")];
-    char *psz_aux_file;
+    char *psz_file, *psz_aux_file;
+    bool b_container = pp_aux_file == NULL;
+
+    if ( b_read )
+    {
+        psz_file = FindDirFile( psz_dir_path, i_file, &b_container );
+        if ( !StatFile( psz_file ) )
+        {
+            free( psz_file );
+            return -1;
+        }
+    }
+    else
+    {
+        if ( i_dir_bucket_size )
+        {
+            psz_file = malloc( strlen(psz_dir_path)
+                                + sizeof("/18446744073709551615") );
+            sprintf( psz_file, "%s/%"PRIu64, psz_dir_path,
+                     GetDirBucket( i_file ) );
+            if ( mkdir( psz_file, 0755 ) < 0 && errno != EEXIST )
+                msg_Err( NULL, "couldn't create directory %s (%s)", psz_file,
+                         strerror(errno) );
+            free( psz_file );
+        }
+        psz_file = GetDirFileName( psz_dir_path, i_file,
+                                   b_container ? PSZ_CT_EXT : PSZ_TS_EXT,
+                                   true );
+    }
+
+    if ( b_container )
+    {
+        if ( !b_read )
+            CheckContainerFile( psz_file, i_payload_size );
+        else
+            *pp_aux_file = NULL;
+        i_fd = OpenFile( psz_file, b_read, !b_read );
+        free( psz_file );
+        return i_fd;
+    }
 
-    sprintf( psz_file, "%s/%"PRIu64"."PSZ_TS_EXT, psz_dir_path, i_file );
     psz_aux_file = GetAuxFile( psz_file, i_payload_size );
 
     if ( !b_read )
         CheckFileSizes( psz_file, psz_aux_file, i_payload_size );
 
     i_fd = OpenFile( psz_file, b_read, !b_read );
+    free( psz_file );
     if ( i_fd < 0 )
     {
         free( psz_aux_file );
@@ -1202,12 +2629,410 @@ off_t LookupDirAuxFile( const char *psz_dir_path, uint64_t i_file,
                         int64_t i_wanted, size_t i_payload_size )
 {
     off_t i_ret;
-    char psz_file[strlen(psz_dir_path) + sizeof(PSZ_TS_EXT) +
-                  sizeof(".18446744073709551615")];
-    sprintf( psz_file, "%s/%"PRIu64"."PSZ_TS_EXT, psz_dir_path, i_file );
+    bool b_container;
+    char *psz_file = FindDirFile( psz_dir_path, i_file, &b_container );
 
-    char *psz_aux_file = GetAuxFile( psz_file, i_payload_size );
-    i_ret = LookupAuxFile( psz_aux_file, i_wanted, true );
-    free( psz_aux_file );
+    if ( b_container )
+        i_ret = LookupContainerFile( psz_file, i_wanted, true,
+                                     i_payload_size );
+    else
+    {
+        char *psz_aux_file = GetAuxFile( psz_file, i_payload_size );
+        i_ret = LookupAuxFile( psz_aux_file, i_wanted, true );
+        free( psz_aux_file );
+    }
+    free( psz_file );
+    return i_ret;
+}
+
+/*****************************************************************************
+ * OpenDirRAPFile: open the index of the segment being written
+ *****************************************************************************/
+int OpenDirRAPFile( const char *psz_dir_path, uint64_t i_file,
+                    size_t i_payload_size, off_t i_nb_chunks )
+{
+    char *psz_file = GetDirFileName( psz_dir_path, i_file, PSZ_TS_EXT, true );
+    int i_fd = OpenRAPFile( psz_file, i_payload_size, i_nb_chunks );
+
+    free( psz_file );
+    return i_fd;
+}
+
+/*****************************************************************************
+ * LookupDirRAPFile: return the last random access point at or before a
+ * chunk of a segment, or -1
+ *****************************************************************************/
+off_t LookupDirRAPFile( const char *psz_dir_path, uint64_t i_file,
+                        off_t i_chunk, size_t i_payload_size )
+{
+    bool b_container;
+    char *psz_file = FindDirFile( psz_dir_path, i_file, &b_container );
+    off_t i_ret = LookupRAPFile( psz_file, i_chunk, i_payload_size );
+
+    free( psz_file );
     return i_ret;
 }
+
+/*****************************************************************************
+ * OpenDirNullFile: open the null packet counts of a segment at a chunk
+ *****************************************************************************/
+int OpenDirNullFile( const char *psz_dir_path, uint64_t i_file,
+                     size_t i_payload_size, bool b_read, off_t i_chunk )
+{
+    bool b_container;
+    char *psz_file = b_read ?
+        FindDirFile( psz_dir_path, i_file, &b_container ) :
+        GetDirFileName( psz_dir_path, i_file, PSZ_TS_EXT, true );
+    int i_fd = OpenNullFile( psz_file, i_payload_size, b_read, i_chunk );
+
+    free( psz_file );
+    return i_fd;
+}
+
+/*****************************************************************************
+ * Directory retention
+ *****************************************************************************
+ * Expired segments are unlinked by a separate thread, so that the writer
+ * never waits for the file system. The thread scans the directory once at
+ * startup, then only learns about new segments from UpdateDirRetention().
+ *****************************************************************************/
+#define RETENTION_PERIOD 10 /* s, to check the disk usage */
+
+struct dir_retention_t
+{
+    char *psz_dir_path;
+    size_t i_payload_size;
+    uint64_t i_rotate_size;
+    unsigned int i_max_files;
+    uint64_t i_max_age;
+    unsigned int i_max_usage;
+
+    /* owned by the retention thread */
+    uint64_t *pi_files;
+    size_t i_nb_files, i_first_file, i_max_nb_files;
+
+    /* shared with the writer */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    bool b_exit;
+    uint64_t *pi_new_files;
+    size_t i_nb_new_files, i_max_new_files;
+    uint64_t i_current_stc;
+};
+
+static int CompareFiles( const void *p1, const void *p2 )
+{
+    uint64_t i1 = *(const uint64_t *)p1, i2 = *(const uint64_t *)p2;
+    return i1 < i2 ? -1 : i1 > i2;
+}
+
+static void RetentionAddFile( dir_retention_t *p_ret, uint64_t i_file )
+{
+    if ( p_ret->i_first_file + p_ret->i_nb_files == p_ret->i_max_nb_files )
+    {
+        if ( p_ret->i_first_file )
+        {
+            memmove( p_ret->pi_files, p_ret->pi_files + p_ret->i_first_file,
+                     p_ret->i_nb_files * sizeof(uint64_t) );
+            p_ret->i_first_file = 0;
+        }
+        else
+        {
+            p_ret->i_max_nb_files = p_ret->i_max_nb_files ?
+                                    p_ret->i_max_nb_files * 2 : 64;
+            p_ret->pi_files = realloc( p_ret->pi_files,
+                                 p_ret->i_max_nb_files * sizeof(uint64_t) );
+        }
+    }
+    p_ret->pi_files[p_ret->i_first_file + p_ret->i_nb_files++] = i_file;
+}
+
+static void RetentionScanDir( dir_retention_t *p_ret, const char *psz_path,
+                              bool b_subdirs )
+{
+    DIR *p_dir = opendir( psz_path );
+    struct dirent *p_entry;
+
+    if ( p_dir == NULL )
+    {
+        msg_Warn( NULL, "couldn't scan %s (%s)", psz_path, strerror(errno) );
+        return;
+    }
+
+    while ( (p_entry = readdir( p_dir )) != NULL )
+    {
+        char *psz_end;
+        uint64_t i_file = strtoull( p_entry->d_name, &psz_end, 10 );
+        if ( psz_end == p_entry->d_name )
+            continue;
+        if ( *psz_end == '.' )
+            RetentionAddFile( p_ret, i_file );
+        else if ( !*psz_end && b_subdirs )
+        {
+            char psz_subdir[strlen(psz_path) + strlen(p_entry->d_name) + 2];
+            sprintf( psz_subdir, "%s/%s", psz_path, p_entry->d_name );
+            RetentionScanDir( p_ret, psz_subdir, false );
+        }
+    }
+    closedir( p_dir );
+}
+
+static void RetentionScan( dir_retention_t *p_ret )
+{
+    uint64_t *pi_files;
+    size_t i, j;
+
+    RetentionScanDir( p_ret, p_ret->psz_dir_path, i_dir_bucket_size != 0 );
+
+    /* Sort, and merge the .ts, .aux and .mct files of a segment */
+    pi_files = p_ret->pi_files + p_ret->i_first_file;
+    if ( !p_ret->i_nb_files )
+        return;
+    qsort( pi_files, p_ret->i_nb_files, sizeof(uint64_t), CompareFiles );
+    for ( i = 1, j = 1; i < p_ret->i_nb_files; i++ )
+        if ( pi_files[i] != pi_files[j - 1] )
+            pi_files[j++] = pi_files[i];
+    p_ret->i_nb_files = j;
+}
+
+static void RetentionInsertFile( dir_retention_t *p_ret, uint64_t i_file )
+{
+    uint64_t *pi_files;
+    size_t i;
+
+    RetentionAddFile( p_ret, i_file );
+    pi_files = p_ret->pi_files + p_ret->i_first_file;
+    for ( i = p_ret->i_nb_files - 1; i && pi_files[i - 1] >= i_file; i-- )
+        pi_files[i] = pi_files[i - 1];
+    if ( i + 1 < p_ret->i_nb_files && pi_files[i + 1] == i_file )
+    {
+        /* Already known, undo */
+        memmove( pi_files + i, pi_files + i + 1,
+                 (p_ret->i_nb_files - i - 1) * sizeof(uint64_t) );
+        p_ret->i_nb_files--;
+    }
+    else
+        pi_files[i] = i_file;
+}
+
+static bool RetentionOverUsage( dir_retention_t *p_ret, uint64_t *pi_used )
+{
+    struct statvfs st;
+
+    if ( statvfs( p_ret->psz_dir_path, &st ) < 0 || !st.f_blocks )
+        return false;
+    *pi_used = st.f_blocks - st.f_bfree;
+    return *pi_used * 100 > (*pi_used + st.f_bavail) * p_ret->i_max_usage;
+}
+
+static void RetentionUnlinkFile( const char *psz_file )
+{
+    if ( unlink( psz_file ) < 0 && errno != ENOENT )
+        msg_Warn( NULL, "couldn't unlink %s (%s)", psz_file,
+                  strerror(errno) );
+}
+
+static void RetentionUnlink( dir_retention_t *p_ret, uint64_t i_file )
+{
+    int i;
+
+    msg_Dbg( NULL, "expiring segment %"PRIu64, i_file );
+
+    for ( i = i_dir_bucket_size ? 0 : 1; i < 2; i++ )
+    {
+        char *psz_file = GetDirFileName( p_ret->psz_dir_path, i_file,
+                                         PSZ_TS_EXT, !i );
+        char *psz_aux_file = GetAuxFile( psz_file, p_ret->i_payload_size );
+        char *psz_rap_file = GetSidecarFile( psz_file, PSZ_RAP_EXT,
+                                             p_ret->i_payload_size );
+        char *psz_null_file = GetSidecarFile( psz_file, PSZ_NULL_EXT,
+                                              p_ret->i_payload_size );
+        RetentionUnlinkFile( psz_file );
+        RetentionUnlinkFile( psz_aux_file );
+        RetentionUnlinkFile( psz_rap_file );
+        RetentionUnlinkFile( psz_null_file );
+        free( psz_null_file );
+        free( psz_rap_file );
+        free( psz_aux_file );
+        free( psz_file );
+
+        psz_file = GetDirFileName( p_ret->psz_dir_path, i_file, PSZ_CT_EXT,
+                                   !i );
+        RetentionUnlinkFile( psz_file );
+        free( psz_file );
+    }
+
+    if ( i_dir_bucket_size )
+    {
+        /* Remove the subdirectory once it is empty */
+        char psz_subdir[strlen(p_ret->psz_dir_path)
+                         + sizeof("/18446744073709551615")];
+        sprintf( psz_subdir, "%s/%"PRIu64, p_ret->psz_dir_path,
+                 GetDirBucket( i_file ) );
+        rmdir( psz_subdir );
+    }
+}
+
+static void RetentionExpire( dir_retention_t *p_ret, uint64_t i_current_file,
+                             uint64_t i_current_stc )
+{
+    uint64_t i_used = 0;
+
+    while ( p_ret->i_nb_files )
+    {
+        uint64_t i_file = p_ret->pi_files[p_ret->i_first_file];
+        bool b_expire = false;
+
+        /* Never touch the segment being written, nor anything newer */
+        if ( i_file >= i_current_file )
+            break;
+
+        if ( p_ret->i_max_files && p_ret->i_nb_files > p_ret->i_max_files )
+            b_expire = true;
+        else if ( p_ret->i_max_age && (i_file + 1) * p_ret->i_rotate_size
+                                        + p_ret->i_max_age <= i_current_stc )
+            b_expire = true;
+        else if ( p_ret->i_max_usage )
+        {
+            uint64_t i_new_used;
+
+            b_expire = RetentionOverUsage( p_ret, &i_new_used );
+            /* Space held by open files isn't released by unlink */
+            if ( i_used && i_new_used >= i_used )
+                break;
+            i_used = i_new_used;
+        }
+        if ( !b_expire )
+            break;
+
+        RetentionUnlink( p_ret, i_file );
+        p_ret->i_first_file++;
+        p_ret->i_nb_files--;
+    }
+}
+
+static void *RetentionThread( void *p_arg )
+{
+    dir_retention_t *p_ret = p_arg;
+    uint64_t i_current_file = 0, i_current_stc = 0;
+    bool b_started = false;
+    sigset_t set;
+
+    /* Leave the signals to the writer */
+    sigfillset( &set );
+    pthread_sigmask( SIG_BLOCK, &set, NULL );
+
+    RetentionScan( p_ret );
+
+    pthread_mutex_lock( &p_ret->lock );
+    for ( ; ; )
+    {
+        bool b_exit = p_ret->b_exit;
+        size_t i;
+
+        for ( i = 0; i < p_ret->i_nb_new_files; i++ )
+            RetentionInsertFile( p_ret, p_ret->pi_new_files[i] );
+        if ( p_ret->i_nb_new_files )
+        {
+            i_current_file = p_ret->pi_new_files[p_ret->i_nb_new_files - 1];
+            i_current_stc = p_ret->i_current_stc;
+            p_ret->i_nb_new_files = 0;
+            b_started = true;
+        }
+        pthread_mutex_unlock( &p_ret->lock );
+
+        if ( b_started )
+            RetentionExpire( p_ret, i_current_file, i_current_stc );
+
+        pthread_mutex_lock( &p_ret->lock );
+        if ( b_exit )
+            break;
+        if ( !p_ret->b_exit && !p_ret->i_nb_new_files )
+        {
+            struct timespec ts;
+            clock_gettime( CLOCK_REALTIME, &ts );
+            ts.tv_sec += RETENTION_PERIOD;
+            pthread_cond_timedwait( &p_ret->wait, &p_ret->lock, &ts );
+        }
+    }
+    pthread_mutex_unlock( &p_ret->lock );
+    return NULL;
+}
+
+/*****************************************************************************
+ * StartDirRetention: start expiring the segments of a directory, keeping at
+ * most i_max_files segments, none older than i_max_age, and the disk usage
+ * below i_max_usage percent (0 disables a criterion)
+ *****************************************************************************/
+dir_retention_t *StartDirRetention( const char *psz_dir_path,
+                                    size_t i_payload_size,
+                                    uint64_t i_rotate_size,
+                                    unsigned int i_max_files,
+                                    uint64_t i_max_age,
+                                    unsigned int i_max_usage )
+{
+    dir_retention_t *p_ret = calloc( 1, sizeof(dir_retention_t) );
+
+    p_ret->psz_dir_path = strdup( psz_dir_path );
+    p_ret->i_payload_size = i_payload_size;
+    p_ret->i_rotate_size = i_rotate_size;
+    p_ret->i_max_files = i_max_files;
+    p_ret->i_max_age = i_max_age;
+    p_ret->i_max_usage = i_max_usage;
+    pthread_mutex_init( &p_ret->lock, NULL );
+    pthread_cond_init( &p_ret->wait, NULL );
+
+    if ( pthread_create( &p_ret->thread, NULL, RetentionThread, p_ret ) )
+    {
+        msg_Err( NULL, "couldn't create retention thread" );
+        pthread_mutex_destroy( &p_ret->lock );
+        pthread_cond_destroy( &p_ret->wait );
+        free( p_ret->psz_dir_path );
+        free( p_ret );
+        return NULL;
+    }
+    return p_ret;
+}
+
+/*****************************************************************************
+ * UpdateDirRetention: signal that a new segment is being written
+ *****************************************************************************/
+void UpdateDirRetention( dir_retention_t *p_ret, uint64_t i_file,
+                         uint64_t i_stc )
+{
+    pthread_mutex_lock( &p_ret->lock );
+    if ( p_ret->i_nb_new_files == p_ret->i_max_new_files )
+    {
+        p_ret->i_max_new_files = p_ret->i_max_new_files ?
+                                 p_ret->i_max_new_files * 2 : 16;
+        p_ret->pi_new_files = realloc( p_ret->pi_new_files,
+                                 p_ret->i_max_new_files * sizeof(uint64_t) );
+    }
+    p_ret->pi_new_files[p_ret->i_nb_new_files++] = i_file;
+    p_ret->i_current_stc = i_stc;
+    pthread_cond_signal( &p_ret->wait );
+    pthread_mutex_unlock( &p_ret->lock );
+}
+
+/*****************************************************************************
+ * StopDirRetention
+ *****************************************************************************/
+void StopDirRetention( dir_retention_t *p_ret )
+{
+    if ( p_ret == NULL )
+        return;
+
+    pthread_mutex_lock( &p_ret->lock );
+    p_ret->b_exit = true;
+    pthread_cond_signal( &p_ret->wait );
+    pthread_mutex_unlock( &p_ret->lock );
+    pthread_join( p_ret->thread, NULL );
+
+    pthread_mutex_destroy( &p_ret->lock );
+    pthread_cond_destroy( &p_ret->wait );
+    free( p_ret->pi_files );
+    free( p_ret->pi_new_files );
+    free( p_ret->psz_dir_path );
+    free( p_ret );
+}
@@ -74,6 +74,19 @@ struct udprawpkt {
  };
 
 
+/*****************************************************************************
+ * Aux files (opaque, see util.c for the formats)
+ *****************************************************************************/
+typedef struct aux_file_t aux_file_t;
+
+/* version of the aux files created for writing (1 or 2) */
+extern int i_aux_version;
+
+/*****************************************************************************
+ * Directory retention (opaque, see util.c)
+ *****************************************************************************/
+typedef struct dir_retention_t dir_retention_t;
+
 /*****************************************************************************
  * Prototypes
  *****************************************************************************/
@@ -94,15 +107,56 @@ int OpenSocket( const char *_psz_arg, int i_ttl, uint16_t i_bind_port,
 mode_t StatFile(const char *psz_arg);
 int OpenFile( const char *psz_arg, bool b_read, bool b_append );
 char *GetAuxFile( const char *psz_arg, size_t i_payload_size );
-FILE *OpenAuxFile( const char *psz_arg, bool b_read, bool b_append );
+aux_file_t *OpenAuxFile( const char *psz_arg, bool b_read, bool b_append );
+bool ReadAuxFile( aux_file_t *p_aux, uint64_t *pi_stc );
+int SeekAuxFile( aux_file_t *p_aux, off_t i_chunk );
+off_t CountAuxFile( aux_file_t *p_aux );
+bool WriteAuxFile( aux_file_t *p_aux, uint64_t i_stc );
+void FlushAuxFile( aux_file_t *p_aux );
+void CloseAuxFile( aux_file_t *p_aux );
 off_t LookupAuxFile( const char *psz_arg, int64_t i_wanted, bool b_absolute );
+size_t GetContainerPayloadSize( const char *psz_arg );
+off_t CheckContainerFile( const char *psz_file, size_t i_payload_size );
+ssize_t ReadContainer( int i_fd, off_t i_chunk, uint64_t *pi_stc,
+                       void *p_buf, size_t i_len );
+ssize_t WriteContainer( int i_fd, off_t i_chunk, uint64_t i_stc,
+                        const void *p_buf, size_t i_len );
+off_t LookupContainerFile( const char *psz_arg, int64_t i_wanted,
+                           bool b_absolute, size_t i_payload_size );
+int OpenRAPFile( const char *psz_arg, size_t i_payload_size,
+                 off_t i_nb_chunks );
+bool WriteRAPFile( int i_fd, off_t i_chunk );
+off_t LookupRAPFile( const char *psz_arg, off_t i_chunk,
+                     size_t i_payload_size );
+int OpenNullFile( const char *psz_arg, size_t i_payload_size, bool b_read,
+                  off_t i_chunk );
+bool ReadNullFile( int i_fd, uint32_t *pi_nulls );
+bool WriteNullFile( int i_fd, uint32_t i_nulls );
 void CheckFileSizes( const char *psz_file, const char *psz_aux_file,
                      size_t i_payload_size );
 uint64_t GetDirFile( uint64_t i_rotate_size, int64_t i_wanted );
+void SetDirLayout( uint64_t i_rotate_size, uint64_t i_bucket_size );
+void AddDirRoot( const char *psz_path );
+bool ExistsDirFile( const char *psz_dir_path, uint64_t i_file );
 int OpenDirFile( const char *psz_dir_path, uint64_t i_file, bool b_read,
-                 size_t i_payload_size, FILE **pp_aux_file );
+                 size_t i_payload_size, aux_file_t **pp_aux_file );
 off_t LookupDirAuxFile( const char *psz_dir_path, uint64_t i_file,
                         int64_t i_wanted, size_t i_payload_size );
+int OpenDirRAPFile( const char *psz_dir_path, uint64_t i_file,
+                    size_t i_payload_size, off_t i_nb_chunks );
+off_t LookupDirRAPFile( const char *psz_dir_path, uint64_t i_file,
+                        off_t i_chunk, size_t i_payload_size );
+int OpenDirNullFile( const char *psz_dir_path, uint64_t i_file,
+                     size_t i_payload_size, bool b_read, off_t i_chunk );
+dir_retention_t *StartDirRetention( const char *psz_dir_path,
+                                    size_t i_payload_size,
+                                    uint64_t i_rotate_size,
+                                    unsigned int i_max_files,
+                                    uint64_t i_max_age,
+                                    unsigned int i_max_usage );
+void UpdateDirRetention( dir_retention_t *p_ret, uint64_t i_file,
+                         uint64_t i_stc );
+void StopDirRetention( dir_retention_t *p_ret );
 
 /*****************************************************************************
  * Aux files helpers
@@ -131,6 +185,82 @@ static inline void ToSTC( uint8_t *p_aux, uint64_t i_stc )
     p_aux[7] = (i_stc >> 0) & 0xff;
 }
 
+/*****************************************************************************
+ * Container helpers - biTStream style
+ *****************************************************************************
+ * A self-timed container interleaves timing and payload in a single file.
+ * It is made of blocks of CT_BLOCK_CHUNKS records; every block starts with a
+ * header ('M' 'C' 'T' 'B', payload size, block number), and every record
+ * is the 64-bit big-endian STC of a chunk followed by the chunk itself.
+ * Blocks have a fixed size, so the offset of any chunk is known.
+ *****************************************************************************/
+#define CT_HEADER_SIZE 16
+#define CT_BLOCK_CHUNKS 256
+#define PSZ_CT_EXT "mct"
+
+static inline size_t ct_get_record_size(size_t i_payload_size)
+{
+    return sizeof(uint64_t) + i_payload_size;
+}
+
+static inline off_t ct_get_block_size(size_t i_payload_size)
+{
+    return CT_HEADER_SIZE
+            + (off_t)CT_BLOCK_CHUNKS * ct_get_record_size(i_payload_size);
+}
+
+/* offset of a chunk, including the block header for the first chunk */
+static inline off_t ct_get_offset(off_t i_chunk, size_t i_payload_size)
+{
+    off_t i_record = i_chunk % CT_BLOCK_CHUNKS;
+    return (i_chunk / CT_BLOCK_CHUNKS) * ct_get_block_size(i_payload_size)
+            + (i_record ? CT_HEADER_SIZE
+                           + i_record * ct_get_record_size(i_payload_size) : 0);
+}
+
+/* offset of the STC of a chunk */
+static inline off_t ct_get_stc_offset(off_t i_chunk, size_t i_payload_size)
+{
+    return ct_get_offset(i_chunk, i_payload_size)
+            + (i_chunk % CT_BLOCK_CHUNKS ? 0 : CT_HEADER_SIZE);
+}
+
+/* number of complete chunks in a file of the given size */
+static inline off_t ct_get_chunks(off_t i_size, size_t i_payload_size)
+{
+    off_t i_block_size = ct_get_block_size(i_payload_size);
+    off_t i_rest = i_size % i_block_size;
+    return (i_size / i_block_size) * CT_BLOCK_CHUNKS
+            + (i_rest > CT_HEADER_SIZE ? (i_rest - CT_HEADER_SIZE)
+                                    / ct_get_record_size(i_payload_size) : 0);
+}
+
+static inline void ct_set_header(uint8_t *p_ct, size_t i_payload_size,
+                                 uint64_t i_block)
+{
+    p_ct[0] = 'M';
+    p_ct[1] = 'C';
+    p_ct[2] = 'T';
+    p_ct[3] = 'B';
+    p_ct[4] = i_payload_size >> 24;
+    p_ct[5] = (i_payload_size >> 16) & 0xff;
+    p_ct[6] = (i_payload_size >> 8) & 0xff;
+    p_ct[7] = i_payload_size & 0xff;
+    ToSTC(p_ct + 8, i_block);
+}
+
+static inline bool ct_check_header(const uint8_t *p_ct)
+{
+    return p_ct[0] == 'M' && p_ct[1] == 'C' && p_ct[2] == 'T' &&
+           p_ct[3] == 'B';
+}
+
+static inline size_t ct_get_payload_size(const uint8_t *p_ct)
+{
+    return ((size_t)p_ct[4] << 24) | ((size_t)p_ct[5] << 16) |
+           ((size_t)p_ct[6] << 8) | p_ct[7];
+}
+
 /*****************************************************************************
  * Retx helpers - biTStream style
  *****************************************************************************/